@@ -0,0 +1,523 @@
+/*
+ * Microbenchmarks for the variants in branch_test.c, branch_test2.c and
+ * branch_test3.c: name_len1 vs name_len2, open_ctl_socket1 vs
+ * open_ctl_socket2 and hello1 vs hello2.
+ *
+ * Each pair is warmed up, then run in alternating order a number of times.
+ * Every run is timed and, where the kernel lets us, counted with
+ * perf_event_open (cycles, instructions, branch misses, user space only).
+ * The inputs are random so that the branch predictor cannot learn them.
+ * For each pair the report gives the median, mean and standard deviation
+ * per call, and Welch's t-test on the difference of the means.
+ *
+ * usage: bench_branch [-n calls] [-r runs] [-s seed] [-w warmups] [pair ...]
+ */
+
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <time.h>
+
+/* branch_test2.c is BSD code. */
+#ifndef INFTIM
+#define INFTIM (-1)
+#endif
+
+#if defined(__GLIBC__) && !__GLIBC_PREREQ(2, 38)
+#include <stddef.h>
+
+static size_t
+strlcpy(char *dst, const char *src, size_t size)
+{
+	size_t len = strlen(src);
+
+	if (size > 0) {
+		size_t n = len < size - 1 ? len : size - 1;
+		memcpy(dst, src, n);
+		dst[n] = '\0';
+	}
+	return len;
+}
+#endif
+
+#define main branch_test_main
+#include "branch_test.c"
+#undef main
+#define main branch_test2_main
+#include "branch_test2.c"
+#undef main
+#define main branch_test3_main
+#include "branch_test3.c"
+#undef main
+
+#define NINPUTS 4096	/* random inputs per pair, a power of two */
+#define MAXRUNS 1000
+
+enum { CYCLES, INSTRUCTIONS, BRANCH_MISSES, NCOUNTERS };
+
+static const char *counter_names[NCOUNTERS] = {
+	"cycles", "instructions", "branch-misses"
+};
+
+static int counter_fds[NCOUNTERS] = { -1, -1, -1 };
+
+struct sample {
+	double	ns;
+	double	count[NCOUNTERS];
+};
+
+struct pair {
+	const char	*name;
+	const char	*variant[2];
+	long		 calls;		/* default calls per run */
+	void		(*setup)(void);
+	void		(*teardown)(void);
+	unsigned long	(*run[2])(long);
+};
+
+static uint64_t rng_state;
+
+static uint64_t
+rng(void)
+{
+	/* xorshift64* */
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 2685821657736338717ULL;
+}
+
+/*
+ * name_len: random wire names of 1 to 6 labels of 1 to 20 bytes, visited
+ * in random order.
+ */
+
+static unsigned char	 names[NINPUTS * 128];
+static const unsigned char *name_ptrs[NINPUTS];
+
+static void
+names_setup(void)
+{
+	unsigned char *p = names;
+	int i, j, k, labels, len;
+
+	for (i = 0; i < NINPUTS; i++) {
+		name_ptrs[i] = p;
+		labels = 1 + rng() % 6;
+		for (j = 0; j < labels; j++) {
+			len = 1 + rng() % 20;
+			*p++ = len;
+			for (k = 0; k < len; k++)
+				*p++ = 'a' + rng() % 26;
+		}
+		*p++ = 0;
+	}
+	for (i = NINPUTS - 1; i > 0; i--) {
+		const unsigned char *t;
+
+		j = rng() % (i + 1);
+		t = name_ptrs[i];
+		name_ptrs[i] = name_ptrs[j];
+		name_ptrs[j] = t;
+	}
+}
+
+static unsigned long
+run_name_len1(long calls)
+{
+	unsigned long sum = 0;
+	long i;
+
+	for (i = 0; i < calls; i++)
+		sum += name_len1(name_ptrs[i & (NINPUTS - 1)]);
+	return sum;
+}
+
+static unsigned long
+run_name_len2(long calls)
+{
+	unsigned long sum = 0;
+	long i;
+
+	for (i = 0; i < calls; i++)
+		sum += name_len2(name_ptrs[i & (NINPUTS - 1)]);
+	return sum;
+}
+
+/*
+ * ctl_socket: both versions succeed every time, so this measures the
+ * system calls and the layout of the success path.
+ */
+
+static char ctl_path[64];
+
+static void
+ctl_setup(void)
+{
+	snprintf(ctl_path, sizeof(ctl_path), "/tmp/bench_branch.%d", (int)getpid());
+}
+
+static void
+ctl_teardown(void)
+{
+	unlink(ctl_path);
+}
+
+static unsigned long
+run_ctl_socket1(long calls)
+{
+	unsigned long sum = 0;
+	long i;
+	int s;
+
+	for (i = 0; i < calls; i++) {
+		s = open_ctl_socket1(ctl_path);
+		sum += s;
+		close(s);
+	}
+	return sum;
+}
+
+static unsigned long
+run_ctl_socket2(long calls)
+{
+	unsigned long sum = 0;
+	long i;
+	int s;
+
+	for (i = 0; i < calls; i++) {
+		s = open_ctl_socket2(ctl_path);
+		sum += s;
+		close(s);
+	}
+	return sum;
+}
+
+/*
+ * hello: argc is 1 or 2 at random, so half of the calls print.  Output
+ * goes to /dev/null while the pair runs.
+ */
+
+static int	 hello_argc[NINPUTS];
+static char	*hello_argv[] = { "hello", "world", NULL };
+static int	 saved_stdout = -1;
+
+static void
+hello_setup(void)
+{
+	int i, fd;
+
+	for (i = 0; i < NINPUTS; i++)
+		hello_argc[i] = 1 + rng() % 2;
+
+	fflush(stdout);
+	if ((saved_stdout = dup(STDOUT_FILENO)) == -1)
+		err(1, "dup");
+	if ((fd = open("/dev/null", O_WRONLY)) == -1)
+		err(1, "/dev/null");
+	if (dup2(fd, STDOUT_FILENO) == -1)
+		err(1, "dup2");
+	close(fd);
+}
+
+static void
+hello_teardown(void)
+{
+	fflush(stdout);
+	if (dup2(saved_stdout, STDOUT_FILENO) == -1)
+		err(1, "dup2");
+	close(saved_stdout);
+}
+
+static unsigned long
+run_hello1(long calls)
+{
+	long i;
+
+	for (i = 0; i < calls; i++)
+		hello1(hello_argc[i & (NINPUTS - 1)], hello_argv);
+	return 0;
+}
+
+static unsigned long
+run_hello2(long calls)
+{
+	unsigned long sum = 0;
+	long i;
+
+	for (i = 0; i < calls; i++)
+		sum += hello2(hello_argc[i & (NINPUTS - 1)], hello_argv);
+	return sum;
+}
+
+static struct pair pairs[] = {
+	{ "name_len", { "name_len1", "name_len2" }, 1L << 20,
+	    names_setup, NULL, { run_name_len1, run_name_len2 } },
+	{ "ctl_socket", { "open_ctl_socket1", "open_ctl_socket2" }, 2000,
+	    ctl_setup, ctl_teardown, { run_ctl_socket1, run_ctl_socket2 } },
+	{ "hello", { "hello1", "hello2" }, 1L << 18,
+	    hello_setup, hello_teardown, { run_hello1, run_hello2 } },
+};
+
+#define NPAIRS (sizeof(pairs) / sizeof(pairs[0]))
+
+/*
+ * Counters.  Each one is opened on its own, so that a kernel or a virtual
+ * machine without, say, branch miss counting still gives the others.
+ */
+
+static void
+counters_open(void)
+{
+	static const uint64_t config[NCOUNTERS] = {
+		PERF_COUNT_HW_CPU_CYCLES,
+		PERF_COUNT_HW_INSTRUCTIONS,
+		PERF_COUNT_HW_BRANCH_MISSES,
+	};
+	struct perf_event_attr attr;
+	int i;
+
+	for (i = 0; i < NCOUNTERS; i++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = config[i];
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		counter_fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		if (counter_fds[i] == -1)
+			fprintf(stderr, "bench_branch: %s: %s\n", counter_names[i],
+			    strerror(errno));
+	}
+}
+
+static void
+counters_start(void)
+{
+	int i;
+
+	for (i = 0; i < NCOUNTERS; i++) {
+		if (counter_fds[i] == -1)
+			continue;
+		ioctl(counter_fds[i], PERF_EVENT_IOC_RESET, 0);
+		ioctl(counter_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+	}
+}
+
+static void
+counters_stop(struct sample *s, long calls)
+{
+	uint64_t v;
+	int i;
+
+	for (i = 0; i < NCOUNTERS; i++) {
+		s->count[i] = NAN;
+		if (counter_fds[i] == -1)
+			continue;
+		ioctl(counter_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+		if (read(counter_fds[i], &v, sizeof(v)) == sizeof(v))
+			s->count[i] = (double)v / calls;
+	}
+}
+
+static double
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static volatile unsigned long sink;
+
+static void
+measure(unsigned long (*run)(long), long calls, struct sample *s)
+{
+	double t0;
+
+	counters_start();
+	t0 = now_ns();
+	sink += run(calls);
+	s->ns = (now_ns() - t0) / calls;
+	counters_stop(s, calls);
+}
+
+/*
+ * Statistics.
+ */
+
+struct stats {
+	double	median, mean, sd;
+};
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+stats(const double *v, int n, struct stats *st)
+{
+	double sorted[MAXRUNS], sum = 0, sq = 0;
+	int i;
+
+	memcpy(sorted, v, n * sizeof(v[0]));
+	qsort(sorted, n, sizeof(sorted[0]), cmp_double);
+	st->median = n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+	for (i = 0; i < n; i++)
+		sum += v[i];
+	st->mean = sum / n;
+	for (i = 0; i < n; i++)
+		sq += (v[i] - st->mean) * (v[i] - st->mean);
+	st->sd = n > 1 ? sqrt(sq / (n - 1)) : 0;
+}
+
+/* Two-sided 5% critical values of Student's t for 1 to 30 degrees of freedom. */
+static const double t_crit[30] = {
+	12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+	2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+	2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+};
+
+static void
+report(const char *metric, const struct pair *p, double *v[2], int n)
+{
+	struct stats st[2];
+	double se, t, df, va, vb, crit;
+	int i;
+
+	if (isnan(v[0][0]))
+		return;
+	for (i = 0; i < 2; i++) {
+		stats(v[i], n, &st[i]);
+		printf("  %-14s %-18s median %10.2f  mean %10.2f  sd %8.2f\n",
+		    metric, p->variant[i], st[i].median, st[i].mean, st[i].sd);
+	}
+
+	/* Welch's t-test, with the Welch-Satterthwaite degrees of freedom. */
+	va = st[0].sd * st[0].sd / n;
+	vb = st[1].sd * st[1].sd / n;
+	se = sqrt(va + vb);
+	if (se == 0) {
+		printf("  %-14s no variance, %s\n", metric,
+		    st[0].mean == st[1].mean ? "same" : "different");
+		return;
+	}
+	t = (st[1].mean - st[0].mean) / se;
+	df = (va + vb) * (va + vb) / (va * va / (n - 1) + vb * vb / (n - 1));
+	crit = df < 1 ? t_crit[0] : df <= 30 ? t_crit[(int)df - 1] : 1.960;
+	printf("  %-14s %s - %s: %+.2f", metric, p->variant[1], p->variant[0],
+	    st[1].mean - st[0].mean);
+	if (st[0].mean != 0)
+		printf(" (%+.1f%%)", 100 * (st[1].mean - st[0].mean) / st[0].mean);
+	printf(", t = %.2f, df = %.1f: %s\n", t, df,
+	    fabs(t) > crit ? "significant at 5%" : "not significant");
+}
+
+static void
+bench(const struct pair *p, long calls, int runs, int warmups)
+{
+	static struct sample samples[2][MAXRUNS];
+	double ns[2][MAXRUNS], count[2][MAXRUNS], *v[2] = { ns[0], ns[1] };
+	int r, i, c, first;
+
+	if (p->setup != NULL)
+		p->setup();
+	for (r = 0; r < warmups; r++)
+		for (i = 0; i < 2; i++)
+			measure(p->run[i], calls, &samples[i][0]);
+	for (r = 0; r < runs; r++) {
+		/* Alternate the order so that drift hits both alike. */
+		first = r % 2;
+		measure(p->run[first], calls, &samples[first][r]);
+		measure(p->run[!first], calls, &samples[!first][r]);
+	}
+	if (p->teardown != NULL)
+		p->teardown();
+
+	printf("%s: %d runs of %ld calls, %d warm-up runs\n", p->name, runs, calls,
+	    warmups);
+	for (i = 0; i < 2; i++)
+		for (r = 0; r < runs; r++)
+			ns[i][r] = samples[i][r].ns;
+	report("ns/call", p, v, runs);
+	for (c = 0; c < NCOUNTERS; c++) {
+		for (i = 0; i < 2; i++) {
+			v[i] = count[i];
+			for (r = 0; r < runs; r++)
+				count[i][r] = samples[i][r].count[c];
+		}
+		report(counter_names[c], p, v, runs);
+	}
+}
+
+static void
+usage(void)
+{
+	size_t i;
+
+	fprintf(stderr, "usage: bench_branch [-n calls] [-r runs] [-s seed] [-w warmups] [pair ...]\n"
+	    "pairs:");
+	for (i = 0; i < NPAIRS; i++)
+		fprintf(stderr, " %s", pairs[i].name);
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	long calls = 0;
+	int runs = 30, warmups = 3, ch, i, ran = 0;
+	size_t j;
+
+	rng_state = 88172645463325252ULL;
+	while ((ch = getopt(argc, argv, "n:r:s:w:")) != -1) {
+		switch (ch) {
+		case 'n':
+			calls = atol(optarg);
+			break;
+		case 'r':
+			runs = atoi(optarg);
+			break;
+		case 's':
+			rng_state = strtoull(optarg, NULL, 0) | 1;
+			break;
+		case 'w':
+			warmups = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (calls < 0 || runs < 2 || runs > MAXRUNS || warmups < 0)
+		usage();
+
+	counters_open();
+	for (j = 0; j < NPAIRS; j++) {
+		int want = argc == 0;
+
+		for (i = 0; i < argc; i++)
+			want |= !strcmp(argv[i], pairs[j].name);
+		if (!want)
+			continue;
+		if (ran++)
+			printf("\n");
+		bench(&pairs[j], calls ? calls : pairs[j].calls, runs, warmups);
+	}
+	if (!ran)
+		usage();
+	return 0;
+}
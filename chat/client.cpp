@@ -93,9 +93,9 @@ static void client(const std::string &ipstr, int port, const std::string &userna
 
         if (pfds[0].revents & POLLIN) {
             rbufs[0].read(STDIN_FILENO);
-            if (rbufs[0]) {
-                const std::string msg(rbufs[0].str());
-                auto nwrote = write(pfds[1].fd, msg.c_str(), msg.size());
+            while (rbufs[0].hasmsg()) {
+                std::string_view msg(rbufs[0].popmsg());
+                auto nwrote = write(pfds[1].fd, msg.data(), msg.size());
                 if (nwrote == -1)
                     err(1, "write");
                 nwrote = write(pfds[1].fd, "\n", 1);
@@ -105,10 +105,8 @@ static void client(const std::string &ipstr, int port, const std::string &userna
         }
         if (pfds[1].revents & POLLIN) {
             rbufs[1].read(pfds[1].fd);
-            if (rbufs[1]) {
-                const std::string msg(rbufs[1].str());
-                std::cout << msg << std::endl;
-            }
+            while (rbufs[1].hasmsg())
+                std::cout << rbufs[1].popmsg() << std::endl;
         }
     }
 }
@@ -0,0 +1,349 @@
+#ifndef JSONTOK_HPP
+#define JSONTOK_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+// Pull tokenizer for JSON text held in memory, e.g. a message still sitting
+// in a recvbuf.  It never allocates: strings are returned as views of their
+// raw, still escaped contents and numbers as views of their digits.
+//
+// Tokens are checked for well-formedness and brackets for balance, but the
+// placement of commas and colons is left to the caller.
+class jsontok {
+    public:
+        enum token {
+            END,
+            ERROR,
+            OBJECT_BEGIN,
+            OBJECT_END,
+            ARRAY_BEGIN,
+            ARRAY_END,
+            COLON,
+            COMMA,
+            STRING,
+            NUMBER,
+            LIT_TRUE,
+            LIT_FALSE,
+            LIT_NULL,
+        };
+
+        static const unsigned max_depth = 64;
+
+        jsontok(std::string_view text) :
+            p(text.data()),
+            end(text.data() + text.size()),
+            depth(0),
+            nesting(0),
+            has_escapes(false)
+        {
+        }
+
+        token next() {
+            const char *q = p;
+            while (q < end && (*q == ' ' || *q == '\t' || *q == '\n' || *q == '\r'))
+                ++q;
+            if (q == end) {
+                p = q;
+                return depth == 0 ? END : ERROR;
+            }
+
+            const char *start = q;
+            p = q + 1;
+            switch (*start) {
+            case '{':
+                return open(OBJECT_BEGIN, 1);
+            case '[':
+                return open(ARRAY_BEGIN, 0);
+            case '}':
+                return close(OBJECT_END, 1);
+            case ']':
+                return close(ARRAY_END, 0);
+            case ':':
+                return COLON;
+            case ',':
+                return COMMA;
+            case '"':
+                return string();
+            case 't':
+                return literal(start, "true", LIT_TRUE);
+            case 'f':
+                return literal(start, "false", LIT_FALSE);
+            case 'n':
+                return literal(start, "null", LIT_NULL);
+            default:
+                p = start;
+                return number();
+            }
+        }
+
+        // Raw text of the last STRING (without quotes) or NUMBER token.
+        std::string_view text() const {
+            return tok;
+        }
+
+        // True if the last STRING token contains backslash escapes and has
+        // to go through unescape() before it can be compared.
+        bool escaped() const {
+            return has_escapes;
+        }
+
+        // Skips the value whose first token is t.  Returns false if the
+        // value is malformed.
+        bool skip(token t) {
+            if (t != OBJECT_BEGIN && t != ARRAY_BEGIN)
+                return t == STRING || t == NUMBER || t == LIT_TRUE || t == LIT_FALSE || t == LIT_NULL;
+            unsigned d = depth - 1;
+            while (depth > d) {
+                t = next();
+                if (t == ERROR || t == END)
+                    return false;
+            }
+            return true;
+        }
+
+        // Appends the decoded form of a raw string token to out.  Returns
+        // false on an invalid escape sequence.
+        static bool unescape(std::string_view raw, std::string &out) {
+            for (size_t i = 0; i < raw.size(); ++i) {
+                char c = raw[i];
+                if (c != '\\') {
+                    out += c;
+                    continue;
+                }
+                if (++i == raw.size())
+                    return false;
+                switch (raw[i]) {
+                case '"': out += '"'; break;
+                case '\\': out += '\\'; break;
+                case '/': out += '/'; break;
+                case 'b': out += '\b'; break;
+                case 'f': out += '\f'; break;
+                case 'n': out += '\n'; break;
+                case 'r': out += '\r'; break;
+                case 't': out += '\t'; break;
+                case 'u': {
+                    uint32_t cp;
+                    if (!hex4(raw, i + 1, cp))
+                        return false;
+                    i += 4;
+                    if (cp >= 0xd800 && cp < 0xdc00) {
+                        uint32_t lo;
+                        if (i + 2 >= raw.size() || raw[i + 1] != '\\' || raw[i + 2] != 'u'
+                            || !hex4(raw, i + 3, lo) || lo < 0xdc00 || lo > 0xdfff)
+                            return false;
+                        i += 6;
+                        cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                    }
+                    utf8(cp, out);
+                    break;
+                }
+                default:
+                    return false;
+                }
+            }
+            return true;
+        }
+
+    private:
+        const char          *p;
+        const char          *end;
+        unsigned             depth;
+        uint64_t             nesting;   // bit per level, set for objects
+        bool                 has_escapes;
+        std::string_view     tok;
+
+        token open(token t, uint64_t is_object) {
+            if (depth == max_depth)
+                return ERROR;
+            nesting = (nesting << 1) | is_object;
+            ++depth;
+            return t;
+        }
+
+        token close(token t, uint64_t is_object) {
+            if (depth == 0 || (nesting & 1) != is_object)
+                return ERROR;
+            nesting >>= 1;
+            --depth;
+            return t;
+        }
+
+        // Works on a local cursor: stores through char pointers may alias
+        // the members, which would otherwise be reloaded on every byte.
+        token string() {
+            const char *start = p, *q = p, *e = end;
+            bool esc = false;
+            for ( ;; ) {
+                while (q < e && !special((unsigned char) *q))
+                    ++q;
+                if (q == e)
+                    return ERROR;
+                unsigned char c = *q;
+                if (c == '"') {
+                    tok = std::string_view(start, q - start);
+                    has_escapes = esc;
+                    p = q + 1;
+                    return STRING;
+                } else if (c == '\\') {
+                    esc = true;
+                    if (e - q < 2)
+                        return ERROR;
+                    if (q[1] == 'u') {
+                        if (e - q < 6)
+                            return ERROR;
+                        for (int i = 2; i < 6; ++i)
+                            if (!is_hex((unsigned char) q[i]))
+                                return ERROR;
+                        q += 6;
+                    } else if (q[1] != '\0' && strchr("\"\\/bfnrt", q[1]) != nullptr) {
+                        q += 2;
+                    } else {
+                        return ERROR;
+                    }
+                } else {
+                    return ERROR;   // unescaped control character
+                }
+            }
+        }
+
+        // True for bytes that end a run of plain string characters.
+        static bool special(unsigned char c) {
+            return c == '"' || c == '\\' || c < 0x20;
+        }
+
+        token number() {
+            const char *start = p, *q = p, *e = end;
+            if (q < e && *q == '-')
+                ++q;
+            if (q < e && *q == '0')
+                ++q;
+            else if (!digits(q, e))
+                return ERROR;
+            if (q < e && *q == '.') {
+                ++q;
+                if (!digits(q, e))
+                    return ERROR;
+            }
+            if (q < e && (*q == 'e' || *q == 'E')) {
+                ++q;
+                if (q < e && (*q == '+' || *q == '-'))
+                    ++q;
+                if (!digits(q, e))
+                    return ERROR;
+            }
+            tok = std::string_view(start, q - start);
+            p = q;
+            return NUMBER;
+        }
+
+        static bool digits(const char *&q, const char *e) {
+            const char *start = q;
+            while (q < e && *q >= '0' && *q <= '9')
+                ++q;
+            return q != start;
+        }
+
+        token literal(const char *start, const char *word, token t) {
+            size_t len = strlen(word);
+            if ((size_t) (end - start) < len || memcmp(start, word, len) != 0)
+                return ERROR;
+            p = start + len;
+            return t;
+        }
+
+        static bool is_hex(unsigned char c) {
+            return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+        }
+
+        static bool hex4(std::string_view s, size_t pos, uint32_t &v) {
+            if (pos + 4 > s.size())
+                return false;
+            v = 0;
+            for (size_t i = pos; i < pos + 4; ++i) {
+                unsigned char c = s[i];
+                v <<= 4;
+                if (c >= '0' && c <= '9')
+                    v |= c - '0';
+                else if (c >= 'a' && c <= 'f')
+                    v |= c - 'a' + 10;
+                else if (c >= 'A' && c <= 'F')
+                    v |= c - 'A' + 10;
+                else
+                    return false;
+            }
+            return true;
+        }
+
+        static void utf8(uint32_t cp, std::string &out) {
+            if (cp < 0x80) {
+                out += (char) cp;
+            } else if (cp < 0x800) {
+                out += (char) (0xc0 | (cp >> 6));
+                out += (char) (0x80 | (cp & 0x3f));
+            } else if (cp < 0x10000) {
+                out += (char) (0xe0 | (cp >> 12));
+                out += (char) (0x80 | ((cp >> 6) & 0x3f));
+                out += (char) (0x80 | (cp & 0x3f));
+            } else {
+                out += (char) (0xf0 | (cp >> 18));
+                out += (char) (0x80 | ((cp >> 12) & 0x3f));
+                out += (char) (0x80 | ((cp >> 6) & 0x3f));
+                out += (char) (0x80 | (cp & 0x3f));
+            }
+        }
+};
+
+// Looks up the string member key of the top-level object in text without
+// building a DOM.  On success value refers either into text or, if the
+// string had to be unescaped, into scratch.  Members after key are not
+// examined.
+inline bool
+json_get_string(std::string_view text, std::string_view key, std::string &scratch,
+    std::string_view &value)
+{
+    jsontok tok(text);
+    jsontok::token t;
+
+    if (tok.next() != jsontok::OBJECT_BEGIN)
+        return false;
+    t = tok.next();
+    if (t == jsontok::OBJECT_END)
+        return false;
+    for ( ;; ) {
+        if (t != jsontok::STRING)
+            return false;
+        bool match;
+        if (tok.escaped()) {
+            scratch.clear();
+            if (!jsontok::unescape(tok.text(), scratch))
+                return false;
+            match = scratch == key;
+        } else {
+            match = tok.text() == key;
+        }
+        if (tok.next() != jsontok::COLON)
+            return false;
+        t = tok.next();
+        if (match) {
+            if (t != jsontok::STRING)
+                return false;
+            if (!tok.escaped()) {
+                value = tok.text();
+                return true;
+            }
+            scratch.clear();
+            if (!jsontok::unescape(tok.text(), scratch))
+                return false;
+            value = scratch;
+            return true;
+        }
+        if (!tok.skip(t) || tok.next() != jsontok::COMMA)
+            return false;
+        t = tok.next();
+    }
+}
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef MPSC_HPP
+#define MPSC_HPP
+
+#include <atomic>
+#include <utility>
+
+// Unbounded lock-free multi-producer single-consumer queue (Vyukov).
+//
+// push() may be called from any thread; it is wait-free apart from the node
+// allocation.  pop() must only be called by the owning thread.  A pop() that
+// races with an unfinished push() may report the queue empty even though
+// the push has already been linearized, so producers should wake the
+// consumer only after push() returns.
+template<typename T>
+class mpsc {
+    public:
+        mpsc() :
+            head(new node()),
+            tail(head.load(std::memory_order_relaxed))
+        {
+        }
+
+        mpsc(const mpsc &) = delete;
+        mpsc &operator=(const mpsc &) = delete;
+
+        ~mpsc() {
+            T v;
+            while (pop(v))
+                ;
+            delete tail;
+        }
+
+        void push(T v) {
+            node *n = new node(std::move(v));
+            node *prev = head.exchange(n, std::memory_order_acq_rel);
+            prev->next.store(n, std::memory_order_release);
+        }
+
+        bool pop(T &v) {
+            node *t = tail;
+            node *next = t->next.load(std::memory_order_acquire);
+            if (next == nullptr)
+                return false;
+            v = std::move(next->value);
+            tail = next;
+            delete t;
+            return true;
+        }
+
+    private:
+        struct node {
+            std::atomic<node *>     next;
+            T                       value;
+
+            node() :
+                next(nullptr)
+            {
+            }
+
+            explicit node(T &&v) :
+                next(nullptr),
+                value(std::move(v))
+            {
+            }
+        };
+
+        alignas(64) std::atomic<node *>     head;   // producers
+        alignas(64) node                   *tail;   // consumer
+};
+
+#endif
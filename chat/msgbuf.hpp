@@ -0,0 +1,113 @@
+#ifndef MSGBUF_HPP
+#define MSGBUF_HPP
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string_view>
+#include <utility>
+
+#include "recvbuf.hpp"
+
+// Immutable, reference-counted wire image of a chat message.
+//
+// A message is serialized once, newline or frame header included, and
+// every recipient's wbuf holds a msgbuf referring to the same bytes, so
+// broadcasting to N clients costs one copy of the message rather than N.
+// The count is atomic so references may be handed to other threads.
+class msgbuf {
+    public:
+        msgbuf() :
+            rep(nullptr)
+        {
+        }
+
+        // Copies payload into a new buffer and terminates it with marker.
+        static msgbuf make(std::string_view payload, char marker = '\n') {
+            msgbuf m(alloc(payload.size() + 1));
+            memcpy(m.rep->bytes(), payload.data(), payload.size());
+            m.rep->bytes()[payload.size()] = marker;
+            return m;
+        }
+
+        // Copies payload into a new buffer behind a recvbuf LENGTH frame
+        // header.
+        static msgbuf makeframe(std::string_view payload) {
+            msgbuf m(alloc(recvbuf::hdrsize + payload.size()));
+            recvbuf::putheader(m.rep->bytes(), payload.size());
+            memcpy(m.rep->bytes() + recvbuf::hdrsize, payload.data(), payload.size());
+            return m;
+        }
+
+        msgbuf(const msgbuf &other) :
+            rep(other.rep)
+        {
+            if (rep != nullptr)
+                rep->refs.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        msgbuf(msgbuf &&other) noexcept :
+            rep(other.rep)
+        {
+            other.rep = nullptr;
+        }
+
+        msgbuf &operator=(msgbuf other) noexcept {
+            std::swap(rep, other.rep);
+            return *this;
+        }
+
+        ~msgbuf() {
+            if (rep != nullptr && rep->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                rep->~header();
+                free(rep);
+            }
+        }
+
+        const char *data() const {
+            return rep->bytes();
+        }
+
+        size_t size() const {
+            return rep->size;
+        }
+
+        explicit operator bool() const {
+            return rep != nullptr;
+        }
+
+        // Number of msgbufs sharing these bytes.
+        long refs() const {
+            return rep == nullptr ? 0 : rep->refs.load(std::memory_order_relaxed);
+        }
+
+    private:
+        struct header {
+            std::atomic<long>   refs;
+            size_t              size;
+
+            char *bytes() {
+                return reinterpret_cast<char *>(this + 1);
+            }
+        };
+
+        header *rep;
+
+        explicit msgbuf(header *rep) :
+            rep(rep)
+        {
+        }
+
+        static header *alloc(size_t size) {
+            void *p = malloc(sizeof(header) + size);
+            if (p == nullptr)
+                throw std::bad_alloc();
+            header *h = new (p) header;
+            h->refs.store(1, std::memory_order_relaxed);
+            h->size = size;
+            return h;
+        }
+};
+
+#endif
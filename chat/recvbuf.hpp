@@ -1,47 +1,99 @@
 #ifndef RECVBUF_HPP
 #define RECVBUF_HPP
 
+#include <cerrno>
+#include <cstdint>
 #include <cstring>
 #include <cstdlib>
 #include <iostream>
+#include <new>
 #include <string>
+#include <string_view>
 #include <stdexcept>
 
 #include <unistd.h>
 
+// Splits a byte stream into marker-terminated messages or, once switched to
+// LENGTH framing, into frames made of a 4-byte big-endian payload length
+// followed by the payload.  Frames may carry arbitrary bytes and are found
+// from their header alone, without scanning the payload.
+//
+// Unconsumed data lives in buf[rpos, wpos).  popmsg() only advances rpos and
+// returns a view into buf, so draining a burst of messages is linear in the
+// number of bytes received.  Data is moved to the front of buf only when
+// read() runs out of room at the tail, and buf never shrinks.
 class recvbuf {
     public:
+        enum framing {
+            MARKER,
+            LENGTH,
+        };
+
+        static const size_t hdrsize = 4;
+        static const size_t maxframe = 16 << 20;
+
+        // Sent by a client as its very first byte to ask for LENGTH framing
+        // and echoed by the server at the point its output switches over.
+        static const char framinghello = '\0';
+
         recvbuf(char marker = '\n') :
             buf(nullptr),
             markerfound(false),
+            closed(false),
             bufsize(0),
             markerpos(0),
-            readpos(0),
+            scanpos(0),
+            rpos(0),
+            wpos(0),
+            mode(MARKER),
             marker(marker)
         {
         }
 
+        recvbuf(const recvbuf &) = delete;
+        recvbuf &operator=(const recvbuf &) = delete;
+
+        recvbuf(recvbuf &&other) noexcept :
+            recvbuf(other.marker)
+        {
+            swap(other);
+        }
+
+        recvbuf &operator=(recvbuf &&other) noexcept {
+            swap(other);
+            return *this;
+        }
+
         ~recvbuf() {
             free(buf);
         }
 
+        // Reads from fd until it would block or the peer closes the
+        // connection.  Invalidates views previously returned by popmsg().
+        // Throws std::runtime_error if a frame longer than maxframe is
+        // announced.
         size_t read(int fd) {
             size_t sum = 0;
             for ( ;; ) {
-                if (readpos >= bufsize)
-                    grow();
+                if (mode == LENGTH)
+                    reserveframe();
+                if (wpos >= bufsize)
+                    makeroom();
 
-                size_t readsize = bufsize - readpos;
-                ssize_t nbytes = ::read(fd, buf + readpos, readsize);
+                size_t readsize = bufsize - wpos;
+                ssize_t nbytes = ::read(fd, buf + wpos, readsize);
                 if (nbytes == -1) {
-                    if (errno == EAGAIN)
+                    if (errno == EINTR)
+                        continue;
+                    else if (errno == EAGAIN || errno == EWOULDBLOCK)
                         break;
                     else
                         throw std::runtime_error("read(2) failed!");
+                } else if (nbytes == 0) {
+                    closed = true;
+                    break;
                 } else {
-                    if (!markerfound)
-                        markerfound = find(readpos, nbytes);
-                    readpos += nbytes;
+                    wpos += nbytes;
                     sum += (size_t) nbytes;
                     if ((size_t) nbytes < readsize)
                         break;
@@ -51,33 +103,122 @@ class recvbuf {
             return sum;
         }
 
+        // True once read() has seen end of file.
+        bool eof() const {
+            return closed;
+        }
+
         bool hasmsg() {
+            if (!markerfound) {
+                if (mode == LENGTH)
+                    markerfound = findframe();
+                else if (scanpos < wpos)
+                    markerfound = find(scanpos, wpos - scanpos);
+            }
             return markerfound;
         }
 
-        std::string popmsg() {
-            if (!markerfound)
-                return "";
-            std::string s(buf, buf + markerpos);
-            discard(markerpos);
-            if (readpos > 0)
-                markerfound = find(0, readpos - 1);
-            else
-                markerfound = false;
-            return s;
+        // Returns the next message without the marker or frame header.  The
+        // view stays valid until the next call to read().
+        std::string_view popmsg() {
+            if (!hasmsg())
+                return std::string_view();
+            size_t start = rpos + (mode == LENGTH ? hdrsize : 0);
+            std::string_view msg(buf + start, markerpos - start);
+            rpos = scanpos = markerpos + (mode == LENGTH ? 0 : 1);
+            markerfound = false;
+            if (rpos == wpos)
+                rpos = wpos = scanpos = 0;
+            return msg;
+        }
+
+        // Switches framing for the data not yet popped.
+        void setframing(framing f) {
+            mode = f;
+            markerfound = false;
+            scanpos = rpos;
+        }
+
+        framing getframing() const {
+            return mode;
+        }
+
+        // Data received but not yet popped, e.g. to look at a handshake.
+        std::string_view peek() const {
+            return std::string_view(buf + rpos, size());
+        }
+
+        void skip(size_t n) {
+            rpos += n < size() ? n : size();
+            scanpos = rpos > scanpos ? rpos : scanpos;
+            markerfound = false;
+            if (rpos == wpos)
+                rpos = wpos = scanpos = 0;
+        }
+
+        static void putheader(char *p, size_t len) {
+            p[0] = (char) (len >> 24);
+            p[1] = (char) (len >> 16);
+            p[2] = (char) (len >> 8);
+            p[3] = (char) len;
+        }
+
+        static size_t getheader(const char *p) {
+            const unsigned char *u = (const unsigned char *) p;
+            return (size_t) u[0] << 24 | (size_t) u[1] << 16 | (size_t) u[2] << 8 | u[3];
+        }
+
+        // Number of bytes received but not yet popped.
+        size_t size() const {
+            return wpos - rpos;
+        }
+
+        size_t capacity() const {
+            return bufsize;
         }
 
     private:
         char                *buf;
         bool                 markerfound;
+        bool                 closed;
         size_t               bufsize;
         size_t               markerpos;
-        size_t               readpos;
+        size_t               scanpos;
+        size_t               rpos;
+        size_t               wpos;
         static const size_t  growsize = 8192;
-        const char           marker;
+        framing              mode;
+        char                 marker;
 
-        void grow() {
-            resize(bufsize + growsize);
+        void swap(recvbuf &other) noexcept {
+            std::swap(buf, other.buf);
+            std::swap(markerfound, other.markerfound);
+            std::swap(closed, other.closed);
+            std::swap(bufsize, other.bufsize);
+            std::swap(markerpos, other.markerpos);
+            std::swap(scanpos, other.scanpos);
+            std::swap(rpos, other.rpos);
+            std::swap(wpos, other.wpos);
+            std::swap(mode, other.mode);
+            std::swap(marker, other.marker);
+        }
+
+        // Compacting only when at least half of buf is free keeps the
+        // memmove cost amortized O(1) per byte; otherwise double.
+        void makeroom() {
+            if (rpos > 0 && size() <= bufsize / 2)
+                compact();
+            else
+                resize(bufsize == 0 ? growsize : bufsize * 2);
+        }
+
+        void compact() {
+            memmove(buf, buf + rpos, wpos - rpos);
+            wpos -= rpos;
+            scanpos -= rpos;
+            if (markerfound)
+                markerpos -= rpos;
+            rpos = 0;
         }
 
         void resize(size_t size) {
@@ -88,18 +229,44 @@ class recvbuf {
             buf = p;
         }
 
-        void discard(size_t pos) {
-            memmove(buf, buf + pos + 1, readpos - pos - 1);
-            readpos -= (pos + 1);
-            resize((readpos / growsize + 1) * growsize);
+        // Once the header of the next frame is in, makes sure the whole
+        // frame fits behind rpos so that it arrives without further copies.
+        void reserveframe() {
+            if (size() < hdrsize)
+                return;
+            size_t need = hdrsize + getheader(buf + rpos);
+            if (need - hdrsize > maxframe)
+                throw std::runtime_error("frame too large");
+            if (bufsize - rpos >= need)
+                return;
+            if (rpos > 0)
+                compact();
+            if (bufsize < need) {
+                size_t size = bufsize;
+                while (size < need)
+                    size *= 2;
+                resize(size);
+            }
+        }
+
+        bool findframe() {
+            if (size() < hdrsize)
+                return false;
+            size_t end = rpos + hdrsize + getheader(buf + rpos);
+            if (end > wpos)
+                return false;
+            markerpos = end;
+            return true;
         }
 
         bool find(size_t start, size_t size) {
             char *p = (char *) memchr(buf + start, marker, size);
             if (p == nullptr) {
+                scanpos = start + size;
                 return false;
             } else {
                 markerpos = p - buf;
+                scanpos = markerpos;
                 return true;
             }
         }
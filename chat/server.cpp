@@ -3,8 +3,9 @@
 #include <cstring>
 #include <cstdarg>
 #include <iostream>
-#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <map>
 #include <algorithm>
@@ -16,7 +17,8 @@
 #include <netinet/ip.h>
 #include <err.h>
 
-#include <json.hpp>
+#include "jsontok.hpp"
+#include "recvbuf.hpp"
 
 #define DEFAULT_PORT    1234
 
@@ -76,9 +78,8 @@ echohostnamed(int port)
 {
     int                  s, conn;
     struct sockaddr_in   sa;
-    char buf[8192];
-    const size_t bufsize = sizeof(buf);
-    ssize_t n_bytes;
+    std::string          scratch;
+    std::string_view     request;
 
 
     dbgprintf("trying to listen on port %d\n", port);
@@ -110,31 +111,21 @@ echohostnamed(int port)
 
         dbgprintf("received connection\n");
 
-        std::ostringstream ostr("");
-        for ( ;; ) {
-            n_bytes = read(conn, buf, bufsize);
-            dbgprintf("read %d bytes\n", n_bytes);
-            if (n_bytes == -1) {
+        recvbuf rbuf;
+        while (!rbuf.eof()) {
+            try {
+                size_t n_bytes = rbuf.read(conn);
+                dbgprintf("read %zu bytes\n", n_bytes);
+            } catch (const std::runtime_error &e) {
                 warn("read");
-                close(conn);
                 break;
             }
-            if (n_bytes == 0) {
-                close(conn);
-                break;
-            }
-            char *p = (char *) memchr(buf, '\n', n_bytes);
-            if (p == NULL) {
-                ostr.write(buf, n_bytes);
-            } else {
-                ostr.write(buf, p - buf);
-                try {
-                    json::value val(json::parse(ostr.str()));
-                    dbgprintf("received json msg: %s\n", val.str().c_str());
-                } catch (const json::parse_error &e) {
-                    dbgprintf("received bogus json msg: %s\n", ostr.str().c_str());
-                }
-                ostr.str("");
+            while (rbuf.hasmsg()) {
+                std::string_view msg(rbuf.popmsg());
+                if (json_get_string(msg, "request", scratch, request))
+                    dbgprintf("received json request: %.*s\n", (int) request.size(), request.data());
+                else
+                    dbgprintf("received bogus json msg: %.*s\n", (int) msg.size(), msg.data());
             }
         }
 
@@ -1,57 +1,92 @@
 #include <algorithm>
+#include <atomic>
 #include <iostream>
 #include <sstream>
+#include <string>
+#include <thread>
 #include <vector>
-#include <map>
+
+#include <csignal>
 
 #include <unistd.h>
-#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/eventfd.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <err.h>
-#include <poll.h>
+#include <pthread.h>
 
 #include <json.hpp>
+#include "recvbuf.hpp"
+#include "msgbuf.hpp"
+#include "mpsc.hpp"
+#include "poller.hpp"
+#include "wbuf.hpp"
 
 static const int default_port = 1234;
-static const int default_poll_timeout = 1; // in milliseconds
 
-static void server(int);
+static bool verbose = false;
+static size_t highwater = wbuf::default_highwater;
+static bool dropslow = false;
+
+static void server(int, bool, int);
 
 int main(int argc, char **argv) {
     extern char    *optarg;
-    int             c, port = default_port;
+    int             c, port = default_port, nthreads = 1;
+    bool            useepoll = false;
 
-    while ((c = getopt(argc, argv, "p:")) != -1) {
+    while ((c = getopt(argc, argv, "DEp:t:vw:")) != -1) {
         switch (c) {
+        case 'D':
+            dropslow = true;
+            break;
+        case 'E':
+            useepoll = true;
+            break;
         case 'p':
             port = atoi(optarg);
             break;
+        case 't':
+            nthreads = atoi(optarg);
+            if (nthreads < 1)
+                errx(1, "invalid number of threads: %s", optarg);
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        case 'w':
+            highwater = strtoul(optarg, nullptr, 0);
+            break;
         default:
+            std::cerr << "usage: server3 [-DEv] [-p <port>] [-t <threads>] [-w <highwater>]" << std::endl
+                      << "  -D drops messages for clients with more than <highwater> bytes" << std::endl
+                      << "     queued instead of disconnecting them" << std::endl
+                      << "  -t runs <threads> shards, each with its own SO_REUSEPORT listener" << std::endl;
             return 1;
         }
     }
 
-    server(port);
+    server(port, useepoll, nthreads);
 
     return 0;
 }
 
-static void set_nonblock(int fd) {
-    if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1)
-        err(1, "fcntl");
-}
+// Asked for so that a storm of connects queues up rather than being
+// dropped; the kernel clamps it to net.core.somaxconn.
+static const int listen_backlog = 16384;
 
-static int listen_port(int port) {
+static int listen_port(int port, bool reuseport) {
     int                     s;
     struct sockaddr_in      sa;
+    int                     on = 1;
 
-    s = socket(AF_INET, SOCK_STREAM, 0);
+    s = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (s == -1)
         err(1, "socket");
-    //set_nonblock(s);
+    if (reuseport && setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1)
+        err(1, "setsockopt: SO_REUSEPORT");
 
     bzero(&sa, sizeof(sa));
     sa.sin_family = AF_INET;
@@ -59,91 +94,352 @@ static int listen_port(int port) {
     sa.sin_addr.s_addr = htonl(INADDR_ANY);
     if (bind(s, (struct sockaddr *) &sa, sizeof(sa)) == -1)
         err(1, "bind");
-    if (listen(s, 0) == -1)
+    if (listen(s, listen_backlog) == -1)
         err(1, "listen");
 
     return s;
 }
 
-static void repeat(int s, const std::string &msg, const std::vector<pollfd> &pfds) {
-    for (auto i = pfds.begin() + 1; i != pfds.end(); ++i) {
-        if (i->fd == s)
-            continue;
-        std::clog << "repeating msg to " << i->fd << std::endl;
-        auto nbytes = write(i->fd, msg.c_str(), msg.size());
-        std::clog << " wrote " << nbytes << std::endl;
-        nbytes = write(i->fd, "\n", 1);
+// Per-connection state, kept in a slab indexed by fd.
+struct conn {
+    bool            open = false;
+    bool            dead = false;
+    bool            writing = false;
+    bool            negotiated = false;
+    bool            framed = false; // speaks recvbuf LENGTH frames
+    size_t          slot = 0;       // index into hub::fds
+    recvbuf         rbuf;
+    wbuf            wb { highwater };
+};
+
+// Counter written by its shard only and read by the thread dumping stats.
+class counter {
+    public:
+        counter &operator+=(size_t n) {
+            v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+            return *this;
+        }
+
+        counter &operator++() {
+            return *this += 1;
+        }
+
+        operator size_t() const {
+            return v.load(std::memory_order_relaxed);
+        }
+
+    private:
+        std::atomic<size_t> v { 0 };
+};
+
+// Broadcast accounting, dumped to stderr on SIGUSR1.  bytescopied counts
+// what was serialized into msgbufs and bytesqueued what was handed to
+// recipients by reference; only the former should grow with message size.
+struct stats {
+    counter broadcasts;
+    counter deliveries;
+    counter bytescopied;
+    counter bytesqueued;
+    counter forwarded;
+    counter dropped;
+    counter disconnected;
+
+    void dump(std::ostream &os) const {
+        size_t n = broadcasts == 0 ? 1 : (size_t) broadcasts;
+        os << "broadcasts: " << broadcasts << std::endl
+           << "deliveries: " << deliveries << std::endl
+           << "bytes copied: " << bytescopied
+           << " (" << bytescopied / n << " per broadcast)" << std::endl
+           << "bytes queued: " << bytesqueued
+           << " (" << bytesqueued / n << " per broadcast)" << std::endl
+           << "forwarded to other shards: " << forwarded << std::endl
+           << "dropped: " << dropped << std::endl
+           << "disconnected: " << disconnected << std::endl;
     }
-}
+};
 
-static void server(int port) {
-    int                     s;
-    std::vector<pollfd>     pfds;
+class hub;
 
-    s = listen_port(port);
+// All shards, fixed before any of them starts running.
+static std::vector<std::unique_ptr<hub>> hubs;
 
-    pfds.push_back({ s, POLLIN });
+// Chat room: every message received from one client is repeated to all the
+// others.
+//
+// Each hub is a shard owning a listener, an event loop and the clients the
+// kernel handed to that listener.  A message is fanned out to the local
+// clients directly and to every other shard through that shard's lock-free
+// inbox; an eventfd wakes the receiving shard up.
+class hub {
+    public:
+        hub(size_t id, int s, bool useepoll) :
+            id(id),
+            s(s),
+            efd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+            p(makepoller(useepoll))
+        {
+            if (efd == -1)
+                err(1, "eventfd");
+            p->add(s, false);
+            p->add(efd, false);
+        }
 
-    for ( ;; ) {
-        auto npoll = poll(pfds.data(), pfds.size(), -1);
-
-        if (npoll == -1)
-            err(1, "poll");
-        else if (npoll == 0)
-            continue;
-
-        std::clog << "----" << std::endl
-                  << "npoll=" << npoll << std::endl
-                  << "pfds.size()=" << pfds.size() << std::endl;
-
-        for (auto &i : pfds) {
-            if (i.fd == s)
-                continue;
-
-            if (i.revents & POLLIN) {
-                recvbuf &rbuf = rbufs[i.fd];
-                if (rbuf.read(i.fd) == 0) { // Connection closed by remote host
-                    i.revents |= POLLHUP;
-                    close(i.fd);
-                    rbufs.erase(i.fd);
-                } else if (rbuf) {
-                    const std::string msg(rbuf.str());
-                    std::clog << "got message from " << i.fd << ": " << msg << std::endl;
-                    repeat(i.fd, msg, pfds);
+        void run() {
+            std::vector<pollev> evs;
+
+            std::clog << "shard " << id << " using " << p->name() << " backend" << std::endl;
+
+            for ( ;; ) {
+                p->wait(evs, -1);
+
+                for (const auto &ev : evs) {
+                    if (ev.fd == s)
+                        acceptconn();
+                    else if (ev.fd == efd)
+                        drain();
+                    else
+                        handle(ev);
+                }
+
+                reap();
+            }
+        }
+
+        // Hands m to this shard.  May be called from any thread.
+        void post(const msgbuf &m) {
+            inbox.push(m);
+            if (!signaled.exchange(true, std::memory_order_acq_rel)) {
+                uint64_t one = 1;
+                if (write(efd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+                    warn("write: eventfd");
+            }
+        }
+
+        const stats &getstats() const {
+            return st;
+        }
+
+    private:
+        size_t                      id;
+        int                         s;
+        int                         efd;
+        std::unique_ptr<poller>     p;
+        std::vector<conn>           conns;
+        std::vector<int>            fds;
+        std::vector<int>            dead;
+        mpsc<msgbuf>                inbox;
+        std::atomic<bool>           signaled { false };
+        stats                       st;
+
+        // Drains the whole backlog.  The listener is level-triggered, so
+        // if accepting stops early (e.g. out of descriptors) the next wait
+        // reports it again.
+        void acceptconn() {
+            for ( ;; ) {
+                int fd = accept4(s, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (fd == -1) {
+                    if (errno == EINTR || errno == ECONNABORTED)
+                        continue;
+                    if (errno != EAGAIN && errno != EWOULDBLOCK)
+                        warn("accept4");
+                    return;
+                }
+
+                if ((size_t) fd >= conns.size())
+                    conns.resize(fd + 1);
+                conn &c = conns[fd];
+                c.open = true;
+                c.slot = fds.size();
+                fds.push_back(fd);
+                p->add(fd);
+
+                if (verbose)
+                    std::clog << "shard " << id << " accepted new connection, fd=" << fd << std::endl;
+            }
+        }
+
+        void handle(const pollev &ev) {
+            conn &c = conns[ev.fd];
+            if (!c.open || c.dead)
+                return;
+
+            if (ev.out)
+                flush(ev.fd);
+
+            if (ev.in) {
+                try {
+                    c.rbuf.read(ev.fd);
+                } catch (const std::runtime_error &e) {
+                    warn("read: fd %d", ev.fd);
+                    kill(ev.fd);
+                    return;
                 }
-            } else if (i.revents != 0) {
-                std::clog << "closing fd " << i.fd << std::endl;
-                close(i.fd);
-                rbufs.erase(i.fd);
+                if (!c.negotiated)
+                    negotiate(ev.fd);
+                while (c.rbuf.hasmsg()) {
+                    std::string_view msg(c.rbuf.popmsg());
+                    if (verbose)
+                        std::clog << "got message from " << ev.fd << ": " << msg << std::endl;
+                    repeat(ev.fd, msg);
+                }
+                if (c.rbuf.eof())
+                    kill(ev.fd);
+            } else if (ev.hup) {
+                kill(ev.fd);
+            }
+        }
+
+        // The first byte a client sends decides its framing for good.  A
+        // client asking for LENGTH frames gets the hello byte back; lines
+        // queued for it before that are still sent as text.
+        void negotiate(int fd) {
+            conn &c = conns[fd];
+            std::string_view head(c.rbuf.peek());
+            if (head.empty())
+                return;
+            c.negotiated = true;
+            if (head[0] != recvbuf::framinghello)
+                return;
+            c.rbuf.skip(1);
+            c.rbuf.setframing(recvbuf::LENGTH);
+            c.framed = true;
+            if (!c.wb.push(msgbuf::make(std::string_view(), recvbuf::framinghello))) {
+                kill(fd);
+                return;
+            }
+            if (!c.writing)
+                flush(fd);
+            if (verbose)
+                std::clog << "fd " << fd << " switched to length-prefixed frames" << std::endl;
+        }
+
+        // Clears signaled before draining so that a post() racing with the
+        // drain rings the eventfd again rather than getting lost.  The
+        // exchange pairs with post()'s: a plain store could still sit in the
+        // store buffer while the pops below find the inbox empty.
+        void drain() {
+            uint64_t    n;
+            msgbuf      m;
+
+            if (read(efd, &n, sizeof(n)) == -1 && errno != EAGAIN)
+                warn("read: eventfd");
+            signaled.exchange(false, std::memory_order_acq_rel);
+            while (inbox.pop(m))
+                deliver(-1, m);
+        }
+
+        // Serializes msg once, queues a reference to it for every local
+        // client but the sender and forwards it to the other shards.  m is
+        // always the text form; deliver() frames it for framed clients.
+        void repeat(int from, std::string_view msg) {
+            msgbuf m(msgbuf::make(msg));
+
+            ++st.broadcasts;
+            st.bytescopied += m.size();
+            deliver(from, m);
+            for (auto &h : hubs) {
+                if (h.get() == this)
+                    continue;
+                h->post(m);
+                ++st.forwarded;
             }
         }
-        pfds.erase(
-            std::remove_if(
-                pfds.begin(),
-                pfds.end(),
-                [](const pollfd &pfd) {
-                    return pfd.revents != 0 && !(pfd.revents & POLLIN);
+
+        void deliver(int from, const msgbuf &text) {
+            msgbuf frame;
+
+            for (int fd : fds) {
+                if (fd == from || conns[fd].dead)
+                    continue;
+                conn &c = conns[fd];
+                if (c.framed && !frame) {
+                    frame = msgbuf::makeframe(std::string_view(text.data(), text.size() - 1));
+                    st.bytescopied += frame.size();
+                }
+                const msgbuf &m = c.framed ? frame : text;
+                if (!c.wb.push(m)) {
+                    if (dropslow) {
+                        if (++st.dropped % 1024 == 1)
+                            std::clog << "dropping messages for slow fd " << fd
+                                      << ", " << st.dropped << " dropped in total" << std::endl;
+                    } else {
+                        std::clog << "fd " << fd << " has " << c.wb.size()
+                                  << " bytes queued, disconnecting" << std::endl;
+                        ++st.disconnected;
+                        kill(fd);
+                    }
+                    continue;
                 }
-            ),
-            pfds.end()
-        );
-
-        // Accept the new connection if any
-        auto &pfd = pfds[0];
-        if (pfd.revents & (POLLIN | POLLPRI)) {
-            auto conn = accept(pfd.fd, nullptr, nullptr);
-            if (conn == -1) {
-                warn("accept");
-                continue;
+                ++st.deliveries;
+                st.bytesqueued += m.size();
+                if (!c.writing)
+                    flush(fd);
             }
-            //set_nonblock(conn);
+        }
 
-            std::clog << "accepted new connection" << std::endl;
+        // Writes as much pending output as the socket takes and watches for
+        // writability only while something is left over.
+        void flush(int fd) {
+            conn &c = conns[fd];
+            if (c.wb.flush(fd) == -1) {
+                warn("writev: fd %d", fd);
+                kill(fd);
+                return;
+            }
+            if (c.writing == c.wb.empty()) {
+                c.writing = !c.writing;
+                p->wantwrite(fd, c.writing);
+            }
+        }
 
-            pfds.push_back({ conn, POLLIN | POLLPRI });
-            rbufs.insert(std::make_pair(conn, recvbuf()));
+        // Connections are closed after the current batch of events so that
+        // fds is not modified while deliver() walks it.
+        void kill(int fd) {
+            if (conns[fd].dead)
+                return;
+            conns[fd].dead = true;
+            dead.push_back(fd);
         }
-    }
-}
 
+        void reap() {
+            for (int fd : dead) {
+                conn &c = conns[fd];
+                std::clog << "closing fd " << fd << std::endl;
+                p->del(fd);
+                close(fd);
+                conns[fds.back()].slot = c.slot;
+                fds[c.slot] = fds.back();
+                fds.pop_back();
+                c = conn();
+            }
+            dead.clear();
+        }
+};
+
+// Workers run with SIGUSR1 blocked; the main thread waits for it and dumps
+// the counters of every shard.
+static void server(int port, bool useepoll, int nthreads) {
+    std::vector<std::thread>    workers;
+    sigset_t                    set;
+    int                         sig;
+
+    signal(SIGPIPE, SIG_IGN);
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    if (pthread_sigmask(SIG_BLOCK, &set, nullptr) != 0)
+        errx(1, "pthread_sigmask");
+
+    for (int i = 0; i < nthreads; ++i)
+        hubs.emplace_back(new hub(i, listen_port(port, nthreads > 1), useepoll));
+    for (auto &h : hubs)
+        workers.emplace_back(&hub::run, h.get());
 
+    for ( ;; ) {
+        if (sigwait(&set, &sig) != 0)
+            errx(1, "sigwait");
+        for (size_t i = 0; i < hubs.size(); ++i) {
+            std::clog << "shard " << i << ":" << std::endl;
+            hubs[i]->getstats().dump(std::clog);
+        }
+    }
+}
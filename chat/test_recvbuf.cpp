@@ -19,11 +19,12 @@ int main(int argc, char **argv) {
         recvbuf buf;
 
         buf.read(fd);
-        /*
-        while (buf)
-            std::cout << "msg: " << buf.str() << std::endl;
-        */
-        std::cout << "str: " << buf.str() << std::endl;
+        if (!buf.peek().empty() && buf.peek()[0] == recvbuf::framinghello) {
+            buf.skip(1);
+            buf.setframing(recvbuf::LENGTH);
+        }
+        while (buf.hasmsg())
+            std::cout << "msg: " << buf.popmsg() << std::endl;
         close(fd);
     }
 
@@ -1,10 +1,116 @@
 #ifndef WBUF
 #define WBUF
 
+#include <cerrno>
+#include <climits>
+#include <deque>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "msgbuf.hpp"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// Outbound message queue of a single connection.
+//
+// The queue holds references to shared msgbufs rather than copies, and
+// flush() hands the kernel one iovec per message so that everything queued
+// goes out in as few writev(2) calls as possible.  Once more than highwater
+// bytes are queued push() refuses new messages and the owner decides
+// whether to drop them or to disconnect the slow reader.
 class wbuf {
     public:
+        static const size_t default_highwater = 1024 * 1024;
+
+        wbuf(size_t highwater = default_highwater) :
+            highwater(highwater),
+            queued(0),
+            headpos(0)
+        {
+        }
+
+        // Queues a reference to m.  Returns false, leaving the queue
+        // untouched, if the high-water mark has been reached.
+        bool push(const msgbuf &m) {
+            if (queued >= highwater)
+                return false;
+            msgs.push_back(m);
+            queued += m.size();
+            return true;
+        }
+
+        // Writes until the queue is empty or the socket would block.
+        // Returns the number of bytes written or -1 on error.
+        ssize_t flush(int fd) {
+            iovec       iov[IOV_MAX];
+            ssize_t     sum = 0;
+
+            while (!msgs.empty()) {
+                int     niov = 0;
+                size_t  want = 0;
+                size_t  skip = headpos;
+
+                for (auto i = msgs.begin(); i != msgs.end() && niov < IOV_MAX; ++i) {
+                    iov[niov].iov_base = (void *) (i->data() + skip);
+                    iov[niov].iov_len = i->size() - skip;
+                    want += iov[niov++].iov_len;
+                    skip = 0;
+                }
+
+                ssize_t nbytes = writev(fd, iov, niov);
+                if (nbytes == -1) {
+                    if (errno == EINTR)
+                        continue;
+                    if (errno == EAGAIN || errno == EWOULDBLOCK)
+                        break;
+                    return -1;
+                }
+                consume(nbytes);
+                sum += nbytes;
+                if ((size_t) nbytes < want)
+                    break;
+            }
+
+            return sum;
+        }
+
+        bool empty() const {
+            return msgs.empty();
+        }
+
+        // Number of bytes not yet written.
+        size_t size() const {
+            return queued;
+        }
+
+        void clear() {
+            msgs.clear();
+            queued = 0;
+            headpos = 0;
+        }
+
+    private:
+        std::deque<msgbuf>  msgs;
+        size_t              highwater;
+        size_t              queued;
+        size_t              headpos;    // bytes of msgs.front() already written
 
-        void write(
+        void consume(size_t nbytes) {
+            queued -= nbytes;
+            while (nbytes > 0) {
+                size_t left = msgs.front().size() - headpos;
+                if (nbytes < left) {
+                    headpos += nbytes;
+                    return;
+                }
+                nbytes -= left;
+                msgs.pop_front();
+                headpos = 0;
+            }
+        }
 };
 
 #endif
@@ -0,0 +1,111 @@
+// Copyright (c) 2016 Sviatoslav Chagaev <sviatoslav.chagaev@gmail.com>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+// Runs threads that look up random names in a dns::Cache, inserting a
+// response on every miss, and prints the lookup rate and the cache's
+// counters.  More names than entries make it evict.
+// Usage: bench_cache [-c entries] [-k names] [-n lookups per thread]
+//                    [-s shards] [-t threads]
+
+#include <unistd.h>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+
+#include "cache.h"
+#include "dns.h"
+#include "flat.h"
+
+int main(int argc, char** argv) {
+  int ch;
+  size_t entries = 100000, names = 120000, shards = 16;
+  long lookups = 1000000;
+  int threads = 4;
+
+  while ((ch = getopt(argc, argv, "c:k:n:s:t:")) != -1) {
+    switch (ch) {
+      case 'c':
+        entries = static_cast<size_t>(atol(optarg));
+        break;
+      case 'k':
+        names = static_cast<size_t>(atol(optarg));
+        break;
+      case 'n':
+        lookups = atol(optarg);
+        break;
+      case 's':
+        shards = static_cast<size_t>(atol(optarg));
+        break;
+      case 't':
+        threads = atoi(optarg);
+        break;
+      default:
+        std::cerr << "usage: bench_cache [-c entries] [-k names] [-n lookups] [-s shards] [-t threads]"
+                  << std::endl;
+        return 1;
+    }
+  }
+
+  // One encoded response per name, as a server would have produced.
+  std::vector<dns::ByteVector> responses(names);
+  const dns::ByteVector addr{192, 0, 2, 1};
+  dns::Codec codec;
+  codec.Compress(true);
+  for (size_t i = 0; i < names; ++i) {
+    dns::Msg msg;
+    msg.hdr = dns::Hdr{0, dns::kFlagQR | dns::kFlagAA};
+    std::string name = "host" + std::to_string(i) + ".example.com";
+    msg << dns::Question{name, dns::QType::A, dns::QClass::IN};
+    msg.answer.push_back(dns::RR{name, dns::RRType::A, dns::RRClass::IN, 300, addr});
+    codec.Rewind() << msg;
+    responses[i].assign(codec.Data(), codec.Data() + codec.Size());
+  }
+
+  dns::Cache cache(entries, shards);
+  std::vector<std::thread> workers;
+  auto t0 = std::chrono::steady_clock::now();
+  for (int t = 0; t < threads; ++t) {
+    workers.emplace_back([&, t] {
+      std::minstd_rand rng(static_cast<unsigned>(t + 1));
+      dns::FlatMsg reply;
+      uint8_t out[512];
+      for (long i = 0; i < lookups; ++i) {
+        const dns::ByteVector& r = responses[rng() % names];
+        // The question name starts right after the header.
+        size_t len = 0;
+        while (r[12 + len] != 0)
+          len += 1 + r[12 + len];
+        ++len;
+        if (cache.Lookup(&r[12], len, dns::QType::A, dns::QClass::IN, static_cast<uint16_t>(i), out,
+                         sizeof(out)) == 0 && reply.Parse(r.data(), r.size()))
+          cache.Insert(reply);
+      }
+    });
+  }
+  for (auto& w : workers)
+    w.join();
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+  dns::CacheStats st = cache.Stats();
+  std::cout << "threads: " << threads << ", shards: " << shards
+            << ", lookups/s: " << threads * lookups / seconds << std::endl
+            << "hits: " << st.hits << ", misses: " << st.misses << ", expired: " << st.expired
+            << ", inserts: " << st.inserts << ", evictions: " << st.evictions << std::endl;
+  return 0;
+}
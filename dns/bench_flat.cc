@@ -0,0 +1,127 @@
+// Copyright (c) 2016 Sviatoslav Chagaev <sviatoslav.chagaev@gmail.com>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+// Times encode/decode round trips of a typical response, a question with
+// four A records and two address records in the additional section, with
+// Codec and Msg and with FlatMsg, and counts the heap allocations each does.
+// Usage: bench_flat [iterations]
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <string>
+
+#include "dns.h"
+#include "flat.h"
+
+static uint64_t allocations;
+
+void* operator new(size_t size) {
+  ++allocations;
+  if (void* p = malloc(size))
+    return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+  free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+  free(p);
+}
+
+namespace {
+
+const char* const kNames[] = {
+  "www.example.com",
+  "ns1.example.com",
+  "ns2.example.com",
+};
+
+struct Result {
+  double ns;
+  double allocs;
+};
+
+template <typename F>
+Result Time(long iterations, F round_trip) {
+  round_trip();  // Warm up buffers that are meant to be reused.
+  uint64_t allocs = allocations;
+  auto t0 = std::chrono::steady_clock::now();
+  for (long i = 0; i < iterations; ++i)
+    round_trip();
+  auto t1 = std::chrono::steady_clock::now();
+  return Result{
+    std::chrono::duration<double, std::nano>(t1 - t0).count() / iterations,
+    static_cast<double>(allocations - allocs) / iterations
+  };
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+  const dns::ByteVector addr{192, 0, 2, 1};
+  volatile size_t sink = 0;
+
+  dns::Msg msg;
+  msg.hdr = dns::Hdr{0x1234, 0x8180};
+  msg << dns::Question{kNames[0], dns::QType::A, dns::QClass::IN};
+  for (int i = 0; i < 4; ++i)
+    msg.answer.push_back(dns::RR{kNames[0], dns::RRType::A, dns::RRClass::IN, 300, addr});
+  for (int i = 1; i < 3; ++i)
+    msg.additional.push_back(dns::RR{kNames[i], dns::RRType::A, dns::RRClass::IN, 300, addr});
+
+  dns::FlatMsg flat;
+  flat.Clear(0x1234, 0x8180);
+  flat.Add(kNames[0], dns::QType::A, dns::QClass::IN);
+  for (int i = 0; i < 4; ++i)
+    flat.Add(flat.answer, kNames[0], strlen(kNames[0]), dns::RRType::A, dns::RRClass::IN,
+             300, addr.data(), static_cast<uint16_t>(addr.size()));
+  for (int i = 1; i < 3; ++i)
+    flat.Add(flat.additional, kNames[i], strlen(kNames[i]), dns::RRType::A, dns::RRClass::IN,
+             300, addr.data(), static_cast<uint16_t>(addr.size()));
+
+  dns::Codec encoder, decoder;
+  dns::Msg decoded;
+  Result codec = Time(iterations, [&] {
+    encoder.Rewind() << msg;
+    decoder.Load(encoder.Data(), encoder.Size()) >> decoded;
+    sink = sink + decoded.answer.size();
+  });
+
+  uint8_t buf[512];
+  dns::FlatMsg parsed;
+  Result flat_result = Time(iterations, [&] {
+    size_t n = flat.Encode(buf, sizeof(buf));
+    parsed.Parse(buf, n);
+    sink = sink + parsed.answer.size();
+  });
+
+  if (decoded.answer.size() != 4 || parsed.answer.size() != 4 ||
+      parsed.Name(parsed.additional[1].name) != "ns2.example.com.") {
+    std::cerr << "round trip mismatch" << std::endl;
+    return 1;
+  }
+
+  std::cout << "iterations: " << iterations << std::endl
+            << "msg:  " << codec.ns << " ns/round trip, "
+            << codec.allocs << " allocations/round trip" << std::endl
+            << "flat: " << flat_result.ns << " ns/round trip, "
+            << flat_result.allocs << " allocations/round trip" << std::endl;
+  return 0;
+}
@@ -0,0 +1,239 @@
+// Copyright (c) 2016 Sviatoslav Chagaev <sviatoslav.chagaev@gmail.com>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+// Times the name encoders and hostname validators of name.h on random
+// hostnames, next to the byte at a time encoder Codec used to have and the
+// wire name walkers of ../branch_test.c, and checks that every version
+// gives the same result.
+// Usage: bench_name [-k names] [-l labels] [-n rounds]
+
+#include <unistd.h>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include "dns.h"
+#include "name.h"
+
+namespace {
+
+// Codec::operator<<(const std::string&) as it was before name.h, growing
+// the buffer for every byte.
+size_t EncodeBytewise(const std::string& name, dns::ByteVector* buf) {
+  const size_t npos = ~static_cast<size_t>(0);
+  size_t pos = 0, len_pos = npos;
+  bool fail = false;
+  auto grow = [&](size_t n) {
+    if (pos + n > buf->size())
+      buf->resize(pos + n);
+  };
+  for (size_t i = 0; i < name.size(); ++i) {
+    uint8_t ch = static_cast<uint8_t>(name[i]);
+    if (ch == '.' || len_pos == npos) {
+      if (pos > 0 && len_pos == pos - 1)
+        continue;
+      grow(1);
+      len_pos = pos;
+      (*buf)[pos++] = 0;
+      if (ch == '.')
+        continue;
+    }
+    if (++(*buf)[len_pos] > 63)
+      fail = true;
+    grow(1);
+    (*buf)[pos++] = ch;
+  }
+  if (name.empty() || name[name.size() - 1] != '.') {
+    grow(1);
+    (*buf)[pos++] = 0;
+  }
+  return fail || pos > 255 ? 0 : pos;
+}
+
+// name_len1() and name_len2() of ../branch_test.c, without the message.
+int NameLen1(const uint8_t* s) {
+  int len = 0;
+  unsigned c;
+  while (*s) {
+    c = *s;
+    if (c > 63)
+      return -1;
+    len += c;
+    s += c + 1;
+  }
+  return len;
+}
+
+int NameLen2(const uint8_t* s) {
+  int len = 0;
+  unsigned c;
+  while (*s) {
+    c = *s;
+    if (c < 64) {
+      len += c;
+      s += c + 1;
+    } else {
+      return -1;
+    }
+  }
+  return len;
+}
+
+// Hostnames of 2 to labels + 1 labels of 1 to 20 characters, the last one
+// from a few top level domains, and now and then a final dot or a bad
+// character so that the validators do not always say yes.
+std::vector<std::string> RandomNames(size_t count, int labels, std::mt19937* rng) {
+  static const char kChars[] = "abcdefghijklmnopqrstuvwxyz0123456789-";
+  static const char* const kTlds[] = {"com", "net", "org", "io", "de", "example"};
+  std::vector<std::string> names(count);
+  for (auto& name : names) {
+    int n = 1 + static_cast<int>((*rng)() % static_cast<unsigned>(labels));
+    for (int i = 0; i < n; ++i) {
+      size_t len = 1 + (*rng)() % 20;
+      for (size_t j = 0; j < len; ++j)
+        name += kChars[(*rng)() % (sizeof(kChars) - 2)];  // No hyphens here.
+      if (len > 2 && (*rng)() % 4 == 0)
+        name[name.size() - len / 2] = '-';
+      name += '.';
+    }
+    name += kTlds[(*rng)() % (sizeof(kTlds) / sizeof(kTlds[0]))];
+    if ((*rng)() % 8 == 0)
+      name += '.';
+    if ((*rng)() % 16 == 0)
+      name[(*rng)() % name.size()] = '!';
+  }
+  return names;
+}
+
+template <typename F>
+void Time(const char* what, size_t names, long rounds, F f) {
+  unsigned long sink = 0;
+  auto t0 = std::chrono::steady_clock::now();
+  for (long r = 0; r < rounds; ++r)
+    for (size_t i = 0; i < names; ++i)
+      sink += f(i);
+  double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count();
+  std::cout << std::left << std::setw(24) << what << std::right << std::fixed << std::setprecision(1)
+            << std::setw(8) << ns / (static_cast<double>(rounds) * static_cast<double>(names))
+            << " ns/name  (" << sink % 10 << ")" << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  int ch;
+  size_t count = 10000;
+  int labels = 3;
+  long rounds = 200;
+
+  while ((ch = getopt(argc, argv, "k:l:n:")) != -1) {
+    switch (ch) {
+      case 'k':
+        count = static_cast<size_t>(atol(optarg));
+        break;
+      case 'l':
+        labels = atoi(optarg);
+        break;
+      case 'n':
+        rounds = atol(optarg);
+        break;
+      default:
+        std::cerr << "usage: bench_name [-k names] [-l labels] [-n rounds]" << std::endl;
+        return 1;
+    }
+  }
+  if (count == 0 || labels < 1) {
+    std::cerr << "bench_name: need at least one name and one label" << std::endl;
+    return 1;
+  }
+
+  std::mt19937 rng(1);
+  std::vector<std::string> names = RandomNames(count, labels, &rng);
+  size_t total = 0;
+  for (const auto& name : names)
+    total += name.size();
+  std::cout << "names: " << count << ", mean length: " << static_cast<double>(total) / count
+#if defined(DNS_HAVE_AVX2)
+            << ", avx2: " << (dns::HaveAvx2() ? "yes" : "no")
+#endif
+            << std::endl;
+
+  // Every version must agree before any of them is timed.
+  std::vector<dns::ByteVector> wire(count);
+  dns::ByteVector old;
+  for (size_t i = 0; i < count; ++i) {
+    const std::string& name = names[i];
+    uint8_t out[300];
+    size_t n = dns::EncodeName(name.data(), name.size(), out);
+    wire[i].assign(out, out + n);
+    bool same = EncodeBytewise(name, &old) == n && std::equal(out, out + n, old.begin());
+#if defined(__SSE2__)
+    same = same && dns::EncodeNameSse2(name.data(), name.size(), out) == n &&
+           std::equal(out, out + n, wire[i].begin());
+    same = same && dns::ValidateHostnameSse2(name.data(), name.size()) ==
+                       dns::ValidateHostname(name.data(), name.size());
+#endif
+#if defined(DNS_HAVE_AVX2)
+    if (dns::HaveAvx2())
+      same = same && dns::EncodeNameAvx2(name.data(), name.size(), out) == n &&
+             std::equal(out, out + n, wire[i].begin());
+#endif
+    if (!same || n == 0) {
+      std::cerr << "bench_name: versions disagree on " << name << std::endl;
+      return 1;
+    }
+  }
+
+  // Codec only encodes names as part of a message.
+  std::vector<dns::Msg> queries(count);
+  for (size_t i = 0; i < count; ++i)
+    queries[i] << dns::Question{names[i], dns::QType::A, dns::QClass::IN};
+
+  uint8_t out[300];
+  dns::Codec codec;
+  Time("bytewise (old Codec)", count, rounds,
+       [&](size_t i) { return EncodeBytewise(names[i], &old); });
+  Time("Codec query", count, rounds, [&](size_t i) {
+    codec.Rewind() << queries[i];
+    return codec.Size();
+  });
+  Time("EncodeName", count, rounds,
+       [&](size_t i) { return dns::EncodeName(names[i].data(), names[i].size(), out); });
+#if defined(__SSE2__)
+  Time("EncodeNameSse2", count, rounds,
+       [&](size_t i) { return dns::EncodeNameSse2(names[i].data(), names[i].size(), out); });
+#endif
+#if defined(DNS_HAVE_AVX2)
+  if (dns::HaveAvx2())
+    Time("EncodeNameAvx2", count, rounds,
+         [&](size_t i) { return dns::EncodeNameAvx2(names[i].data(), names[i].size(), out); });
+#endif
+  Time("EncodeNameFast", count, rounds,
+       [&](size_t i) { return dns::EncodeNameFast(names[i].data(), names[i].size(), out); });
+  Time("name_len1", count, rounds, [&](size_t i) { return NameLen1(wire[i].data()); });
+  Time("name_len2", count, rounds, [&](size_t i) { return NameLen2(wire[i].data()); });
+  Time("ValidateHostname", count, rounds,
+       [&](size_t i) { return dns::ValidateHostname(names[i].data(), names[i].size()); });
+#if defined(__SSE2__)
+  Time("ValidateHostnameSse2", count, rounds,
+       [&](size_t i) { return dns::ValidateHostnameSse2(names[i].data(), names[i].size()); });
+#endif
+  return 0;
+}
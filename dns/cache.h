@@ -0,0 +1,358 @@
+// Copyright (c) 2016 Sviatoslav Chagaev <sviatoslav.chagaev@gmail.com>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#ifndef DNS_CACHE_H_
+#define DNS_CACHE_H_
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <cctype>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+
+#include "dns.h"
+#include "flat.h"
+
+namespace dns {
+
+struct CacheStats {
+  uint64_t hits;
+  uint64_t misses;     // Expired entries included.
+  uint64_t expired;    // Misses that found the entry expired.
+  uint64_t inserts;
+  uint64_t evictions;  // Live entries pushed out to make room.
+};
+
+// Caches encoded responses by question: (name, QType, QClass), the name
+// compared ignoring case.  A hit copies the stored response and rewrites its
+// ID and the spelling of its question name, nothing else, so responses go
+// out with the TTLs they were cached with until they expire after the
+// smallest TTL in them.
+//
+// The cache is split into shards by key hash, each with its own lock,
+// table and LRU list, so lookups from several threads mostly take different
+// locks.  Entries are preallocated and lookups build their key on the
+// stack, so once the stored responses have grown to size the cache does not
+// allocate.
+// Example:
+//   dns::Cache cache(100000);
+//   size_t n = cache.Lookup(query, out, sizeof(out));
+//   if (n == 0) {
+//     ...  // ask upstream, parse the reply into reply
+//     cache.Insert(reply);
+//   }
+class Cache {
+ public:
+  // Longest time a response is kept, whatever its TTLs say.
+  static const uint32_t kMaxTtl = 7 * 24 * 3600;
+
+  explicit Cache(size_t capacity, size_t shards = 16) {
+    shards = std::max<size_t>(shards, 1);
+    size_t per_shard = std::max<size_t>((capacity + shards - 1) / shards, 1);
+    for (size_t i = 0; i < shards; ++i)
+      shards_.emplace_back(new Shard(per_shard));
+  }
+
+  Cache(const Cache&) = delete;
+  Cache& operator=(const Cache&) = delete;
+
+  // Copies the cached response to the question with the given uncompressed
+  // wire format name into out, with its ID set to id and its question name
+  // spelled as asked.  Returns the size of the response, or 0 if it is not
+  // cached, has expired or does not fit.
+  size_t Lookup(const uint8_t* name, size_t len, QType type, QClass klass, uint16_t id,
+                uint8_t* out, size_t size) {
+    uint8_t key[kMaxKey];
+    size_t key_len = MakeKey(name, len, static_cast<uint16_t>(type), static_cast<uint16_t>(klass), key);
+    if (key_len == 0)
+      return 0;
+    uint32_t hash = Hash(key, key_len);
+    Shard& s = ShardOf(hash);
+    std::lock_guard<std::mutex> lock(s.lock);
+
+    int32_t i = s.Find(hash, key, key_len);
+    if (i < 0) {
+      ++s.stats.misses;
+      return 0;
+    }
+    Entry& e = s.entries[i];
+    if (e.expires <= Clock::now()) {
+      ++s.stats.expired;
+      ++s.stats.misses;
+      s.Remove(i);
+      s.Free(i);
+      return 0;
+    }
+    size_t response_size = e.data.size() - e.key_len;
+    if (response_size > size) {
+      ++s.stats.misses;
+      return 0;
+    }
+    ++s.stats.hits;
+    s.Touch(i);
+    memcpy(out, e.data.data() + e.key_len, response_size);
+    out[0] = static_cast<uint8_t>(id >> CHAR_BIT);
+    out[1] = static_cast<uint8_t>(id & 0xff);
+    // The question name right after the header cannot be compressed, so it
+    // is there in full.
+    if (response_size >= 12 + len)
+      memcpy(out + 12, name, len);
+    return response_size;
+  }
+
+  // Looks up the first question of query, answering with its ID.
+  size_t Lookup(const FlatMsg& query, uint8_t* out, size_t size) {
+    if (query.question.empty())
+      return 0;
+    const FlatQuestion& q = query.question[0];
+    return Lookup(query.NameData(q.name), q.name.len, q.type, q.klass, query.hdr.id, out, size);
+  }
+
+  // Stores response as the answer to a question for ttl seconds, replacing
+  // what was cached for it.  Returns false if it was not stored.
+  bool Insert(const uint8_t* name, size_t len, QType type, QClass klass,
+              const uint8_t* response, size_t size, uint32_t ttl) {
+    uint8_t key[kMaxKey];
+    size_t key_len = MakeKey(name, len, static_cast<uint16_t>(type), static_cast<uint16_t>(klass), key);
+    if (key_len == 0 || ttl == 0 || size < 2)
+      return false;
+    if (ttl > kMaxTtl)
+      ttl = kMaxTtl;
+    uint32_t hash = Hash(key, key_len);
+    Shard& s = ShardOf(hash);
+    std::lock_guard<std::mutex> lock(s.lock);
+
+    int32_t i = s.Find(hash, key, key_len);
+    if (i < 0) {
+      i = s.Allocate(Clock::now());
+      s.entries[i].hash = hash;
+      s.Link(i);
+    } else {
+      s.Touch(i);
+    }
+    Entry& e = s.entries[i];
+    e.data.assign(key, key + key_len);
+    e.data.insert(e.data.end(), response, response + size);
+    e.key_len = static_cast<uint16_t>(key_len);
+    e.expires = Clock::now() + std::chrono::seconds(ttl);
+    ++s.stats.inserts;
+    return true;
+  }
+
+  // Stores a parsed reply, if it is worth caching: a complete NOERROR or
+  // NXDOMAIN answer to one question, kept for its smallest TTL, or for a
+  // negative answer the SOA's (RFC 2308 5).
+  bool Insert(const FlatMsg& reply) {
+    uint32_t ttl;
+    if (reply.Packet() == nullptr || reply.question.size() != 1 || !Ttl(reply, &ttl))
+      return false;
+    const FlatQuestion& q = reply.question[0];
+    return Insert(reply.NameData(q.name), q.name.len, q.type, q.klass,
+                  reply.Packet(), reply.PacketSize(), ttl);
+  }
+
+  // Returns the counters summed over all shards.
+  CacheStats Stats() const {
+    CacheStats total;
+    memset(&total, 0, sizeof(total));
+    for (const auto& s : shards_) {
+      std::lock_guard<std::mutex> lock(s->lock);
+      total.hits += s->stats.hits;
+      total.misses += s->stats.misses;
+      total.expired += s->stats.expired;
+      total.inserts += s->stats.inserts;
+      total.evictions += s->stats.evictions;
+    }
+    return total;
+  }
+
+  // Computes how long reply may be cached.  Returns false if it may not.
+  static bool Ttl(const FlatMsg& reply, uint32_t* ttl) {
+    uint16_t rcode = reply.hdr.flags & kRcodeMask;
+    if (!(reply.hdr.flags & kFlagQR) || (reply.hdr.flags & kFlagTC) || (rcode != 0 && rcode != 3))
+      return false;
+    int64_t min = -1;
+    for (const auto& rr : reply.answer) {
+      if (rr.ttl <= 0)  // TTLs with the high bit set count as 0 (RFC 2181).
+        return false;
+      min = min < 0 ? rr.ttl : std::min<int64_t>(min, rr.ttl);
+    }
+    if (reply.answer.empty()) {
+      for (const auto& rr : reply.authority) {
+        if (rr.type != RRType::SOA || rr.rdlength < 20)
+          continue;
+        const uint8_t* p = rr.rdata + rr.rdlength - 4;
+        uint32_t minimum = (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) |
+                           (static_cast<uint32_t>(p[2]) << 8) | p[3];
+        min = std::min<int64_t>(rr.ttl, minimum);
+      }
+    }
+    if (min <= 0)
+      return false;
+    *ttl = static_cast<uint32_t>(std::min<int64_t>(min, kMaxTtl));
+    return true;
+  }
+
+ private:
+  typedef std::chrono::steady_clock Clock;
+
+  // Lower-cased name, type and class.
+  static const size_t kMaxKey = 255 + 4;
+
+  struct Entry {
+    ByteVector data;  // The key, then the response, to touch one buffer.
+    Clock::time_point expires;
+    uint32_t hash = 0;
+    uint16_t key_len = 0;
+    int32_t prev = -1;   // LRU list, most recently used first.
+    int32_t next = -1;
+    int32_t chain = -1;  // Next entry in the same bucket.
+  };
+
+  struct Shard {
+    mutable std::mutex lock;
+    std::vector<Entry> entries;
+    std::vector<int32_t> buckets;
+    int32_t head = -1;
+    int32_t tail = -1;
+    int32_t free = -1;  // Entries removed on expiry, chained by chain.
+    size_t used = 0;
+    CacheStats stats;
+
+    explicit Shard(size_t capacity) : entries(capacity) {
+      size_t n = 1;
+      while (n < capacity)
+        n <<= 1;
+      buckets.assign(n, -1);
+      memset(&stats, 0, sizeof(stats));
+    }
+
+    int32_t Find(uint32_t hash, const uint8_t* key, size_t len) const {
+      for (int32_t i = buckets[hash & (buckets.size() - 1)]; i >= 0; i = entries[i].chain) {
+        const Entry& e = entries[i];
+        if (e.hash == hash && e.key_len == len && memcmp(e.data.data(), key, len) == 0)
+          return i;
+      }
+      return -1;
+    }
+
+    // Returns an unused entry, evicting the least recently used one if
+    // there is none.  Reclaiming an expired entry is not an eviction.
+    int32_t Allocate(Clock::time_point now) {
+      if (free >= 0) {
+        int32_t i = free;
+        free = entries[i].chain;
+        return i;
+      }
+      if (used < entries.size())
+        return static_cast<int32_t>(used++);
+      int32_t victim = tail;
+      if (entries[victim].expires > now)
+        ++stats.evictions;
+      Remove(victim);
+      return victim;
+    }
+
+    // Puts a new entry at the front of the LRU list and in its bucket.
+    void Link(int32_t i) {
+      Entry& e = entries[i];
+      int32_t& bucket = buckets[e.hash & (buckets.size() - 1)];
+      e.chain = bucket;
+      bucket = i;
+      e.prev = -1;
+      e.next = head;
+      if (head >= 0)
+        entries[head].prev = i;
+      head = i;
+      if (tail < 0)
+        tail = i;
+    }
+
+    void Unlist(int32_t i) {
+      Entry& e = entries[i];
+      if (e.prev >= 0)
+        entries[e.prev].next = e.next;
+      else
+        head = e.next;
+      if (e.next >= 0)
+        entries[e.next].prev = e.prev;
+      else
+        tail = e.prev;
+    }
+
+    void Touch(int32_t i) {
+      if (head == i)
+        return;
+      Unlist(i);
+      Entry& e = entries[i];
+      e.prev = -1;
+      e.next = head;
+      entries[head].prev = i;
+      head = i;
+    }
+
+    void Remove(int32_t i) {
+      Unlist(i);
+      Entry& e = entries[i];
+      int32_t* p = &buckets[e.hash & (buckets.size() - 1)];
+      while (*p != i)
+        p = &entries[*p].chain;
+      *p = e.chain;
+    }
+
+    void Free(int32_t i) {
+      entries[i].chain = free;
+      free = i;
+    }
+  };
+
+  std::vector<std::unique_ptr<Shard>> shards_;
+
+  // Picks the shard from the high bits of the hash, as the buckets within
+  // a shard are picked from the low ones.
+  Shard& ShardOf(uint32_t hash) {
+    return *shards_[(static_cast<uint64_t>(hash) * shards_.size()) >> 32];
+  }
+
+  static size_t MakeKey(const uint8_t* name, size_t len, uint16_t type, uint16_t klass, uint8_t* key) {
+    if (len == 0 || len > 255)
+      return 0;
+    for (size_t i = 0; i < len; ++i)
+      key[i] = static_cast<uint8_t>(tolower(name[i]));
+    key[len] = static_cast<uint8_t>(type >> CHAR_BIT);
+    key[len + 1] = static_cast<uint8_t>(type & 0xff);
+    key[len + 2] = static_cast<uint8_t>(klass >> CHAR_BIT);
+    key[len + 3] = static_cast<uint8_t>(klass & 0xff);
+    return len + 4;
+  }
+
+  // FNV-1a.
+  static uint32_t Hash(const uint8_t* key, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; ++i) {
+      h ^= key[i];
+      h *= 16777619u;
+    }
+    return h;
+  }
+};
+
+} // namespace dns
+
+#endif  // DNS_CACHE_H_
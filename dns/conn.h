@@ -0,0 +1,454 @@
+// Copyright (c) 2016 Sviatoslav Chagaev <sviatoslav.chagaev@gmail.com>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#ifndef DNS_CONN_H_
+#define DNS_CONN_H_
+
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+
+#include "dns.h"
+#include "flat.h"
+
+namespace dns {
+
+// Opens a non-blocking UDP socket connected to addr, or bound to it if
+// listen is set.  addr is "host", "host:port" or "[host]:port", and the port
+// defaults to 53.  Returns -1 with errno set on failure.
+inline int OpenUdp(const std::string& addr, bool listen) {
+  std::string host = addr, port = "53";
+  if (!addr.empty() && addr[0] == '[') {
+    std::string::size_type end = addr.find(']');
+    if (end == std::string::npos) {
+      errno = EINVAL;
+      return -1;
+    }
+    host = addr.substr(1, end - 1);
+    if (end + 1 < addr.size() && addr[end + 1] == ':')
+      port = addr.substr(end + 2);
+  } else {
+    std::string::size_type colon = addr.rfind(':');
+    if (colon != std::string::npos && addr.find(':') == colon) {
+      host = addr.substr(0, colon);
+      port = addr.substr(colon + 1);
+    }
+  }
+
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_flags = listen ? AI_PASSIVE : 0;
+  addrinfo* res = nullptr;
+  if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &res) != 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  int s = -1;
+  for (addrinfo* ai = res; ai != nullptr; ai = ai->ai_next) {
+    s = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+    if (s == -1)
+      continue;
+    if ((listen ? bind(s, ai->ai_addr, ai->ai_addrlen) : connect(s, ai->ai_addr, ai->ai_addrlen)) == 0)
+      break;
+    int saved = errno;
+    close(s);
+    errno = saved;
+    s = -1;
+  }
+  freeaddrinfo(res);
+  if (s != -1) {
+    // Bursts of a whole window of queries or replies have to fit.
+    int size = 4 << 20;
+    setsockopt(s, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setsockopt(s, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+  }
+  return s;
+}
+
+struct ConnStats {
+  uint64_t queries;   // Taken from the source.
+  uint64_t sent;      // Datagrams sent, retries included.
+  uint64_t retries;
+  uint64_t timeouts;  // Queries given up on after the last try.
+  uint64_t replies;   // Datagrams received.
+  uint64_t stray;     // Replies that were malformed, late or unasked for.
+};
+
+// A pipelined DNS client over one connected UDP socket.  Resolve() keeps up
+// to a window of queries outstanding, sends them in batches with sendmmsg,
+// reads replies in batches with recvmmsg and matches them to queries by ID
+// and question, retrying each query a few times before giving up on it.
+// Example:
+//   dns::Conn conn;
+//   if (!conn.Dial("127.0.0.1:53"))
+//     ...  // errno is set
+//   conn.Resolve(
+//       [&](dns::Question* q) { return ReadNextQuestion(q); },
+//       [&](const dns::Question& q, const dns::FlatMsg* reply) {
+//         ...  // reply is null if the query timed out
+//       });
+class Conn {
+ public:
+  // Datagrams moved per sendmmsg or recvmmsg call.
+  static const size_t kBatch = 64;
+  static const size_t kMaxPacket = 4096;
+
+  // Fills in the next question to ask, or returns false if there is none.
+  typedef std::function<bool(Question* q)> Source;
+  // Called once per question with the reply to it, or with null if the
+  // question went unanswered or could not be encoded.  The reply is only
+  // valid during the call.
+  typedef std::function<void(const Question& q, const FlatMsg* reply)> Sink;
+
+  Conn() : id_slot_(65536, -1), recv_buf_(kBatch * kMaxPacket) {
+    std::minstd_rand rng(static_cast<unsigned>(
+        std::chrono::steady_clock::now().time_since_epoch().count()));
+    std::vector<uint16_t> ids(65536);
+    for (size_t i = 0; i < ids.size(); ++i)
+      ids[i] = static_cast<uint16_t>(i);
+    std::shuffle(ids.begin(), ids.end(), rng);
+    free_ids_.assign(ids.begin(), ids.end());
+    memset(&stats_, 0, sizeof(stats_));
+  }
+
+  ~Conn() {
+    if (sock_ != -1)
+      close(sock_);
+  }
+
+  Conn(const Conn&) = delete;
+  Conn& operator=(const Conn&) = delete;
+
+  // Connects to a server, see OpenUdp() for the address format.  Returns
+  // false with errno set on failure.
+  bool Dial(const std::string& addr) {
+    if (sock_ != -1)
+      close(sock_);
+    sock_ = OpenUdp(addr, false);
+    return sock_ != -1;
+  }
+
+  // Sets how long to wait for a reply to each try.
+  Conn& Timeout(int ms) {
+    timeout_ = std::chrono::milliseconds(ms);
+    return *this;
+  }
+
+  // Sets how many times a query is sent before giving up on it.
+  Conn& Tries(int tries) {
+    tries_ = std::max(tries, 1);
+    return *this;
+  }
+
+  // Sets how many queries may be outstanding at once.  Half the ID space
+  // at most, so that an ID is not reused while a late reply to its previous
+  // query may still arrive.
+  Conn& Window(size_t window) {
+    window_ = std::min<size_t>(std::max<size_t>(window, 1), 32768);
+    return *this;
+  }
+
+  const ConnStats& Stats() const {
+    return stats_;
+  }
+
+  // Asks every question next() gives and hands each answer to done(), in
+  // the order they arrive.  Returns false with errno set if the socket
+  // fails; questions still outstanding then get no call to done().
+  bool Resolve(const Source& next, const Sink& done) {
+    bool more = true;
+
+    // Take back the IDs of anything a failed run left outstanding.
+    for (auto& s : slots_) {
+      if (s.busy) {
+        id_slot_[s.id] = -1;
+        free_ids_.push_back(s.id);
+      }
+    }
+    slots_.assign(window_, Slot());
+    free_slots_.clear();
+    for (size_t i = window_; i > 0; --i)
+      free_slots_.push_back(static_cast<uint32_t>(i - 1));
+    outq_.clear();
+    timers_.clear();
+    inflight_ = 0;
+
+    for ( ;; ) {
+      while (more && !free_slots_.empty()) {
+        uint32_t idx = free_slots_.back();
+        Slot& s = slots_[idx];
+        if (!next(&s.q)) {
+          more = false;
+          break;
+        }
+        ++stats_.queries;
+        uint16_t id = free_ids_.front();
+        query_.Clear(id, kFlagRD);
+        s.size = 0;
+        if (query_.Add(s.q.name.data(), s.q.name.size(), s.q.type, s.q.klass))
+          s.size = static_cast<uint16_t>(query_.Encode(s.packet, sizeof(s.packet)));
+        if (s.size == 0) {
+          done(s.q, nullptr);
+          continue;
+        }
+        free_ids_.pop_front();
+        free_slots_.pop_back();
+        s.id = id;
+        s.tries = 0;
+        s.busy = true;
+        id_slot_[id] = static_cast<int32_t>(idx);
+        outq_.push_back(Send{idx, s.gen});
+        ++inflight_;
+      }
+
+      Expire(done);
+      if (!Flush())
+        return false;
+      if (!more && inflight_ == 0)
+        return true;
+
+      pollfd pfd;
+      pfd.fd = sock_;
+      pfd.events = static_cast<short>(POLLIN | (outq_.empty() ? 0 : POLLOUT));
+      int wait = -1;
+      if (!timers_.empty()) {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+            timers_.front().deadline - std::chrono::steady_clock::now());
+        wait = static_cast<int>(std::max<std::chrono::milliseconds::rep>(left.count() + 1, 0));
+      }
+      if (poll(&pfd, 1, wait) == -1 && errno != EINTR)
+        return false;
+      if ((pfd.revents & (POLLIN | POLLERR)) && !Receive(done))
+        return false;
+    }
+  }
+
+  // Asks a single question and decodes the reply into reply.  Returns false
+  // if there was no usable reply.
+  bool Exchange(const Question& q, Msg* reply) {
+    bool asked = false, ok = false;
+    Resolve(
+        [&](Question* out) {
+          if (asked)
+            return false;
+          *out = q;
+          return asked = true;
+        },
+        [&](const Question&, const FlatMsg* r) {
+          Codec codec;
+          ok = r != nullptr && (codec.Load(last_reply_, last_size_) >> *reply);
+        });
+    return ok;
+  }
+
+ private:
+  typedef std::chrono::steady_clock::time_point TimePoint;
+
+  struct Slot {
+    Question q;
+    uint8_t packet[512];
+    uint16_t size = 0;
+    uint16_t id = 0;
+    int tries = 0;
+    uint32_t gen = 0;  // Bumped on release, to spot stale timers.
+    bool busy = false;
+  };
+
+  struct Timer {
+    TimePoint deadline;
+    uint32_t slot;
+    uint32_t gen;
+  };
+
+  struct Send {
+    uint32_t slot;
+    uint32_t gen;
+  };
+
+  int sock_ = -1;
+  std::chrono::milliseconds timeout_{1000};
+  int tries_ = 3;
+  size_t window_ = 1024;
+  ConnStats stats_;
+
+  std::vector<Slot> slots_;
+  std::vector<uint32_t> free_slots_;
+  size_t inflight_ = 0;
+  // Every try gets the same timeout, so timers expire in the order they are
+  // set and a FIFO is enough.
+  std::deque<Timer> timers_;
+  std::deque<Send> outq_;  // Slots waiting to be sent.
+  // IDs are handed out from the front and returned to the back, so a freed
+  // ID is not reused until the rest of the ID space has been.
+  std::deque<uint16_t> free_ids_;
+  std::vector<int32_t> id_slot_;
+
+  FlatMsg query_;
+  FlatMsg reply_;
+  ByteVector recv_buf_;
+  mmsghdr msgs_[kBatch];
+  iovec iov_[kBatch];
+  const uint8_t* last_reply_ = nullptr;
+  size_t last_size_ = 0;
+
+  void Release(uint32_t idx) {
+    Slot& s = slots_[idx];
+    id_slot_[s.id] = -1;
+    free_ids_.push_back(s.id);
+    s.busy = false;
+    ++s.gen;
+    free_slots_.push_back(idx);
+    --inflight_;
+  }
+
+  void Expire(const Sink& done) {
+    TimePoint now = std::chrono::steady_clock::now();
+    while (!timers_.empty() && timers_.front().deadline <= now) {
+      Timer t = timers_.front();
+      timers_.pop_front();
+      Slot& s = slots_[t.slot];
+      if (!s.busy || s.gen != t.gen)
+        continue;
+      if (s.tries < tries_) {
+        ++stats_.retries;
+        outq_.push_back(Send{t.slot, t.gen});
+        continue;
+      }
+      ++stats_.timeouts;
+      done(s.q, nullptr);
+      Release(t.slot);
+    }
+  }
+
+  // Sends queued queries until the queue is empty or the socket is full.
+  // Entries for slots released since they were queued, answered or timed
+  // out while the socket was full, are dropped.
+  bool Flush() {
+    Send batch[kBatch];
+
+    while (!outq_.empty()) {
+      size_t n = 0;
+      while (n < kBatch && !outq_.empty()) {
+        Send q = outq_.front();
+        outq_.pop_front();
+        Slot& s = slots_[q.slot];
+        if (!s.busy || s.gen != q.gen)
+          continue;
+        iov_[n].iov_base = s.packet;
+        iov_[n].iov_len = s.size;
+        memset(&msgs_[n], 0, sizeof(msgs_[n]));
+        msgs_[n].msg_hdr.msg_iov = &iov_[n];
+        msgs_[n].msg_hdr.msg_iovlen = 1;
+        batch[n++] = q;
+      }
+      if (n == 0)
+        break;
+      int sent = sendmmsg(sock_, msgs_, static_cast<unsigned>(n), MSG_DONTWAIT);
+      // Requeue what was not sent, in order.
+      for (size_t i = n; i-- > (sent > 0 ? static_cast<size_t>(sent) : 0); )
+        outq_.push_front(batch[i]);
+      if (sent == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+          return true;
+        // An ICMP error for an earlier datagram; the retries cover it.
+        if (errno == ECONNREFUSED)
+          continue;
+        return false;
+      }
+      TimePoint deadline = std::chrono::steady_clock::now() + timeout_;
+      for (int i = 0; i < sent; ++i) {
+        ++slots_[batch[i].slot].tries;
+        timers_.push_back(Timer{deadline, batch[i].slot, batch[i].gen});
+      }
+      stats_.sent += sent;
+    }
+    return true;
+  }
+
+  // Reads every reply waiting on the socket.
+  bool Receive(const Sink& done) {
+    for ( ;; ) {
+      for (size_t i = 0; i < kBatch; ++i) {
+        iov_[i].iov_base = &recv_buf_[i * kMaxPacket];
+        iov_[i].iov_len = kMaxPacket;
+        memset(&msgs_[i], 0, sizeof(msgs_[i]));
+        msgs_[i].msg_hdr.msg_iov = &iov_[i];
+        msgs_[i].msg_hdr.msg_iovlen = 1;
+      }
+      int n = recvmmsg(sock_, msgs_, kBatch, MSG_DONTWAIT, nullptr);
+      if (n == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+          return true;
+        if (errno == ECONNREFUSED)
+          continue;
+        return false;
+      }
+      for (int i = 0; i < n; ++i) {
+        const uint8_t* data = &recv_buf_[i * kMaxPacket];
+        size_t size = msgs_[i].msg_len;
+        ++stats_.replies;
+        int32_t idx = -1;
+        if (reply_.Parse(data, size) && (reply_.hdr.flags & kFlagQR))
+          idx = id_slot_[reply_.hdr.id];
+        if (idx < 0 || !Matches(slots_[idx])) {
+          ++stats_.stray;
+          continue;
+        }
+        last_reply_ = data;
+        last_size_ = size;
+        done(slots_[idx].q, &reply_);
+        Release(static_cast<uint32_t>(idx));
+      }
+      if (static_cast<size_t>(n) < kBatch)
+        return true;
+    }
+  }
+
+  // Tells whether reply_ answers the query in s: it has to repeat the
+  // question, with the name compared case-insensitively.
+  bool Matches(const Slot& s) const {
+    if (reply_.question.size() != 1)
+      return false;
+    const FlatQuestion& q = reply_.question[0];
+    if (q.type != s.q.type || q.klass != s.q.klass)
+      return false;
+    // The query's name starts right after its 12-byte header.
+    const uint8_t* want = s.packet + 12;
+    const uint8_t* got = reply_.NameData(q.name);
+    for (uint32_t i = 0; i < q.name.len; ++i) {
+      if (tolower(want[i]) != tolower(got[i]))
+        return false;
+    }
+    return want[q.name.len - 1] == 0;
+  }
+};
+
+} // namespace dns
+
+#endif  // DNS_CONN_H_
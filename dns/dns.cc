@@ -12,364 +12,357 @@
 // ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
 // OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 
-#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/socket.h>
 #include <unistd.h>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <memory>
 #include <iostream>
 #include <sstream>
 #include <string>
 #include <vector>
-#include <utility>
+#include <cerrno>
 #include <cstdint>
-#include <climits>
+#include <cstdlib>
 #include <cstring>
-#include <cstdio>
 #include <cstddef>
 
-namespace dns {
+#include "cache.h"
+#include "conn.h"
+#include "dns.h"
+#include "zone.h"
 
-typedef std::vector<uint8_t> ByteVector;
-
-enum class RRType : uint16_t {
-  A = 1,
-  NS = 2,
-  MD = 3,
-  MF = 4,
-  CNAME = 5,
-  SOA = 6,
-  MB = 7,
-  MG = 8,
-  MR = 9,
-  RR_NULL = 10,
-  WKS = 11,
-  PTR = 12,
-  HINFO = 13,
-  MINFO = 14,
-  MX = 15,
-  TXT = 16
-};
-
-enum class QType : uint16_t {
-  A = 1,
-  NS = 2,
-  MD = 3,
-  MF = 4,
-  CNAME = 5,
-  SOA = 6,
-  MB = 7,
-  MG = 8,
-  MR = 9,
-  RR_NULL = 10,
-  WKS = 11,
-  PTR = 12,
-  HINFO = 13,
-  MINFO = 14,
-  MX = 15,
-  TXT = 16,
-
-  AXFR = 252,
-  MAILB = 253,
-  MAILA = 254,
-  ANY = 255
-};
-
-enum class RRClass : uint16_t {
-  IN = 1,
-  CS = 2,
-  CH = 3,
-  HS = 4
-};
-
-enum class QClass : uint16_t {
-  IN = 1,
-  CS = 2,
-  CH = 3,
-  HS = 4,
-  ANY = 255
-};
-
-struct RR {
-  std::string name;
-  RRType type;
-  RRClass klass;
-  int32_t ttl;
-  ByteVector rdata;
-};
-typedef std::vector<RR> RRVector;
-
-struct Question {
-  std::string name;
-  QType type;
-  QClass klass;
-};
-typedef std::vector<Question> QuestionVector;
-
-// FIXME
-struct Hdr {
-  uint16_t id;
-  uint16_t flags;
-};
-
-struct Msg {
-  Hdr hdr;
-  QuestionVector question;
-  RRVector answer;
-  RRVector authority;
-  RRVector additional;
-
-  Msg& operator<<(Question&& q) {
-    question.push_back(q);
-    return *this;
-  }
-
-  Msg& operator<<(const Question& q) {
-    question.push_back(q);
-    return *this;
-  }
-};
-
-// Encodes and decodes DNS messages to and from wire format.
-// Example:
-//   dns::Codec codec;
-//   dns::Msg msg;
-//   msg << dns::Question{"google.com", dns::QType::A, dns::QClass::IN};
-//   codec << msg;
-//   write(udp_sock, codec.Data(), codec.Size());
-class Codec {
- public:
-  // Rewinds the data stream to the beginning: next Msg write will overwrite
-  // what's already in Codec and next Msg read will start from the beginning.
-  Codec& Rewind() {
-    pos_ = 0;
-    return *this;
-  }
-
-  // Rewinds the data stream to the beginning and resizes the underlying 
-  Codec& Resize(ByteVector::size_type size) {
-    buf_.resize(size);
-    pos_ = 0;
-    return *this;
-  }
-
-  // Returns the pointer to raw data currently held by Codec.
-  const uint8_t* Data() const {
-    return buf_.data();
+std::string Dump(const uint8_t* ptr, size_t size) {
+  const char hex[] = { '0', '1', '2', '3', '4', '5', '6', '7', '8', '9',
+                       'a', 'b', 'c', 'd', 'e', 'f' };
+  std::ostringstream ostr;
+  ostr << std::hex;
+  for (size_t i = 0; i < size; ++i) {
+    if (i != 0 && (i % 8) == 0)
+      ostr << std::endl;
+    else if (i != 0 && (i % 4) == 0)
+      ostr << ' ';
+    uint8_t ch = *(ptr++);
+    ostr << hex[ch >> 4] << hex[ch & 0xf];
   }
+  return ostr.str();
+}
 
-  // Returns the size of raw data currently held by Codec, i.e. the size of
-  // DNS messages encoded into wire format currently held by Codec.
-  ByteVector::size_type Size() const {
-    return pos_;
-  }
+// Encodes a query for each name given, dumps it, decodes it back and prints
+// the questions found.  With compress all names go into a single compressed
+// query.
+int PrintQueries(int argc, char** argv, bool compress) {
+  dns::Codec codec;
+  std::vector<dns::Msg> msgs;
 
-  ByteVector::size_type Capacity() const {
-    return buf_.size();
+  if (compress) {
+    codec.Compress(true);
+    msgs.emplace_back();
   }
-
-  // Encodes a DNS message into wire format.
-  Codec& operator<<(const Msg& msg) {
-    *this << msg.hdr.id
-          << msg.hdr.flags
-          << static_cast<uint16_t>(msg.question.size())
-          << static_cast<uint16_t>(msg.answer.size())
-          << static_cast<uint16_t>(msg.authority.size())
-          << static_cast<uint16_t>(msg.additional.size())
-          << msg.question
-          << msg.answer
-          << msg.authority
-          << msg.additional;
-    return *this;
+  for ( ; argc > 0; ++argv, --argc) {
+    if (!compress)
+      msgs.emplace_back();
+    msgs.back() << dns::Question{*argv, dns::QType::A, dns::QClass::IN};
   }
 
- private:
-  ByteVector buf_;
-  ByteVector::size_type pos_;
-
-  void GrowIfNeeded(ByteVector::size_type size) {
-    if (buf_.size() < (pos_ + size))
-      buf_.resize(pos_ + size);
-  }
+  for (const auto& msg : msgs) {
+    codec.Rewind() << msg;
+    if (!codec) {
+      std::cerr << "cannot encode query" << std::endl;
+      return 1;
+    }
+    std::cout << "ptr: " << static_cast<const void*>(codec.Data()) << ", size: " << codec.Size() << std::endl;
+    std::cout << Dump(codec.Data(), codec.Size());
+    std::cout << std::endl;
+    write(STDERR_FILENO, codec.Data(), codec.Size());
 
-  Codec& operator<<(int32_t i) {
-    GrowIfNeeded(sizeof(i));
-    buf_[pos_++] = static_cast<uint8_t>((i >> (CHAR_BIT * 3)) & 0xff);
-    buf_[pos_++] = static_cast<uint8_t>((i >> (CHAR_BIT * 2)) & 0xff);
-    buf_[pos_++] = static_cast<uint8_t>((i >> CHAR_BIT) & 0xff);
-    buf_[pos_++] = static_cast<uint8_t>(i & 0xff);
-    return *this;
+    dns::Codec decoder;
+    dns::Msg decoded;
+    if (!(decoder.Load(codec.Data(), codec.Size()) >> decoded)) {
+      std::cerr << "cannot decode query" << std::endl;
+      return 1;
+    }
+    for (const auto& q : decoded.question)
+      std::cout << "question: " << q.name << ' ' << static_cast<int>(q.type)
+                << ' ' << static_cast<int>(q.klass) << std::endl;
   }
 
-  Codec& operator<<(uint16_t i) {
-    GrowIfNeeded(sizeof(i));
-    buf_[pos_++] = static_cast<uint8_t>(i >> CHAR_BIT);
-    buf_[pos_++] = static_cast<uint8_t>(i & 0xff);
-    return *this;
-  }
+  return 0;
+}
 
-  Codec& operator<<(RRType v) {
-    *this << static_cast<uint16_t>(v);
-    return *this;
-  }
+const char* RcodeName(uint16_t flags) {
+  static const char* const names[] = {
+    "NOERROR", "FORMERR", "SERVFAIL", "NXDOMAIN", "NOTIMP", "REFUSED"
+  };
+  uint16_t rcode = flags & dns::kRcodeMask;
+  return rcode < sizeof(names) / sizeof(names[0]) ? names[rcode] : "RCODE?";
+}
 
-  Codec& operator<<(QType v) {
-    *this << static_cast<uint16_t>(v);
-    return *this;
+// Resolves the A records of the names read one per line from in and prints
+// the rcode and answer count of each as the replies come in, then a summary.
+int Resolve(dns::Conn& conn, std::istream& in) {
+  std::string line;
+  auto t0 = std::chrono::steady_clock::now();
+
+  bool ok = conn.Resolve(
+      [&](dns::Question* q) {
+        while (std::getline(in, line)) {
+          if (line.empty())
+            continue;
+          q->name = line;
+          q->type = dns::QType::A;
+          q->klass = dns::QClass::IN;
+          return true;
+        }
+        return false;
+      },
+      [&](const dns::Question& q, const dns::FlatMsg* reply) {
+        if (reply == nullptr)
+          std::cout << q.name << " TIMEOUT\n";
+        else
+          std::cout << q.name << ' ' << RcodeName(reply->hdr.flags) << ' '
+                    << reply->answer.size() << '\n';
+      });
+  std::cout.flush();
+  if (!ok) {
+    std::cerr << "resolve: " << strerror(errno) << std::endl;
+    return 1;
   }
 
-  Codec& operator<<(RRClass v) {
-    *this << static_cast<uint16_t>(v);
-    return *this;
-  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+  const dns::ConnStats& st = conn.Stats();
+  std::cerr << "queries: " << st.queries << ", sent: " << st.sent
+            << ", retries: " << st.retries << ", timeouts: " << st.timeouts
+            << ", replies: " << st.replies << ", stray: " << st.stray
+            << ", seconds: " << seconds << ", queries/s: " << st.queries / seconds
+            << std::endl;
+  return 0;
+}
 
-  Codec& operator<<(QClass v) {
-    *this << static_cast<uint16_t>(v);
-    return *this;
+// Turns a query into its response.
+typedef std::function<void(dns::Msg& msg)> Responder;
+
+// Answers like a resolver that knows every name: A questions in class IN get
+// one A record for 192.0.2.1, anything else an empty NOERROR.
+void StubAnswer(dns::Msg& msg) {
+  static const dns::ByteVector kAddr{192, 0, 2, 1};
+  msg.hdr.flags = static_cast<uint16_t>(dns::kFlagQR | (msg.hdr.flags & (dns::kOpcodeMask | dns::kFlagRD)) |
+                                        dns::kFlagRA);
+  msg.answer.clear();
+  msg.authority.clear();
+  msg.additional.clear();
+  for (const auto& q : msg.question) {
+    if (q.type == dns::QType::A && q.klass == dns::QClass::IN)
+      msg.answer.push_back(dns::RR{q.name, dns::RRType::A, dns::RRClass::IN, 60, kAddr});
   }
+}
 
-  Codec& operator<<(const QuestionVector& v) {
-    for (const auto& i : v)
-      *this << i;
-    return *this;
+// Answers every query received on addr with respond(), batching with
+// recvmmsg and sendmmsg.  With a cache, responses are kept and repeated
+// questions answered from it.  With drop > 0 every drop-th query is
+// ignored, to exercise the client's retries.
+int Serve(const std::string& addr, const Responder& respond, dns::Cache* cache, unsigned drop) {
+  const size_t kBatch = dns::Conn::kBatch;
+  const size_t kMaxPacket = dns::Conn::kMaxPacket;
+  int s = dns::OpenUdp(addr, true);
+  if (s == -1) {
+    std::cerr << "listen " << addr << ": " << strerror(errno) << std::endl;
+    return 1;
   }
 
-  Codec& operator<<(const RRVector& v) {
-    for (const auto& i : v)
-      *this << i;
-    return *this;
-  }
+  dns::ByteVector in(kBatch * kMaxPacket);
+  dns::ByteVector hits(kBatch * kMaxPacket);
+  std::vector<dns::Codec> out(kBatch);
+  std::vector<sockaddr_storage> peers(kBatch);
+  std::vector<mmsghdr> msgs(kBatch);
+  std::vector<iovec> iov(kBatch);
+  dns::Codec decoder;
+  dns::Msg msg;
+  dns::FlatMsg query, reply;
+  unsigned long received = 0;
+  // Cache counters are logged every so many queries.
+  const unsigned long kReportEvery = 1 << 20;
+  unsigned long next_report = kReportEvery;
+
+  for ( ;; ) {
+    pollfd pfd;
+    pfd.fd = s;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+      std::cerr << "poll: " << strerror(errno) << std::endl;
+      return 1;
+    }
 
-  Codec& operator<<(const ByteVector& bytes) {
-    GrowIfNeeded(bytes.size());
-    memcpy(&buf_[pos_], bytes.data(), bytes.size());
-    pos_ += bytes.size();
-    return *this;
-  }
+    for (size_t i = 0; i < kBatch; ++i) {
+      iov[i].iov_base = &in[i * kMaxPacket];
+      iov[i].iov_len = kMaxPacket;
+      memset(&msgs[i], 0, sizeof(msgs[i]));
+      msgs[i].msg_hdr.msg_name = &peers[i];
+      msgs[i].msg_hdr.msg_namelen = sizeof(peers[i]);
+      msgs[i].msg_hdr.msg_iov = &iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    int n = recvmmsg(s, msgs.data(), kBatch, MSG_DONTWAIT, nullptr);
+    if (n == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        continue;
+      std::cerr << "recvmmsg: " << strerror(errno) << std::endl;
+      return 1;
+    }
 
-  Codec& operator<<(const std::string& name) {
-    const ByteVector::size_type npos = ~static_cast<ByteVector::size_type>(0);
-    ByteVector::size_type len_pos = npos;
-    for (size_t i = 0; i < name.size(); ++i) {
-      uint8_t ch = static_cast<uint8_t>(name[i]);
-      if (ch == '.' || len_pos == npos) {
-        if (pos_ > 0 && len_pos == pos_ - 1)
-          continue; // Skip repeating dots.
-        GrowIfNeeded(1);
-        len_pos = pos_;
-        buf_[pos_++] = 0;
-        if (ch == '.')
+    // Replies are packed to the front of msgs, reusing each query's peer.
+    size_t replies = 0;
+    for (int i = 0; i < n; ++i) {
+      ++received;
+      if (drop > 0 && received % drop == 0)
+        continue;
+      const uint8_t* data = &in[i * kMaxPacket];
+      size_t size = msgs[i].msg_len;
+      size_t hit = 0;
+      if (cache != nullptr && query.Parse(data, size) && !(query.hdr.flags & dns::kFlagQR))
+        hit = cache->Lookup(query, &hits[replies * kMaxPacket], kMaxPacket);
+      if (hit != 0) {
+        iov[replies].iov_base = &hits[replies * kMaxPacket];
+        iov[replies].iov_len = hit;
+      } else {
+        if (!(decoder.Load(data, size) >> msg) || (msg.hdr.flags & dns::kFlagQR))
           continue;
+        respond(msg);
+        dns::Codec& codec = out[replies];
+        codec.Compress(true).Rewind() << msg;
+        if (!codec)
+          continue;
+        if (cache != nullptr && reply.Parse(codec.Data(), codec.Size()))
+          cache->Insert(reply);
+        iov[replies].iov_base = const_cast<uint8_t*>(codec.Data());
+        iov[replies].iov_len = codec.Size();
       }
-      ++buf_[len_pos];
-      GrowIfNeeded(1);
-      buf_[pos_++] = ch;
+      msgs[replies].msg_hdr.msg_name = msgs[i].msg_hdr.msg_name;
+      msgs[replies].msg_hdr.msg_namelen = msgs[i].msg_hdr.msg_namelen;
+      msgs[replies].msg_hdr.msg_iov = &iov[replies];
+      msgs[replies].msg_hdr.msg_iovlen = 1;
+      ++replies;
     }
-    if (name.empty() || name[name.size() - 1] != '.') {
-      GrowIfNeeded(1);
-      buf_[pos_++] = 0;
+    // Replies that do not fit in the socket buffer are dropped, as a busy
+    // server would.
+    for (size_t sent = 0; sent < replies; ) {
+      int k = sendmmsg(s, &msgs[sent], static_cast<unsigned>(replies - sent), MSG_DONTWAIT);
+      if (k == -1) {
+        if (errno == EINTR)
+          continue;
+        break;
+      }
+      sent += k;
     }
-    return *this;
-  }
-
-  Codec& operator<<(const Question& q) {
-    *this << q.name
-          << q.type
-          << q.klass;
-    return *this;
-  }
 
-  Codec& operator<<(const RR& rr) {
-    *this << rr.name
-          << rr.type
-          << rr.klass
-          << rr.ttl
-          << static_cast<uint16_t>(rr.rdata.size())
-          << rr.rdata;
-    return *this;
-  }
-};
-
-/*
-struct Tree {
-  std::string name;
-  int32_t ttl;
-  RRVector rrs;
-  std::vector<Tree> child;
-
-  Tree& operator<<(Tree&& t) {
-    auto node = Find(t.name);
-    if (node.name == t.name)
-      node = t;
-    else
-      node.child.push_back(t);
-    return *this;
-  }
-
-  Tree& operator<<(RR&& rr) {
-    rrs.push_back(rr);
-    return *this;
-  }
-
-  // FIXME see also <<
-  Tree& Find(const std::string&) {
-    return *this;
+    if (cache != nullptr && received >= next_report) {
+      dns::CacheStats st = cache->Stats();
+      std::clog << "cache hits: " << st.hits << ", misses: " << st.misses
+                << ", expired: " << st.expired << ", inserts: " << st.inserts
+                << ", evictions: " << st.evictions << std::endl;
+      next_report = received + kReportEvery;
+    }
   }
-};
-*/
-
-std::string& Fqdn(std::string& name) {
-  if (!name.empty() && name[name.size() - 1] != '.')
-    name += '.';
-  return name;
 }
 
-/* FIXME
-class Conn {
- public:
-  Conn(const std::string& addr) {
-  }
+void Usage() {
+  std::cerr << "usage: dns [-c] name ...\n"
+               "       dns -r server[:port] [-n tries] [-t ms] [-w window] [file]\n"
+               "       dns -s [addr]:port [-C entries] [-d n] [-z zonefile]\n"
+               "The first form prints the queries for the names given, -c packs them\n"
+               "into one compressed query.  -r resolves the A records of the names in\n"
+               "file, or standard input, one per line.  -s runs a stub server that\n"
+               "answers every A query with 192.0.2.1 and, with -d, ignores every n-th\n"
+               "query.  With -z it answers authoritatively from a zone file instead.\n"
+               "-C caches up to that many responses." << std::endl;
+}
 
-  Msg&& Exchange(const Codec& codec) {
-    return std::move(Msg{});
+int main(int argc, char** argv) {
+  int ch;
+  bool compress = false;
+  const char* server = nullptr;
+  const char* listen = nullptr;
+  const char* zonefile = nullptr;
+  unsigned drop = 0;
+  size_t cache_size = 0;
+  dns::Conn conn;
+
+  while ((ch = getopt(argc, argv, "C:cd:hn:r:s:t:w:z:")) != -1) {
+    switch (ch) {
+      case 'C':
+        cache_size = static_cast<size_t>(atol(optarg));
+        break;
+      case 'c':
+        compress = true;
+        break;
+      case 'd':
+        drop = static_cast<unsigned>(atoi(optarg));
+        break;
+      case 'h':
+        Usage();
+        return 0;
+      case 'n':
+        conn.Tries(atoi(optarg));
+        break;
+      case 'r':
+        server = optarg;
+        break;
+      case 's':
+        listen = optarg;
+        break;
+      case 't':
+        conn.Timeout(atoi(optarg));
+        break;
+      case 'w':
+        conn.Window(static_cast<size_t>(atol(optarg)));
+        break;
+      case 'z':
+        zonefile = optarg;
+        break;
+      default:
+        Usage();
+        return 1;
+    }
   }
-
-  Msg&& Exchange(const Msg& msg) {
-    return Exchange(Codec{} << msg);
+  argc -= optind;
+  argv += optind;
+
+  std::unique_ptr<dns::Cache> cache;
+  if (cache_size > 0)
+    cache.reset(new dns::Cache(cache_size));
+
+  if (listen != nullptr && zonefile != nullptr) {
+    dns::Zone zone;
+    std::ifstream in(zonefile);
+    std::string error;
+    if (!in) {
+      std::cerr << zonefile << ": " << strerror(errno) << std::endl;
+      return 1;
+    }
+    if (!zone.Load(in, "", &error)) {
+      std::cerr << zonefile << ": " << error << std::endl;
+      return 1;
+    }
+    std::clog << "serving " << zone.Origin() << " on " << listen << std::endl;
+    return Serve(listen, [&zone](dns::Msg& msg) { zone.Answer(msg); }, cache.get(), drop);
   }
-
- private:
-  int sock_;
-};
-*/
-
-} // namespace dns
-
-std::string Dump(const uint8_t* ptr, size_t size) {
-  const char hex[] = { '0', '1', '2', '3', '4', '5', '6', '7', '8', '9',
-                       'a', 'b', 'c', 'd', 'e', 'f' };
-  std::ostringstream ostr;
-  ostr << std::hex;
-  for (size_t i = 0; i < size; ++i) {
-    if (i != 0 && (i % 8) == 0)
-      ostr << std::endl;
-    else if (i != 0 && (i % 4) == 0)
-      ostr << ' ';
-    uint8_t ch = *(ptr++);
-    ostr << hex[ch >> 4] << hex[ch & 0xf];
+  if (listen != nullptr)
+    return Serve(listen, StubAnswer, cache.get(), drop);
+  if (server == nullptr)
+    return PrintQueries(argc, argv, compress);
+
+  if (!conn.Dial(server)) {
+    std::cerr << "dial " << server << ": " << strerror(errno) << std::endl;
+    return 1;
   }
-  return ostr.str();
-}
-
-int main(int argc, char** argv) {
-  dns::Codec codec;
-
-  while (++argv, --argc) {
-    dns::Msg msg;
-    msg << dns::Question{*argv, dns::QType::A, dns::QClass::IN};
-    codec.Rewind() << msg;
-    std::cout << "ptr: " << static_cast<const void*>(codec.Data()) << ", size: " << codec.Size() << std::endl;
-    std::cout << Dump(codec.Data(), codec.Size());
-    std::cout << std::endl;
-    write(STDERR_FILENO, codec.Data(), codec.Size());
+  if (argc == 0)
+    return Resolve(conn, std::cin);
+  std::ifstream in(argv[0]);
+  if (!in) {
+    std::cerr << argv[0] << ": " << strerror(errno) << std::endl;
+    return 1;
   }
-
-  return 0;
+  return Resolve(conn, in);
 }
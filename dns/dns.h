@@ -0,0 +1,614 @@
+// Copyright (c) 2016 Sviatoslav Chagaev <sviatoslav.chagaev@gmail.com>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#ifndef DNS_DNS_H_
+#define DNS_DNS_H_
+
+#include <cctype>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <utility>
+#include <cstdint>
+#include <climits>
+#include <cstring>
+#include <cstddef>
+
+#include "name.h"
+
+namespace dns {
+
+typedef std::vector<uint8_t> ByteVector;
+
+enum class RRType : uint16_t {
+  A = 1,
+  NS = 2,
+  MD = 3,
+  MF = 4,
+  CNAME = 5,
+  SOA = 6,
+  MB = 7,
+  MG = 8,
+  MR = 9,
+  RR_NULL = 10,
+  WKS = 11,
+  PTR = 12,
+  HINFO = 13,
+  MINFO = 14,
+  MX = 15,
+  TXT = 16,
+  AAAA = 28
+};
+
+enum class QType : uint16_t {
+  A = 1,
+  NS = 2,
+  MD = 3,
+  MF = 4,
+  CNAME = 5,
+  SOA = 6,
+  MB = 7,
+  MG = 8,
+  MR = 9,
+  RR_NULL = 10,
+  WKS = 11,
+  PTR = 12,
+  HINFO = 13,
+  MINFO = 14,
+  MX = 15,
+  TXT = 16,
+  AAAA = 28,
+
+  AXFR = 252,
+  MAILB = 253,
+  MAILA = 254,
+  ANY = 255
+};
+
+enum class RRClass : uint16_t {
+  IN = 1,
+  CS = 2,
+  CH = 3,
+  HS = 4
+};
+
+enum class QClass : uint16_t {
+  IN = 1,
+  CS = 2,
+  CH = 3,
+  HS = 4,
+  ANY = 255
+};
+
+struct RR {
+  std::string name;
+  RRType type;
+  RRClass klass;
+  int32_t ttl;
+  ByteVector rdata;
+};
+typedef std::vector<RR> RRVector;
+
+struct Question {
+  std::string name;
+  QType type;
+  QClass klass;
+};
+typedef std::vector<Question> QuestionVector;
+
+// FIXME
+struct Hdr {
+  uint16_t id;
+  uint16_t flags;
+};
+
+// Bits of Hdr::flags.
+const uint16_t kFlagQR = 0x8000;
+const uint16_t kOpcodeMask = 0x7800;
+const uint16_t kFlagAA = 0x0400;
+const uint16_t kFlagTC = 0x0200;
+const uint16_t kFlagRD = 0x0100;
+const uint16_t kFlagRA = 0x0080;
+const uint16_t kRcodeMask = 0x000f;
+
+struct Msg {
+  Hdr hdr;
+  QuestionVector question;
+  RRVector answer;
+  RRVector authority;
+  RRVector additional;
+
+  Msg& operator<<(Question&& q) {
+    question.push_back(q);
+    return *this;
+  }
+
+  Msg& operator<<(const Question& q) {
+    question.push_back(q);
+    return *this;
+  }
+};
+
+// Longest chain of compression pointers followed for one name.
+const int kMaxPointers = 32;
+
+// Walks the possibly compressed name at *pos in the message msg of the given
+// size, calling label() with a pointer to each length-prefixed label, the
+// final empty one included, and moves *pos past the name.  Every pointer has
+// to point before the labels it was reached from, so a chain of them can
+// neither loop nor run forward, and at most kMaxPointers are followed.
+// Returns false if the name is malformed.
+template <typename F>
+bool WalkName(const uint8_t* msg, size_t size, size_t* pos, F label) {
+  size_t p = *pos, limit = *pos, end = 0, wire_size = 0;
+  int pointers = 0;
+
+  for ( ;; ) {
+    if (p >= size)
+      return false;
+    uint8_t len = msg[p];
+    if ((len & 0xc0) == 0xc0) {
+      if (p + 1 >= size)
+        return false;
+      size_t target = (static_cast<size_t>(len & 0x3f) << CHAR_BIT) | msg[p + 1];
+      if (pointers == 0)
+        end = p + 2;
+      if (target >= limit || ++pointers > kMaxPointers)
+        return false;
+      p = limit = target;
+      continue;
+    }
+    if (len & 0xc0)
+      return false;  // Reserved label types.
+    wire_size += len + 1;
+    if (wire_size > 255 || p + 1 + len > size)
+      return false;
+    label(&msg[p]);
+    if (len == 0)
+      break;
+    p += 1 + len;
+  }
+  *pos = pointers == 0 ? p + 1 : end;
+  return true;
+}
+
+// Encodes and decodes DNS messages to and from wire format.
+// Example:
+//   dns::Codec codec;
+//   dns::Msg msg;
+//   msg << dns::Question{"google.com", dns::QType::A, dns::QClass::IN};
+//   codec << msg;
+//   write(udp_sock, codec.Data(), codec.Size());
+//
+//   ssize_t n = read(udp_sock, buf, sizeof(buf));
+//   dns::Msg reply;
+//   if (!(codec.Load(buf, n) >> reply))
+//     ...  // malformed
+//
+// Like an iostream, a Codec that met malformed input or a name it cannot
+// encode is marked failed; further operations do nothing until Rewind().
+// Decoded names are fully qualified ("google.com."), and names inside the
+// RDATA of well-known types are expanded, so RR::rdata never depends on
+// the message it came from.
+class Codec {
+ public:
+  // Makes the encoder replace repeated name suffixes with pointers to their
+  // first occurrence (RFC 1035 4.1.4).  Only owner and question names are
+  // compressed, which any decoder handles.
+  Codec& Compress(bool on) {
+    compress_ = on;
+    return *this;
+  }
+
+  // Rewinds the data stream to the beginning: next Msg write will overwrite
+  // what's already in Codec and next Msg read will start from the beginning.
+  Codec& Rewind() {
+    pos_ = 0;
+    fail_ = false;
+    return *this;
+  }
+
+  // Rewinds the data stream to the beginning and resizes the underlying 
+  Codec& Resize(ByteVector::size_type size) {
+    buf_.resize(size);
+    pos_ = 0;
+    fail_ = false;
+    return *this;
+  }
+
+  // Replaces the data held by Codec with a wire format message to decode.
+  Codec& Load(const uint8_t* data, ByteVector::size_type size) {
+    buf_.assign(data, data + size);
+    pos_ = 0;
+    fail_ = false;
+    return *this;
+  }
+
+  bool Fail() const {
+    return fail_;
+  }
+
+  explicit operator bool() const {
+    return !fail_;
+  }
+
+  // Returns the pointer to raw data currently held by Codec.
+  const uint8_t* Data() const {
+    return buf_.data();
+  }
+
+  // Returns the size of raw data currently held by Codec, i.e. the size of
+  // DNS messages encoded into wire format currently held by Codec.
+  ByteVector::size_type Size() const {
+    return pos_;
+  }
+
+  ByteVector::size_type Capacity() const {
+    return buf_.size();
+  }
+
+  // Encodes a DNS message into wire format.
+  Codec& operator<<(const Msg& msg) {
+    msg_start_ = pos_;
+    suffixes_.clear();
+    *this << msg.hdr.id
+          << msg.hdr.flags
+          << static_cast<uint16_t>(msg.question.size())
+          << static_cast<uint16_t>(msg.answer.size())
+          << static_cast<uint16_t>(msg.authority.size())
+          << static_cast<uint16_t>(msg.additional.size())
+          << msg.question
+          << msg.answer
+          << msg.authority
+          << msg.additional;
+    return *this;
+  }
+
+  // Decodes a DNS message from wire format, starting at the current
+  // position, which is left just past it.
+  Codec& operator>>(Msg& msg) {
+    uint16_t qdcount = 0, ancount = 0, nscount = 0, arcount = 0;
+    msg_start_ = pos_;
+    *this >> msg.hdr.id
+          >> msg.hdr.flags
+          >> qdcount
+          >> ancount
+          >> nscount
+          >> arcount;
+    Read(qdcount, msg.question);
+    Read(ancount, msg.answer);
+    Read(nscount, msg.authority);
+    Read(arcount, msg.additional);
+    return *this;
+  }
+
+ private:
+  ByteVector buf_;
+  ByteVector::size_type pos_ = 0;
+  ByteVector::size_type msg_start_ = 0;
+  bool fail_ = false;
+  bool compress_ = false;
+  // Offsets of the name suffixes written so far in the current message,
+  // keyed by their lower-cased dotted form.
+  std::unordered_map<std::string, uint16_t> suffixes_;
+
+  bool SetFail() {
+    fail_ = true;
+    return false;
+  }
+
+  bool Need(ByteVector::size_type size) {
+    if (!fail_ && buf_.size() - pos_ < size)
+      fail_ = true;
+    return !fail_;
+  }
+
+  Codec& operator>>(uint16_t& i) {
+    if (Need(sizeof(i))) {
+      i = static_cast<uint16_t>((buf_[pos_] << CHAR_BIT) | buf_[pos_ + 1]);
+      pos_ += sizeof(i);
+    }
+    return *this;
+  }
+
+  Codec& operator>>(int32_t& i) {
+    if (Need(sizeof(i))) {
+      i = static_cast<int32_t>((static_cast<uint32_t>(buf_[pos_]) << (CHAR_BIT * 3)) |
+                               (static_cast<uint32_t>(buf_[pos_ + 1]) << (CHAR_BIT * 2)) |
+                               (static_cast<uint32_t>(buf_[pos_ + 2]) << CHAR_BIT) |
+                               buf_[pos_ + 3]);
+      pos_ += sizeof(i);
+    }
+    return *this;
+  }
+
+  template <typename T>
+  Codec& operator>>(T& v) {
+    uint16_t i = 0;
+    *this >> i;
+    v = static_cast<T>(i);
+    return *this;
+  }
+
+  template <typename T>
+  void Read(uint16_t count, std::vector<T>& v) {
+    v.clear();
+    for (uint16_t i = 0; i < count && !fail_; ++i) {
+      v.emplace_back();
+      *this >> v.back();
+    }
+    if (fail_)
+      v.clear();
+  }
+
+  // Reads a possibly compressed name at the current position into its
+  // dotted form and/or its uncompressed wire form.
+  bool ReadName(std::string* name, ByteVector* wire) {
+    ByteVector::size_type pos = pos_ - msg_start_;
+    if (name != nullptr)
+      name->clear();
+    bool ok = WalkName(&buf_[msg_start_], buf_.size() - msg_start_, &pos,
+        [&](const uint8_t* label) {
+          if (wire != nullptr)
+            wire->insert(wire->end(), label, label + 1 + *label);
+          if (name != nullptr && *label != 0) {
+            name->append(reinterpret_cast<const char*>(label + 1), *label);
+            *name += '.';
+          }
+        });
+    if (!ok)
+      return SetFail();
+    pos_ = msg_start_ + pos;
+    if (name != nullptr && name->empty())
+      *name = ".";
+    return true;
+  }
+
+  Codec& operator>>(std::string& name) {
+    if (!fail_)
+      ReadName(&name, nullptr);
+    return *this;
+  }
+
+  Codec& operator>>(Question& q) {
+    *this >> q.name
+          >> q.type
+          >> q.klass;
+    return *this;
+  }
+
+  Codec& operator>>(RR& rr) {
+    uint16_t rdlength = 0;
+    *this >> rr.name
+          >> rr.type
+          >> rr.klass
+          >> rr.ttl
+          >> rdlength;
+    if (!Need(rdlength))
+      return *this;
+    ByteVector::size_type end = pos_ + rdlength;
+    rr.rdata.clear();
+    if (!ReadRdata(rr.type, end, rr.rdata) || pos_ != end)
+      fail_ = true;
+    pos_ = end;
+    return *this;
+  }
+
+  // Copies the RDATA ending at end into rdata with any names in it
+  // expanded.
+  bool ReadRdata(RRType type, ByteVector::size_type end, ByteVector& rdata) {
+    ByteVector::size_type fixed = 0;
+    int names = 0;
+    switch (type) {
+      case RRType::NS:
+      case RRType::MD:
+      case RRType::MF:
+      case RRType::CNAME:
+      case RRType::MB:
+      case RRType::MG:
+      case RRType::MR:
+      case RRType::PTR:
+        names = 1;
+        break;
+      case RRType::MINFO:
+        names = 2;
+        break;
+      case RRType::MX:
+        fixed = 2;  // PREFERENCE precedes EXCHANGE.
+        if (!Need(fixed))
+          return false;
+        rdata.insert(rdata.end(), &buf_[pos_], &buf_[pos_] + fixed);
+        pos_ += fixed;
+        fixed = 0;
+        names = 1;
+        break;
+      case RRType::SOA:
+        names = 2;
+        fixed = 20;  // SERIAL, REFRESH, RETRY, EXPIRE and MINIMUM follow.
+        break;
+      default:
+        rdata.assign(buf_.begin() + pos_, buf_.begin() + end);
+        pos_ = end;
+        return true;
+    }
+    for (int i = 0; i < names; ++i)
+      if (!ReadName(nullptr, &rdata))
+        return false;
+    if (!Need(fixed))
+      return false;
+    rdata.insert(rdata.end(), buf_.begin() + pos_, buf_.begin() + pos_ + fixed);
+    pos_ += fixed;
+    return true;
+  }
+
+  void GrowIfNeeded(ByteVector::size_type size) {
+    if (buf_.size() < (pos_ + size))
+      buf_.resize(pos_ + size);
+  }
+
+  Codec& operator<<(int32_t i) {
+    if (fail_)
+      return *this;
+    GrowIfNeeded(sizeof(i));
+    buf_[pos_++] = static_cast<uint8_t>((i >> (CHAR_BIT * 3)) & 0xff);
+    buf_[pos_++] = static_cast<uint8_t>((i >> (CHAR_BIT * 2)) & 0xff);
+    buf_[pos_++] = static_cast<uint8_t>((i >> CHAR_BIT) & 0xff);
+    buf_[pos_++] = static_cast<uint8_t>(i & 0xff);
+    return *this;
+  }
+
+  Codec& operator<<(uint16_t i) {
+    if (fail_)
+      return *this;
+    GrowIfNeeded(sizeof(i));
+    buf_[pos_++] = static_cast<uint8_t>(i >> CHAR_BIT);
+    buf_[pos_++] = static_cast<uint8_t>(i & 0xff);
+    return *this;
+  }
+
+  Codec& operator<<(RRType v) {
+    *this << static_cast<uint16_t>(v);
+    return *this;
+  }
+
+  Codec& operator<<(QType v) {
+    *this << static_cast<uint16_t>(v);
+    return *this;
+  }
+
+  Codec& operator<<(RRClass v) {
+    *this << static_cast<uint16_t>(v);
+    return *this;
+  }
+
+  Codec& operator<<(QClass v) {
+    *this << static_cast<uint16_t>(v);
+    return *this;
+  }
+
+  Codec& operator<<(const QuestionVector& v) {
+    for (const auto& i : v)
+      *this << i;
+    return *this;
+  }
+
+  Codec& operator<<(const RRVector& v) {
+    for (const auto& i : v)
+      *this << i;
+    return *this;
+  }
+
+  Codec& operator<<(const ByteVector& bytes) {
+    if (fail_)
+      return *this;
+    GrowIfNeeded(bytes.size());
+    memcpy(&buf_[pos_], bytes.data(), bytes.size());
+    pos_ += bytes.size();
+    return *this;
+  }
+
+  Codec& operator<<(const std::string& name) {
+    if (fail_)
+      return *this;
+    if (compress_)
+      return WriteCompressed(name);
+    GrowIfNeeded(name.size() + 2);
+    size_t n = EncodeNameFast(name.data(), name.size(), &buf_[pos_]);
+    if (n == 0)
+      fail_ = true;
+    pos_ += n;
+    return *this;
+  }
+
+  // Writes name's labels up to the longest suffix already in the message,
+  // then a pointer to that suffix, and remembers the new suffixes.
+  Codec& WriteCompressed(const std::string& name) {
+    std::vector<std::pair<std::string::size_type, std::string::size_type>> labels;
+    std::string::size_type i = 0, size = 1;
+    while (i < name.size()) {
+      std::string::size_type dot = name.find('.', i);
+      if (dot == std::string::npos)
+        dot = name.size();
+      if (dot > i) {
+        if (dot - i > 63)
+          fail_ = true;
+        labels.emplace_back(i, dot - i);
+        size += dot - i + 1;
+      }
+      i = dot + 1;
+    }
+    if (size > 255)
+      fail_ = true;
+    if (fail_)
+      return *this;
+
+    std::string key;
+    std::string::size_type n = 0;
+    uint16_t target = 0;
+    for (n = 0; n < labels.size(); ++n) {
+      key.clear();
+      for (auto l = labels.begin() + n; l != labels.end(); ++l) {
+        if (!key.empty())
+          key += '.';
+        for (auto j = l->first; j < l->first + l->second; ++j)
+          key += static_cast<char>(tolower(static_cast<unsigned char>(name[j])));
+      }
+      auto it = suffixes_.find(key);
+      if (it != suffixes_.end()) {
+        target = it->second;
+        break;
+      }
+      if (pos_ - msg_start_ <= 0x3fff)
+        suffixes_.emplace(key, static_cast<uint16_t>(pos_ - msg_start_));
+      GrowIfNeeded(1 + labels[n].second);
+      buf_[pos_++] = static_cast<uint8_t>(labels[n].second);
+      memcpy(&buf_[pos_], name.data() + labels[n].first, labels[n].second);
+      pos_ += labels[n].second;
+    }
+    if (n < labels.size())
+      *this << static_cast<uint16_t>(0xc000 | target);
+    else {
+      GrowIfNeeded(1);
+      buf_[pos_++] = 0;
+    }
+    return *this;
+  }
+
+  Codec& operator<<(const Question& q) {
+    *this << q.name
+          << q.type
+          << q.klass;
+    return *this;
+  }
+
+  Codec& operator<<(const RR& rr) {
+    *this << rr.name
+          << rr.type
+          << rr.klass
+          << rr.ttl
+          << static_cast<uint16_t>(rr.rdata.size())
+          << rr.rdata;
+    return *this;
+  }
+};
+
+inline std::string& Fqdn(std::string& name) {
+  if (!name.empty() && name[name.size() - 1] != '.')
+    name += '.';
+  return name;
+}
+
+} // namespace dns
+
+#endif  // DNS_DNS_H_
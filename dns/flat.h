@@ -0,0 +1,307 @@
+// Copyright (c) 2016 Sviatoslav Chagaev <sviatoslav.chagaev@gmail.com>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#ifndef DNS_FLAT_H_
+#define DNS_FLAT_H_
+
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <climits>
+#include <cstring>
+#include <cstddef>
+
+#include "dns.h"
+
+namespace dns {
+
+// A range of bytes in a FlatMsg arena.
+struct Span {
+  uint32_t off;
+  uint32_t len;
+};
+
+struct FlatQuestion {
+  Span name;
+  QType type;
+  QClass klass;
+};
+
+// rdata points into the packet the record was parsed from, or into the
+// caller's buffer for records added with FlatMsg::Add(), and is copied
+// verbatim: names inside it may be compressed against that packet.
+struct FlatRR {
+  Span name;
+  RRType type;
+  RRClass klass;
+  int32_t ttl;
+  const uint8_t* rdata;
+  uint16_t rdlength;
+};
+
+// A DNS message laid out flat: names live uncompressed in wire form in one
+// byte arena and records refer to them by offset.  The arena and the record
+// vectors keep their capacity across Parse() and Clear(), so a FlatMsg that
+// is reused for every packet decodes and encodes without touching the heap
+// once it has seen a message as large as the current one.
+// Example:
+//   dns::FlatMsg msg;
+//   uint8_t buf[512];
+//   msg.Clear(0x1234, 0x0100);
+//   msg.Add("google.com", dns::QType::A, dns::QClass::IN);
+//   size_t n = msg.Encode(buf, sizeof(buf));
+//   ...
+//   if (!msg.Parse(buf, n))
+//     ...  // malformed
+//   std::string name = msg.Name(msg.question[0].name);
+class FlatMsg {
+ public:
+  Hdr hdr;
+  std::vector<FlatQuestion> question;
+  std::vector<FlatRR> answer;
+  std::vector<FlatRR> authority;
+  std::vector<FlatRR> additional;
+
+  // Empties the message and sets its header.
+  void Clear(uint16_t id = 0, uint16_t flags = 0) {
+    hdr.id = id;
+    hdr.flags = flags;
+    question.clear();
+    answer.clear();
+    authority.clear();
+    additional.clear();
+    used_ = 0;
+    packet_ = nullptr;
+    packet_size_ = 0;
+  }
+
+  // Adds a question for the dotted name of the given length.  Returns false,
+  // leaving the message as it was, if the name cannot be encoded.
+  bool Add(const char* name, size_t len, QType type, QClass klass) {
+    Span span;
+    if (!AddName(name, len, &span))
+      return false;
+    question.push_back(FlatQuestion{span, type, klass});
+    return true;
+  }
+
+  bool Add(const char* name, QType type, QClass klass) {
+    return Add(name, strlen(name), type, klass);
+  }
+
+  // Adds a record to section, which is one of answer, authority or
+  // additional.  rdata is not copied and has to outlive the message.
+  bool Add(std::vector<FlatRR>& section, const char* name, size_t len, RRType type,
+           RRClass klass, int32_t ttl, const uint8_t* rdata, uint16_t rdlength) {
+    Span span;
+    if (!AddName(name, len, &span))
+      return false;
+    section.push_back(FlatRR{span, type, klass, ttl, rdata, rdlength});
+    return true;
+  }
+
+  // Decodes the wire format message data of the given size, which has to
+  // outlive the message as long as rdata is looked at.  Returns false if the
+  // message is malformed, in which case its contents are unspecified.
+  bool Parse(const uint8_t* data, size_t size) {
+    size_t pos = 0;
+    uint16_t qdcount, ancount, nscount, arcount;
+
+    Clear();
+    packet_ = data;
+    packet_size_ = size;
+    if (size < 12)
+      return false;
+    hdr.id = Get16(data);
+    hdr.flags = Get16(data + 2);
+    qdcount = Get16(data + 4);
+    ancount = Get16(data + 6);
+    nscount = Get16(data + 8);
+    arcount = Get16(data + 10);
+    pos = 12;
+
+    for (uint16_t i = 0; i < qdcount; ++i) {
+      FlatQuestion q;
+      if (!ParseName(data, size, &pos, &q.name) || size - pos < 4)
+        return false;
+      q.type = static_cast<QType>(Get16(data + pos));
+      q.klass = static_cast<QClass>(Get16(data + pos + 2));
+      pos += 4;
+      question.push_back(q);
+    }
+    return ParseSection(data, size, &pos, ancount, answer) &&
+           ParseSection(data, size, &pos, nscount, authority) &&
+           ParseSection(data, size, &pos, arcount, additional);
+  }
+
+  // Encodes the message into buf, uncompressed.  Returns the size of the
+  // message or 0 if it does not fit.  rdata goes out as is, so a parsed
+  // record whose rdata holds compressed names cannot be re-encoded this way.
+  size_t Encode(uint8_t* buf, size_t size) const {
+    size_t need = 12;
+    for (const auto& q : question)
+      need += q.name.len + 4;
+    need += SectionSize(answer) + SectionSize(authority) + SectionSize(additional);
+    if (need > size)
+      return 0;
+
+    uint8_t* p = buf;
+    p = Put16(p, hdr.id);
+    p = Put16(p, hdr.flags);
+    p = Put16(p, static_cast<uint16_t>(question.size()));
+    p = Put16(p, static_cast<uint16_t>(answer.size()));
+    p = Put16(p, static_cast<uint16_t>(authority.size()));
+    p = Put16(p, static_cast<uint16_t>(additional.size()));
+    for (const auto& q : question) {
+      p = PutName(p, q.name);
+      p = Put16(p, static_cast<uint16_t>(q.type));
+      p = Put16(p, static_cast<uint16_t>(q.klass));
+    }
+    p = PutSection(p, answer);
+    p = PutSection(p, authority);
+    p = PutSection(p, additional);
+    return static_cast<size_t>(p - buf);
+  }
+
+  // Returns the wire form of the name at span.
+  const uint8_t* NameData(Span span) const {
+    return &arena_[span.off];
+  }
+
+  // Returns the name at span in dotted, fully qualified form.  Allocates,
+  // so it is meant for printing.
+  std::string Name(Span span) const {
+    std::string name;
+    for (const uint8_t* p = NameData(span); *p != 0; p += 1 + *p) {
+      name.append(reinterpret_cast<const char*>(p + 1), *p);
+      name += '.';
+    }
+    return name.empty() ? "." : name;
+  }
+
+  // Returns the total size of the names held.
+  size_t ArenaSize() const {
+    return used_;
+  }
+
+  // Returns the packet last given to Parse(), or null if the message was
+  // built with Add().
+  const uint8_t* Packet() const {
+    return packet_;
+  }
+
+  size_t PacketSize() const {
+    return packet_size_;
+  }
+
+ private:
+  ByteVector arena_;
+  size_t used_ = 0;
+  const uint8_t* packet_ = nullptr;
+  size_t packet_size_ = 0;
+
+  static uint16_t Get16(const uint8_t* p) {
+    return static_cast<uint16_t>((p[0] << CHAR_BIT) | p[1]);
+  }
+
+  static uint8_t* Put16(uint8_t* p, uint16_t i) {
+    p[0] = static_cast<uint8_t>(i >> CHAR_BIT);
+    p[1] = static_cast<uint8_t>(i & 0xff);
+    return p + 2;
+  }
+
+  static size_t SectionSize(const std::vector<FlatRR>& section) {
+    size_t size = 0;
+    for (const auto& rr : section)
+      size += rr.name.len + 10 + rr.rdlength;
+    return size;
+  }
+
+  uint8_t* PutName(uint8_t* p, Span span) const {
+    memcpy(p, &arena_[span.off], span.len);
+    return p + span.len;
+  }
+
+  uint8_t* PutSection(uint8_t* p, const std::vector<FlatRR>& section) const {
+    for (const auto& rr : section) {
+      p = PutName(p, rr.name);
+      p = Put16(p, static_cast<uint16_t>(rr.type));
+      p = Put16(p, static_cast<uint16_t>(rr.klass));
+      p = Put16(p, static_cast<uint16_t>(static_cast<uint32_t>(rr.ttl) >> 16));
+      p = Put16(p, static_cast<uint16_t>(rr.ttl & 0xffff));
+      p = Put16(p, rr.rdlength);
+      if (rr.rdlength != 0)
+        memcpy(p, rr.rdata, rr.rdlength);
+      p += rr.rdlength;
+    }
+    return p;
+  }
+
+  bool AddName(const char* name, size_t len, Span* span) {
+    size_t n = EncodeNameFast(name, len, Reserve(len + 2));
+    if (n == 0)
+      return false;
+    *span = Span{static_cast<uint32_t>(used_), static_cast<uint32_t>(n)};
+    used_ += n;
+    return true;
+  }
+
+  // Returns room for size more bytes at the end of the arena.  The arena
+  // only ever grows.
+  uint8_t* Reserve(size_t size) {
+    if (arena_.size() - used_ < size)
+      arena_.resize(std::max(2 * arena_.size(), used_ + size));
+    return &arena_[used_];
+  }
+
+  bool ParseName(const uint8_t* data, size_t size, size_t* pos, Span* span) {
+    // A name never expands past 255 bytes, so reserving that up front lets
+    // the labels be copied without checking for room.
+    uint8_t* out = Reserve(255);
+    size_t n = 0;
+    bool ok = WalkName(data, size, pos, [&](const uint8_t* label) {
+      memcpy(out + n, label, 1 + *label);
+      n += 1 + *label;
+    });
+    *span = Span{static_cast<uint32_t>(used_), static_cast<uint32_t>(n)};
+    used_ += n;
+    return ok;
+  }
+
+  bool ParseSection(const uint8_t* data, size_t size, size_t* pos, uint16_t count,
+                    std::vector<FlatRR>& section) {
+    for (uint16_t i = 0; i < count; ++i) {
+      FlatRR rr;
+      if (!ParseName(data, size, pos, &rr.name) || size - *pos < 10)
+        return false;
+      const uint8_t* p = data + *pos;
+      rr.type = static_cast<RRType>(Get16(p));
+      rr.klass = static_cast<RRClass>(Get16(p + 2));
+      rr.ttl = static_cast<int32_t>((static_cast<uint32_t>(Get16(p + 4)) << 16) | Get16(p + 6));
+      rr.rdlength = Get16(p + 8);
+      *pos += 10;
+      if (size - *pos < rr.rdlength)
+        return false;
+      rr.rdata = data + *pos;
+      *pos += rr.rdlength;
+      section.push_back(rr);
+    }
+    return true;
+  }
+};
+
+} // namespace dns
+
+#endif  // DNS_FLAT_H_
@@ -0,0 +1,289 @@
+// Copyright (c) 2016 Sviatoslav Chagaev <sviatoslav.chagaev@gmail.com>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+// Conversion of dotted names to wire format, and hostname checks, in a
+// scalar version and, on x86, SSE2 and AVX2 versions that find the dots 16
+// or 32 bytes at a time.  EncodeNameFast() and ValidateHostnameFast() pick
+// the best version the CPU has.
+
+#ifndef DNS_NAME_H_
+#define DNS_NAME_H_
+
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define DNS_HAVE_AVX2 1
+#endif
+
+namespace dns {
+
+// Writes the uncompressed wire form of the dotted name of the given length
+// to out, which needs room for len + 2 bytes.  Repeated dots are skipped,
+// labels may be at most 63 bytes and the whole name at most 255.  Returns
+// the size written, or 0 if the name is too long.
+inline size_t EncodeName(const char* name, size_t len, uint8_t* out) {
+  size_t n = 0, label = 0;
+  bool in_label = false;
+
+  for (size_t i = 0; i < len; ++i) {
+    if (name[i] == '.') {
+      in_label = false;
+      continue;
+    }
+    if (!in_label) {
+      in_label = true;
+      label = n;
+      out[n++] = 0;
+    }
+    if (++out[label] > 63)
+      return 0;
+    out[n++] = static_cast<uint8_t>(name[i]);
+  }
+  out[n++] = 0;
+  return n > 255 ? 0 : n;
+}
+
+// Tells whether the dotted name is a hostname (RFC 1123 2.1): labels of
+// letters, digits and hyphens, neither starting nor ending with a hyphen, at
+// most 63 bytes each and 253 in all, with an optional final dot.
+// Underscores are accepted too, for service labels such as "_sip._tcp".
+inline bool ValidateHostname(const char* name, size_t len) {
+  size_t start = 0;
+
+  if (len > 0 && name[len - 1] == '.')
+    --len;
+  if (len == 0 || len > 253)
+    return false;
+  for (size_t i = 0; i <= len; ++i) {
+    char c = i < len ? name[i] : '.';
+    if (c == '.') {
+      if (i == start || i - start > 63 || name[start] == '-' || name[i - 1] == '-')
+        return false;
+      start = i + 1;
+    } else if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+                 (c >= '0' && c <= '9') || c == '-' || c == '_')) {
+      return false;
+    }
+  }
+  return true;
+}
+
+namespace internal {
+
+// Longest name the vector versions take; longer ones can only encode if
+// they are mostly repeated dots, which EncodeName() deals with.
+const size_t kMaxVectorName = 254;
+
+inline unsigned CountTrailingZeros(uint64_t x) {
+#if defined(__GNUC__)
+  return static_cast<unsigned>(__builtin_ctzll(x));
+#else
+  unsigned n = 0;
+  while (!(x & 1)) {
+    x >>= 1;
+    ++n;
+  }
+  return n;
+#endif
+}
+
+// Second half of the vector encoders.  Given a bitmap of the dots of a name
+// of len bytes and the name already copied to out + 1, turns the dots into
+// label lengths.  Returns the wire size, or 0 if a label is too long.  Sets
+// *empty if a label is empty, i.e. there are repeated or leading dots,
+// which EncodeName() has to deal with.
+inline size_t PutLabelLengths(const uint64_t* dots, size_t len, uint8_t* out, bool* empty) {
+  size_t start = 0;
+  for (size_t w = 0; w * 64 < len; ++w) {
+    for (uint64_t m = dots[w]; m != 0; m &= m - 1) {
+      size_t p = w * 64 + CountTrailingZeros(m);
+      size_t label = p - start;
+      if (label == 0) {
+        *empty = true;
+        return 0;
+      }
+      if (label > 63)
+        return 0;
+      out[start] = static_cast<uint8_t>(label);
+      start = p + 1;
+    }
+  }
+  size_t label = len - start;
+  if (label > 63)
+    return 0;
+  if (label == 0) {
+    out[len] = 0;  // The final dot stands for the root.
+    return len + 1;
+  }
+  out[start] = static_cast<uint8_t>(label);
+  out[len + 1] = 0;
+  return len + 2 > 255 ? 0 : len + 2;
+}
+
+// Second half of the vector validators: checks the label lengths and
+// hyphens of a name of len bytes, without a final dot, whose characters are
+// known to be valid.
+inline bool CheckLabels(const uint64_t* dots, const char* name, size_t len) {
+  size_t start = 0;
+  for (size_t w = 0; w * 64 < len; ++w) {
+    for (uint64_t m = dots[w]; m != 0; m &= m - 1) {
+      size_t p = w * 64 + CountTrailingZeros(m);
+      if (p == start || p - start > 63 || name[start] == '-' || name[p - 1] == '-')
+        return false;
+      start = p + 1;
+    }
+  }
+  return len > start && len - start <= 63 && name[start] != '-' && name[len - 1] != '-';
+}
+
+} // namespace internal
+
+#if defined(__SSE2__)
+
+// EncodeName() finding the dots 16 bytes at a time.
+inline size_t EncodeNameSse2(const char* name, size_t len, uint8_t* out) {
+  if (len == 0 || len > internal::kMaxVectorName)
+    return EncodeName(name, len, out);
+
+  uint64_t dots[4] = {0, 0, 0, 0};
+  const __m128i dot = _mm_set1_epi8('.');
+  for (size_t i = 0; i < len; i += 16) {
+    __m128i v;
+    if (len - i >= 16) {
+      v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(name + i));
+    } else {
+      // Do not read past the end of the name, it may end a page.
+      alignas(16) char tail[16] = {0};
+      memcpy(tail, name + i, len - i);
+      v = _mm_load_si128(reinterpret_cast<const __m128i*>(tail));
+    }
+    uint64_t m = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, dot)));
+    dots[i / 64] |= m << (i % 64);
+  }
+
+  memcpy(out + 1, name, len);
+  bool empty = false;
+  size_t n = internal::PutLabelLengths(dots, len, out, &empty);
+  return empty ? EncodeName(name, len, out) : n;
+}
+
+// ValidateHostname() classifying 16 bytes at a time.
+inline bool ValidateHostnameSse2(const char* name, size_t len) {
+  if (len > 0 && name[len - 1] == '.')
+    --len;
+  if (len == 0 || len > 253)
+    return false;
+
+  uint64_t dots[4] = {0, 0, 0, 0};
+  const __m128i dot = _mm_set1_epi8('.');
+  const __m128i lower = _mm_set1_epi8(0x20);
+  for (size_t i = 0; i < len; i += 16) {
+    __m128i v;
+    size_t n = len - i >= 16 ? 16 : len - i;
+    if (n == 16) {
+      v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(name + i));
+    } else {
+      alignas(16) char tail[16] = {0};
+      memcpy(tail, name + i, n);
+      v = _mm_load_si128(reinterpret_cast<const __m128i*>(tail));
+    }
+    // Bytes above 0x7f are negative, so they fail every range test.
+    __m128i folded = _mm_or_si128(v, lower);
+    __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(folded, _mm_set1_epi8('a' - 1)),
+                                  _mm_cmplt_epi8(folded, _mm_set1_epi8('z' + 1)));
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+                                  _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+    __m128i is_dot = _mm_cmpeq_epi8(v, dot);
+    __m128i other = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('-')),
+                                 _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+    __m128i ok = _mm_or_si128(_mm_or_si128(alpha, digit), _mm_or_si128(is_dot, other));
+    uint32_t want = n == 16 ? 0xffff : (1u << n) - 1;
+    if ((static_cast<uint32_t>(_mm_movemask_epi8(ok)) & want) != want)
+      return false;
+    uint64_t m = static_cast<uint32_t>(_mm_movemask_epi8(is_dot)) & want;
+    dots[i / 64] |= m << (i % 64);
+  }
+  return internal::CheckLabels(dots, name, len);
+}
+
+#endif  // __SSE2__
+
+#if defined(DNS_HAVE_AVX2)
+
+// EncodeName() finding the dots 32 bytes at a time.  Only call it if the
+// CPU has AVX2.
+__attribute__((target("avx2")))
+inline size_t EncodeNameAvx2(const char* name, size_t len, uint8_t* out) {
+  if (len == 0 || len > internal::kMaxVectorName)
+    return EncodeName(name, len, out);
+
+  uint64_t dots[4] = {0, 0, 0, 0};
+  const __m256i dot = _mm256_set1_epi8('.');
+  for (size_t i = 0; i < len; i += 32) {
+    __m256i v;
+    if (len - i >= 32) {
+      v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(name + i));
+    } else {
+      alignas(32) char tail[32] = {0};
+      memcpy(tail, name + i, len - i);
+      v = _mm256_load_si256(reinterpret_cast<const __m256i*>(tail));
+    }
+    uint64_t m = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, dot)));
+    dots[i / 64] |= m << (i % 64);
+  }
+
+  memcpy(out + 1, name, len);
+  bool empty = false;
+  size_t n = internal::PutLabelLengths(dots, len, out, &empty);
+  return empty ? EncodeName(name, len, out) : n;
+}
+
+inline bool HaveAvx2() {
+  static const bool have = __builtin_cpu_supports("avx2");
+  return have;
+}
+
+#endif  // DNS_HAVE_AVX2
+
+// EncodeName() in the fastest version this CPU runs.
+inline size_t EncodeNameFast(const char* name, size_t len, uint8_t* out) {
+#if defined(DNS_HAVE_AVX2)
+  if (len > 32 && HaveAvx2())
+    return EncodeNameAvx2(name, len, out);
+#endif
+#if defined(__SSE2__)
+  return EncodeNameSse2(name, len, out);
+#else
+  return EncodeName(name, len, out);
+#endif
+}
+
+// ValidateHostname() in the fastest version this CPU runs.
+inline bool ValidateHostnameFast(const char* name, size_t len) {
+#if defined(__SSE2__)
+  return ValidateHostnameSse2(name, len);
+#else
+  return ValidateHostname(name, len);
+#endif
+}
+
+} // namespace dns
+
+#endif  // DNS_NAME_H_
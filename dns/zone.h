@@ -0,0 +1,534 @@
+// Copyright (c) 2016 Sviatoslav Chagaev <sviatoslav.chagaev@gmail.com>
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#ifndef DNS_ZONE_H_
+#define DNS_ZONE_H_
+
+#include <arpa/inet.h>
+#include <algorithm>
+#include <istream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include <cctype>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cstddef>
+
+#include "dns.h"
+
+namespace dns {
+
+// Offset and length of each label of a dotted name, in name order.
+typedef std::vector<std::pair<size_t, size_t>> LabelVector;
+
+inline void SplitLabels(const std::string& name, LabelVector* labels) {
+  labels->clear();
+  for (size_t i = 0; i < name.size(); ) {
+    size_t dot = name.find('.', i);
+    if (dot == std::string::npos)
+      dot = name.size();
+    if (dot > i)
+      labels->emplace_back(i, dot - i);
+    i = dot + 1;
+  }
+}
+
+// Compares labels as DNS does, ignoring ASCII case.
+inline int CompareLabels(const char* a, size_t alen, const char* b, size_t blen) {
+  for (size_t i = 0; i < alen && i < blen; ++i) {
+    int ca = tolower(static_cast<unsigned char>(a[i]));
+    int cb = tolower(static_cast<unsigned char>(b[i]));
+    if (ca != cb)
+      return ca - cb;
+  }
+  return alen < blen ? -1 : alen > blen ? 1 : 0;
+}
+
+// A node of a zone's name space: a trie of labels taken from the right, so
+// "www.example.com." lives at root -> com -> example -> www.  Each node holds
+// the RRs owned by its name.  Children are kept sorted by label and found by
+// binary search, so reaching a name costs one search per label.
+class Tree {
+ public:
+  // Adds rr at its owner name, which is taken relative to this node.
+  Tree& operator<<(RR&& rr) {
+    LabelVector labels;
+    SplitLabels(rr.name, &labels);
+    Tree* node = this;
+    for (auto l = labels.rbegin(); l != labels.rend(); ++l)
+      node = node->Insert(rr.name.data() + l->first, l->second);
+    node->rrs_.push_back(std::move(rr));
+    return *this;
+  }
+
+  const Tree* Child(const char* label, size_t len) const {
+    auto it = std::lower_bound(child_.begin(), child_.end(), std::make_pair(label, len), Less());
+    if (it == child_.end() || CompareLabels((*it)->label_.data(), (*it)->label_.size(), label, len) != 0)
+      return nullptr;
+    return it->get();
+  }
+
+  // Walks down from this node along name.  Returns the node of name, or if
+  // there is none, its closest encloser: the deepest node on the way.
+  // *matched is set to how many of name's labels, counted from the right,
+  // the returned node accounts for.
+  const Tree* Find(const std::string& name, const LabelVector& labels, size_t* matched) const {
+    const Tree* node = this;
+    size_t n = 0;
+    for (auto l = labels.rbegin(); l != labels.rend(); ++l, ++n) {
+      const Tree* next = node->Child(name.data() + l->first, l->second);
+      if (next == nullptr)
+        break;
+      node = next;
+    }
+    *matched = n;
+    return node;
+  }
+
+  // Returns the node of name, or null.
+  const Tree* Find(const std::string& name) const {
+    LabelVector labels;
+    size_t matched;
+    SplitLabels(name, &labels);
+    const Tree* node = Find(name, labels, &matched);
+    return matched == labels.size() ? node : nullptr;
+  }
+
+  const RRVector& Rrs() const {
+    return rrs_;
+  }
+
+  bool Has(RRType type) const {
+    for (const auto& rr : rrs_) {
+      if (rr.type == type)
+        return true;
+    }
+    return false;
+  }
+
+  // Appends the RRs of the given type, or all of them for ANY, to out.
+  // owner, if not null, replaces their owner name, as wildcards need.
+  void Collect(QType type, const std::string* owner, RRVector* out) const {
+    for (const auto& rr : rrs_) {
+      if (type != QType::ANY && static_cast<uint16_t>(rr.type) != static_cast<uint16_t>(type))
+        continue;
+      out->push_back(rr);
+      if (owner != nullptr)
+        out->back().name = *owner;
+    }
+  }
+
+ private:
+  struct Less {
+    bool operator()(const std::unique_ptr<Tree>& t, const std::pair<const char*, size_t>& l) const {
+      return CompareLabels(t->label_.data(), t->label_.size(), l.first, l.second) < 0;
+    }
+  };
+
+  std::string label_;
+  RRVector rrs_;
+  std::vector<std::unique_ptr<Tree>> child_;
+
+  Tree* Insert(const char* label, size_t len) {
+    auto it = std::lower_bound(child_.begin(), child_.end(), std::make_pair(label, len), Less());
+    if (it != child_.end() && CompareLabels((*it)->label_.data(), (*it)->label_.size(), label, len) == 0)
+      return it->get();
+    it = child_.insert(it, std::unique_ptr<Tree>(new Tree));
+    (*it)->label_.assign(label, len);
+    return it->get();
+  }
+};
+
+// An authoritative zone loaded from a master file (RFC 1035 5) and the
+// answers it gives.
+// Example:
+//   dns::Zone zone;
+//   std::ifstream in("example.com.zone");
+//   std::string error;
+//   if (!zone.Load(in, "example.com.", &error))
+//     ...
+//   codec.Load(buf, n) >> msg;
+//   zone.Answer(msg);
+//   codec.Rewind() << msg;
+class Zone {
+ public:
+  enum Rcode : uint16_t {
+    kNoError = 0,
+    kFormErr = 1,
+    kNxDomain = 3,
+    kNotImp = 4,
+    kRefused = 5
+  };
+
+  // Longest CNAME chain followed inside the zone.
+  static const int kMaxChain = 8;
+
+  // Reads a zone with the given origin, or if origin is empty, with the
+  // owner of the first SOA record as its origin.  Relative names are taken
+  // relative to origin until a $ORIGIN line says otherwise.  Supports
+  // $ORIGIN, $TTL, relative and "@" names, omitted owners, TTLs
+  // and classes, parentheses and comments, and the types A, AAAA, NS, CNAME,
+  // PTR, MB, MG, MR, MD, MF, MINFO, MX, SOA, HINFO and TXT.  The zone must
+  // have an SOA at its origin.  On failure *error tells where and why.
+  bool Load(std::istream& in, const std::string& origin, std::string* error) {
+    std::string line, owner;
+    std::vector<std::string> tokens;
+    int32_t default_ttl = 3600;
+    int lineno = 0, depth = 0;
+    bool owner_omitted = false;
+
+    origin_ = origin;
+    if (!origin_.empty())
+      Fqdn(origin_);
+    base_ = origin_.empty() ? "." : origin_;
+    std::ostringstream why;
+    while (std::getline(in, line)) {
+      ++lineno;
+      if (depth == 0)
+        owner_omitted = !line.empty() && isspace(static_cast<unsigned char>(line[0]));
+      if (!Tokenize(line, &tokens, &depth)) {
+        why << "line " << lineno << ": unbalanced quotes or parentheses";
+        return Fail(error, why);
+      }
+      if (depth > 0 || tokens.empty())
+        continue;
+
+      size_t t = 0;
+      if (tokens[0] == "$ORIGIN" || tokens[0] == "$TTL") {
+        if (tokens.size() != 2) {
+          why << "line " << lineno << ": " << tokens[0] << " takes one argument";
+          return Fail(error, why);
+        }
+        if (tokens[0] == "$ORIGIN")
+          base_ = Absolute(tokens[1]);
+        else
+          default_ttl = atoi(tokens[1].c_str());
+        tokens.clear();
+        continue;
+      }
+      if (!owner_omitted)
+        owner = Absolute(tokens[t++]);
+      if (owner.empty()) {
+        why << "line " << lineno << ": no owner name";
+        return Fail(error, why);
+      }
+
+      RR rr;
+      rr.name = owner;
+      rr.klass = RRClass::IN;
+      rr.ttl = default_ttl;
+      for ( ; t < tokens.size(); ++t) {
+        if (isdigit(static_cast<unsigned char>(tokens[t][0])))
+          rr.ttl = atoi(tokens[t].c_str());
+        else if (tokens[t] == "IN")
+          rr.klass = RRClass::IN;
+        else
+          break;
+      }
+      if (t == tokens.size() || !ParseType(tokens[t], &rr.type)) {
+        why << "line " << lineno << ": unknown or missing type";
+        return Fail(error, why);
+      }
+      if (!ParseRdata(rr.type, tokens, t + 1, &rr.rdata)) {
+        why << "line " << lineno << ": bad " << tokens[t] << " data";
+        return Fail(error, why);
+      }
+      if (rr.type == RRType::SOA && origin_.empty())
+        origin_ = rr.name;
+      tree_ << std::move(rr);
+      tokens.clear();
+    }
+    if (depth > 0) {
+      why << "line " << lineno << ": unclosed parenthesis";
+      return Fail(error, why);
+    }
+
+    apex_ = tree_.Find(origin_);
+    if (apex_ == nullptr || !apex_->Has(RRType::SOA)) {
+      why << "no SOA record for " << origin_;
+      return Fail(error, why);
+    }
+    SplitLabels(origin_, &origin_labels_);
+    return true;
+  }
+
+  const std::string& Origin() const {
+    return origin_;
+  }
+
+  // Turns the query msg into its response.  Only the first question is
+  // answered; names outside the zone are refused.
+  void Answer(Msg& msg) const {
+    uint16_t opcode = msg.hdr.flags & kOpcodeMask;
+    msg.hdr.flags = static_cast<uint16_t>(kFlagQR | opcode | (msg.hdr.flags & kFlagRD));
+    msg.answer.clear();
+    msg.authority.clear();
+    msg.additional.clear();
+    if (opcode != 0) {
+      msg.hdr.flags |= kNotImp;
+      return;
+    }
+    if (msg.question.size() != 1) {
+      msg.hdr.flags |= kFormErr;
+      return;
+    }
+    msg.hdr.flags |= Resolve(msg.question[0].name, msg.question[0].type, msg);
+  }
+
+ private:
+  Tree tree_;
+  const Tree* apex_ = nullptr;
+  std::string origin_;
+  std::string base_;  // What relative names are relative to while loading.
+  LabelVector origin_labels_;
+
+  static bool Fail(std::string* error, const std::ostringstream& why) {
+    if (error != nullptr)
+      *error = why.str();
+    return false;
+  }
+
+  // Looks up name and fills in msg's sections, following CNAMEs inside the
+  // zone.  Returns the rcode, with AA set unless the answer is a referral.
+  uint16_t Resolve(const std::string& qname, QType qtype, Msg& msg) const {
+    const uint16_t kAA = kFlagAA;
+    std::string name = qname;
+    LabelVector labels;
+
+    for (int chain = 0; chain <= kMaxChain; ++chain) {
+      SplitLabels(name, &labels);
+      size_t matched;
+      const Tree* node = tree_.Find(name, labels, &matched);
+      if (!InZone(name, labels))
+        return chain == 0 ? static_cast<uint16_t>(kRefused) : kAA;
+
+      // Walk down from the apex again to spot a delegation on the way.
+      const Tree* cut = apex_;
+      for (size_t i = origin_labels_.size(); i < matched; ++i) {
+        const auto& l = labels[labels.size() - 1 - i];
+        cut = cut->Child(name.data() + l.first, l.second);
+        if (cut->Has(RRType::NS)) {
+          cut->Collect(QType::NS, nullptr, &msg.authority);
+          AddGlue(msg);
+          return static_cast<uint16_t>(kNoError);
+        }
+      }
+
+      const std::string* owner = nullptr;
+      if (matched < labels.size()) {
+        const Tree* wild = node->Child("*", 1);
+        if (wild == nullptr) {
+          apex_->Collect(QType::SOA, nullptr, &msg.authority);
+          return static_cast<uint16_t>(kAA | kNxDomain);
+        }
+        node = wild;
+        owner = &name;
+      }
+
+      if (qtype != QType::CNAME && node->Has(RRType::CNAME)) {
+        size_t before = msg.answer.size();
+        node->Collect(QType::CNAME, owner, &msg.answer);
+        name = TargetName(msg.answer[before].rdata);
+        continue;
+      }
+      size_t before = msg.answer.size();
+      node->Collect(qtype, owner, &msg.answer);
+      if (msg.answer.size() == before)
+        apex_->Collect(QType::SOA, nullptr, &msg.authority);
+      return kAA;
+    }
+    return kAA;
+  }
+
+  // Tells whether name, split into labels, ends in the origin.
+  bool InZone(const std::string& name, const LabelVector& labels) const {
+    if (labels.size() < origin_labels_.size())
+      return false;
+    for (size_t i = 1; i <= origin_labels_.size(); ++i) {
+      const auto& a = labels[labels.size() - i];
+      const auto& b = origin_labels_[origin_labels_.size() - i];
+      if (CompareLabels(name.data() + a.first, a.second, origin_.data() + b.first, b.second) != 0)
+        return false;
+    }
+    return true;
+  }
+
+  // Adds the in-zone addresses of the name servers in the authority
+  // section.
+  void AddGlue(Msg& msg) const {
+    for (const auto& ns : msg.authority) {
+      const Tree* host = tree_.Find(TargetName(ns.rdata));
+      if (host == nullptr)
+        continue;
+      host->Collect(QType::A, nullptr, &msg.additional);
+      host->Collect(QType::AAAA, nullptr, &msg.additional);
+    }
+  }
+
+  // Decodes the uncompressed name that starts rdata, as in NS or CNAME.
+  static std::string TargetName(const ByteVector& rdata) {
+    std::string name;
+    for (size_t i = 0; i < rdata.size() && rdata[i] != 0; i += 1 + rdata[i]) {
+      name.append(reinterpret_cast<const char*>(&rdata[i + 1]),
+                  std::min<size_t>(rdata[i], rdata.size() - i - 1));
+      name += '.';
+    }
+    return name.empty() ? "." : name;
+  }
+
+  std::string Absolute(const std::string& name) const {
+    if (name == "@")
+      return base_;
+    if (!name.empty() && name[name.size() - 1] == '.')
+      return name;
+    return base_ == "." ? name + "." : name + "." + base_;
+  }
+
+  // Splits a line into tokens, appending to those of the previous lines
+  // while inside parentheses.  Quoted strings become one token, without
+  // the quotes.
+  static bool Tokenize(const std::string& line, std::vector<std::string>* tokens, int* depth) {
+    for (size_t i = 0; i < line.size(); ) {
+      char c = line[i];
+      if (c == ';')
+        break;
+      if (isspace(static_cast<unsigned char>(c))) {
+        ++i;
+      } else if (c == '(') {
+        ++*depth;
+        ++i;
+      } else if (c == ')') {
+        if (--*depth < 0)
+          return false;
+        ++i;
+      } else if (c == '"') {
+        size_t end = line.find('"', i + 1);
+        if (end == std::string::npos)
+          return false;
+        tokens->push_back(line.substr(i + 1, end - i - 1));
+        i = end + 1;
+      } else {
+        size_t end = i;
+        while (end < line.size() && !isspace(static_cast<unsigned char>(line[end])) &&
+               line[end] != ';' && line[end] != '(' && line[end] != ')')
+          ++end;
+        tokens->push_back(line.substr(i, end - i));
+        i = end;
+      }
+    }
+    return true;
+  }
+
+  static bool ParseType(const std::string& s, RRType* type) {
+    static const struct {
+      const char* name;
+      RRType type;
+    } types[] = {
+      {"A", RRType::A}, {"NS", RRType::NS}, {"MD", RRType::MD}, {"MF", RRType::MF},
+      {"CNAME", RRType::CNAME}, {"SOA", RRType::SOA}, {"MB", RRType::MB},
+      {"MG", RRType::MG}, {"MR", RRType::MR}, {"PTR", RRType::PTR},
+      {"HINFO", RRType::HINFO}, {"MINFO", RRType::MINFO}, {"MX", RRType::MX},
+      {"TXT", RRType::TXT}, {"AAAA", RRType::AAAA},
+    };
+    for (const auto& t : types) {
+      if (s == t.name) {
+        *type = t.type;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool PutName(const std::string& s, ByteVector* rdata) const {
+    std::string name = Absolute(s);
+    size_t at = rdata->size();
+    rdata->resize(at + name.size() + 2);
+    size_t n = EncodeName(name.data(), name.size(), &(*rdata)[at]);
+    rdata->resize(at + n);
+    return n != 0;
+  }
+
+  static void PutNumber(uint32_t v, size_t size, ByteVector* rdata) {
+    for (size_t i = size; i > 0; --i)
+      rdata->push_back(static_cast<uint8_t>(v >> (CHAR_BIT * (i - 1))));
+  }
+
+  static bool PutString(const std::string& s, ByteVector* rdata) {
+    if (s.size() > 255)
+      return false;
+    rdata->push_back(static_cast<uint8_t>(s.size()));
+    rdata->insert(rdata->end(), s.begin(), s.end());
+    return true;
+  }
+
+  // Encodes the RDATA of a type from tokens[t..].
+  bool ParseRdata(RRType type, const std::vector<std::string>& tokens, size_t t,
+                  ByteVector* rdata) const {
+    size_t n = tokens.size() - t;
+    switch (type) {
+      case RRType::A:
+      case RRType::AAAA: {
+        uint8_t addr[16];
+        int af = type == RRType::A ? AF_INET : AF_INET6;
+        if (n != 1 || inet_pton(af, tokens[t].c_str(), addr) != 1)
+          return false;
+        rdata->assign(addr, addr + (type == RRType::A ? 4 : 16));
+        return true;
+      }
+      case RRType::NS:
+      case RRType::MD:
+      case RRType::MF:
+      case RRType::CNAME:
+      case RRType::MB:
+      case RRType::MG:
+      case RRType::MR:
+      case RRType::PTR:
+        return n == 1 && PutName(tokens[t], rdata);
+      case RRType::MINFO:
+        return n == 2 && PutName(tokens[t], rdata) && PutName(tokens[t + 1], rdata);
+      case RRType::MX:
+        if (n != 2)
+          return false;
+        PutNumber(static_cast<uint32_t>(atoi(tokens[t].c_str())), 2, rdata);
+        return PutName(tokens[t + 1], rdata);
+      case RRType::SOA:
+        if (n != 7 || !PutName(tokens[t], rdata) || !PutName(tokens[t + 1], rdata))
+          return false;
+        for (size_t i = t + 2; i < tokens.size(); ++i)
+          PutNumber(static_cast<uint32_t>(strtoul(tokens[i].c_str(), nullptr, 10)), 4, rdata);
+        return true;
+      case RRType::HINFO:
+        return n == 2 && PutString(tokens[t], rdata) && PutString(tokens[t + 1], rdata);
+      case RRType::TXT:
+        if (n == 0)
+          return false;
+        for (size_t i = t; i < tokens.size(); ++i) {
+          if (!PutString(tokens[i], rdata))
+            return false;
+        }
+        return true;
+      default:
+        return false;
+    }
+  }
+};
+
+} // namespace dns
+
+#endif  // DNS_ZONE_H_
@@ -0,0 +1,200 @@
+// Evaluates deep list programs with lisp::eval(), heap::eval() and a
+// compiled program and prints the evaluations per second of each, then
+// times the reader on megabytes of random S-expressions against read(2)
+// and memcpy().
+// usage: bench [-d depth] [-m megabytes] [-n list length] [-r repetitions]
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "lisp.h"
+#include "cell.h"
+#include "reader.h"
+#include "vm.h"
+
+static lisp atom(const std::string &s) {
+    return lisp(s);
+}
+
+static lisp list(const std::vector<lisp> &v) {
+    return lisp(v);
+}
+
+// (car (quote (x0 x1 ... xn-1))), which is (x0 x1 ... xn-1).
+static lisp data(int n) {
+    std::vector<lisp> v;
+
+    for (int i = 0; i < n; ++i)
+        v.push_back(atom("x" + std::to_string(i)));
+    return list({ atom("car"), list({ atom("quote"), list(v) }) });
+}
+
+// (op (op ... (op e))), depth times.
+static lisp nest(const std::string &op, int depth, lisp e) {
+    for (int i = 0; i < depth; ++i)
+        e = list({ atom(op), e });
+    return e;
+}
+
+// (cons y (cons y ... e)), depth times.
+static lisp conses(int depth, lisp e) {
+    for (int i = 0; i < depth; ++i)
+        e = list({ atom("cons"), atom("y"), e });
+    return e;
+}
+
+// Evaluations per second.
+static double rate(int reps, const std::function<void()> &f) {
+    auto t0 = std::chrono::steady_clock::now();
+
+    for (int i = 0; i < reps; ++i)
+        f();
+    return reps / std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+// About size bytes of random nested lists of atoms from a thousand names.
+static std::string sexprs(size_t size) {
+    std::string s;
+    unsigned x = 1;
+    int depth = 0;
+
+    while (s.size() < size || depth > 0) {
+        x = x * 1103515245 + 12345;
+        unsigned r = x >> 16;
+        if (r % 8 == 0 && depth < 8 && s.size() < size) {
+            s += '(';
+            ++depth;
+        } else if (r % 8 == 1 && depth > 0) {
+            s += ") ";
+            if (--depth == 0)
+                s += '\n';
+        } else if (depth > 0) {
+            s += "sym" + std::to_string(r % 1000) + ' ';
+        } else {
+            s += '(';
+            ++depth;
+        }
+    }
+    return s;
+}
+
+// Megabytes per second of f over size bytes.
+static double throughput(size_t size, const std::function<void()> &f) {
+    auto t0 = std::chrono::steady_clock::now();
+
+    f();
+    return size / 1e6 / std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+static bool bench_reader(size_t size) {
+    std::string text = sexprs(size);
+    char path[] = "/tmp/lispbenchXXXXXX";
+    int fd = mkstemp(path);
+
+    if (fd == -1 || write(fd, text.data(), text.size()) != static_cast<ssize_t>(text.size())) {
+        std::cerr << "bench: " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    unlink(path);
+
+    std::vector<char> copy(text.size()), buf(1 << 16);
+    double copied = throughput(text.size(), [&] { memcpy(copy.data(), text.data(), text.size()); });
+    lseek(fd, 0, SEEK_SET);
+    double drained = throughput(text.size(), [&] {
+        while (read(fd, buf.data(), buf.size()) > 0)
+            ;
+    });
+
+    heap h;
+    size_t exprs = 0;
+    lseek(fd, 0, SEEK_SET);
+    double parsed = throughput(text.size(), [&] {
+        reader r(h, fd);
+        cell *expr;
+        while (r.read(&expr))
+            ++exprs;
+    });
+    close(fd);
+
+    std::cout << "reader: " << text.size() << " bytes, " << exprs << " expressions, " << h.cells()
+              << " cells, MB/s: memcpy " << copied << ", read " << drained << ", reader " << parsed << std::endl;
+    return true;
+}
+
+int main(int argc, char **argv) {
+    int depth = 100, length = 1000, reps = 1000, megabytes = 8, ch;
+
+    while ((ch = getopt(argc, argv, "d:m:n:r:")) != -1) {
+        switch (ch) {
+            case 'd':
+                depth = atoi(optarg);
+                break;
+            case 'm':
+                megabytes = atoi(optarg);
+                break;
+            case 'n':
+                length = atoi(optarg);
+                break;
+            case 'r':
+                reps = atoi(optarg);
+                break;
+            default:
+                std::cerr << "usage: bench [-d depth] [-m megabytes] [-n list length] [-r repetitions]" << std::endl;
+                return 1;
+        }
+    }
+    if (depth < 0 || length < 1 || reps < 1 || megabytes < 0) {
+        std::cerr << "bench: bad depth, megabytes, length or repetitions" << std::endl;
+        return 1;
+    }
+
+    // Every lisp copy logs; keep that out of the measurements.
+    std::clog.setstate(std::ios::failbit);
+
+    struct test_program {
+        const char *name;
+        lisp expr;
+    };
+    const std::vector<test_program> programs = {
+        { "cdr", nest("cdr", depth, data(length)) },
+        { "cons", conses(depth, data(length)) },
+        { "car cdr", list({ atom("car"), nest("cdr", depth, data(length)) }) },
+        { "eq car cdr", list({ atom("eq"), list({ atom("car"), nest("cdr", depth, data(length)) }),
+                               atom("x" + std::to_string(depth)) }) },
+        { "atom cdr", list({ atom("atom"), nest("cdr", depth, data(length)) }) },
+    };
+
+    std::cout << "depth " << depth << ", list length " << length << ", " << reps << " repetitions" << std::endl;
+    for (const auto &p : programs) {
+        heap h;
+        cell *c = h.from(p.expr);
+        heap::root rc(h, c);
+        program prog(h, c);
+        std::string want = p.expr.eval().str(), got = h.str(h.eval(c)), ran = h.str(prog.run());
+
+        if (got != want || ran != want) {
+            std::cerr << "bench: " << p.name << ": lisp gives " << want << ", cells give " << got
+                      << ", bytecode gives " << ran << std::endl;
+            return 1;
+        }
+
+        double tree = rate(reps, [&] { p.expr.eval(); });
+        double cells = rate(reps, [&] { h.eval(c); });
+        double vm = rate(reps, [&] { prog.run(); });
+        if ((got = h.str(h.eval(c))) != want) {
+            std::cerr << "bench: " << p.name << ": cells give " << got << " after timing, not " << want << std::endl;
+            return 1;
+        }
+        std::cout << p.name << ": evals/s: lisp " << tree << ", cells " << cells << ", bytecode " << vm
+                  << " (" << prog.size() << " instructions), bytecode/cells " << vm / cells << "x" << std::endl;
+    }
+
+    return megabytes == 0 || bench_reader(megabytes * size_t(1) << 20) ? 0 : 1;
+}
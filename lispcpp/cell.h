@@ -0,0 +1,553 @@
+#ifndef CELL_H_
+#define CELL_H_
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "lisp.h"
+
+// Atom names interned to small integers, so that comparing two atoms is
+// comparing two integers.
+class symtab {
+    public:
+        typedef uint32_t id;
+
+        symtab() :
+            m_slots(64, 0)
+        {
+        }
+
+        // FNV-1a, which callers scanning the name anyway can compute with
+        // HASH_INIT and next_hash() and hand to intern().
+        static const uint32_t HASH_INIT = 2166136261u;
+
+        static uint32_t next_hash(uint32_t h, char c) {
+            return (h ^ static_cast<unsigned char>(c)) * 16777619u;
+        }
+
+        static uint32_t hash(const char *s, size_t len) {
+            uint32_t h = HASH_INIT;
+
+            for (size_t i = 0; i < len; ++i)
+                h = next_hash(h, s[i]);
+            return h;
+        }
+
+        id intern(const char *s, size_t len) {
+            return intern(s, len, hash(s, len));
+        }
+
+        id intern(const char *s, size_t len, uint32_t h) {
+            size_t mask = m_slots.size() - 1;
+
+            for (size_t i = h & mask; ; i = (i + 1) & mask) {
+                if (m_slots[i] == 0) {
+                    id n = m_names.size();
+                    m_names.push_back(name_ref { m_chars.size(), len, h });
+                    m_chars.append(s, len);
+                    m_slots[i] = n + 1;
+                    if (m_names.size() * 2 > m_slots.size())
+                        grow();
+                    return n;
+                }
+                const name_ref &r = m_names[m_slots[i] - 1];
+                if (r.hash == h && r.len == len && memcmp(m_chars.data() + r.off, s, len) == 0)
+                    return m_slots[i] - 1;
+            }
+        }
+
+        id intern(const std::string &s) {
+            return intern(s.data(), s.size());
+        }
+
+        std::string name(id n) const {
+            return m_chars.substr(m_names[n].off, m_names[n].len);
+        }
+
+        size_t size() const {
+            return m_names.size();
+        }
+
+    private:
+        struct name_ref {
+            size_t off;
+            size_t len;
+            uint32_t hash;
+        };
+
+        std::vector<uint32_t> m_slots; // open addressing, id + 1, 0 is free
+        std::vector<name_ref> m_names;
+        std::string m_chars;
+
+        void grow() {
+            std::vector<uint32_t> slots(m_slots.size() * 2, 0);
+            size_t mask = slots.size() - 1;
+
+            for (id n = 0; n < m_names.size(); ++n) {
+                size_t i = m_names[n].hash & mask;
+                while (slots[i] != 0)
+                    i = (i + 1) & mask;
+                slots[i] = n + 1;
+            }
+            m_slots.swap(slots);
+        }
+};
+
+// An atom, a cons cell or a closure.  The empty list is a null pointer.
+struct cell {
+    enum types : uint8_t {
+        ATOM,
+        CONS,
+        CLOSURE, // car is the lambda's (parameters body ...), cdr the environment
+        FREE,    // on the heap's free list, linked by cdr
+    };
+
+    enum types type;
+    bool mark;
+    symtab::id sym; // ATOM
+    cell *car;      // CONS, CLOSURE
+    cell *cdr;      // CONS, CLOSURE
+};
+
+struct heap_stats {
+    size_t cells;       // in the blocks
+    size_t live;        // in use after the last collection
+    size_t collections;
+    size_t freed;       // by all collections
+    double pause_total; // seconds
+    double pause_max;
+};
+
+// Cells for the lisp class's programs, allocated from blocks of cells and
+// reclaimed by a mark-sweep collector.  There is one cell per atom name,
+// so eq is a pointer compare, and car, cdr and cons neither copy nor walk
+// their argument.
+//
+// The collector runs when an allocation finds no free cell.  It marks from
+// the atoms, the global variables, variables registered with a root and
+// vectors registered with add_roots(); code that keeps cells anywhere else
+// must hold off collection with a hold.
+class heap {
+    public:
+        // Names eval() dispatches on; they are interned first, in this order.
+        enum builtins {
+            QUOTE,
+            ATOM,
+            CAR,
+            CDR,
+            EQ,
+            CONS,
+            T,
+            LAMBDA,
+            DEFINE,
+            COND,
+        };
+
+        // Keeps what a variable points to from being collected while the
+        // root is in scope.  Roots must go out of scope in reverse order.
+        class root {
+            public:
+                root(heap &h, cell *&var) :
+                    m_heap(h)
+                {
+                    h.m_roots.push_back(&var);
+                }
+
+                ~root() {
+                    m_heap.m_roots.pop_back();
+                }
+
+                root(const root &) = delete;
+                root &operator=(const root &) = delete;
+
+            private:
+                heap &m_heap;
+        };
+
+        // Holds off collection while in scope.
+        class hold {
+            public:
+                explicit hold(heap &h) :
+                    m_heap(h)
+                {
+                    ++h.m_hold;
+                }
+
+                ~hold() {
+                    --m_heap.m_hold;
+                }
+
+                hold(const hold &) = delete;
+                hold &operator=(const hold &) = delete;
+
+            private:
+                heap &m_heap;
+        };
+
+        heap() :
+            m_used(BLOCK),
+            m_free(nullptr),
+            m_nfree(0),
+            m_hold(0),
+            m_stats()
+        {
+            static const char *const names[] = {
+                "quote", "atom", "car", "cdr", "eq", "cons", "t", "lambda", "define", "cond"
+            };
+
+            for (auto name : names)
+                m_symbols.intern(name);
+        }
+
+        heap(const heap &) = delete;
+        heap &operator=(const heap &) = delete;
+
+        symtab &symbols() {
+            return m_symbols;
+        }
+
+        cell *atom(symtab::id sym) {
+            if (sym >= m_atoms.size())
+                m_atoms.resize(sym + 1, nullptr);
+            if (m_atoms[sym] == nullptr) {
+                cell *c = alloc();
+                c->type = cell::ATOM;
+                c->sym = sym;
+                c->car = c->cdr = nullptr;
+                m_atoms[sym] = c;
+            }
+            return m_atoms[sym];
+        }
+
+        cell *atom(const std::string &s) {
+            return atom(m_symbols.intern(s));
+        }
+
+        // May collect, so car and cdr must be reachable from roots.
+        cell *cons(cell *car, cell *cdr) {
+            cell *c = alloc();
+            c->type = cell::CONS;
+            c->sym = 0;
+            c->car = car;
+            c->cdr = cdr;
+            return c;
+        }
+
+        // The cells for a lisp expression.
+        cell *from(const lisp &l) {
+            hold h(*this);
+
+            if (l.type() == lisp::ATOM)
+                return atom(l.atom());
+
+            cell *list = nullptr;
+            for (auto i = l.list().rbegin(); i != l.list().rend(); ++i)
+                list = cons(from(*i), list);
+            return list;
+        }
+
+        // lisp::eval() over cells, in an environment of local variables, plus:
+        //
+        //     (lambda (x y) body ...)  a closure over the environment
+        //     (define name expr)       sets a global variable
+        //     (cond (test expr) ...)   expr of the first test that is not ()
+        //     (f args ...)             if f is a closure, evaluates args and
+        //                              the body with the parameters bound
+        //
+        // An atom evaluates to its variable if it has one, else to itself.
+        // eq compares lists by identity rather than by contents.  Calls and
+        // conds in tail position do not grow the C++ stack.
+        cell *eval(cell *c, cell *env = nullptr) {
+            root rc(*this, c), re(*this, env);
+
+            for (;;) {
+                if (c == nullptr || c->type == cell::CLOSURE)
+                    return c;
+                if (c->type == cell::ATOM)
+                    return lookup(c, env);
+
+                cell *head = c->car;
+                if (head != nullptr && head->type == cell::ATOM) {
+                    switch (head->sym) {
+                        case QUOTE:
+                            return c->cdr;
+                        case ATOM: {
+                            cell *v = eval(arg(c, 1), env);
+                            return v != nullptr && v->type == cell::ATOM ? atom(T) : nullptr;
+                        }
+                        case CAR: {
+                            cell *v = eval(arg(c, 1), env);
+                            return v != nullptr && v->type == cell::CONS ? v->car : nullptr;
+                        }
+                        case CDR: {
+                            cell *v = eval(arg(c, 1), env);
+                            return v != nullptr && v->type == cell::CONS ? v->cdr : nullptr;
+                        }
+                        case EQ: {
+                            cell *a = eval(arg(c, 1), env);
+                            root ra(*this, a);
+                            cell *b = eval(arg(c, 2), env);
+                            return a == b ? atom(T) : nullptr;
+                        }
+                        case CONS: {
+                            if (c->cdr == nullptr)
+                                return nullptr;
+                            cell *a = eval(arg(c, 1), env);
+                            root ra(*this, a);
+                            cell *b = eval(arg(c, 2), env);
+                            root rb(*this, b);
+                            if (a != nullptr && a->type == cell::ATOM && (b == nullptr || b->type == cell::CONS))
+                                return cons(a, b);
+                            return nullptr;
+                        }
+                        case LAMBDA: {
+                            cell *f = cons(c->cdr, env);
+                            f->type = cell::CLOSURE;
+                            return f;
+                        }
+                        case DEFINE: {
+                            cell *name = arg(c, 1);
+                            if (name == nullptr || name->type != cell::ATOM)
+                                return nullptr;
+                            cell *v = eval(arg(c, 2), env);
+                            if (name->sym >= m_globals.size())
+                                m_globals.resize(name->sym + 1, global { false, nullptr });
+                            m_globals[name->sym] = global { true, v };
+                            return name;
+                        }
+                        case COND: {
+                            cell *next = nullptr;
+                            for (cell *i = c->cdr; next == nullptr && i != nullptr && i->type == cell::CONS; i = i->cdr) {
+                                cell *clause = i->car;
+                                if (clause != nullptr && clause->type == cell::CONS && eval(clause->car, env) != nullptr)
+                                    next = clause;
+                            }
+                            if (next == nullptr)
+                                return nullptr;
+                            c = arg(next, 1);
+                            continue;
+                        }
+                        default:
+                            break;
+                    }
+                }
+
+                // A call, if the head is a closure; else the list itself.
+                cell *f = head == nullptr ? nullptr : head->type == cell::ATOM ? lookup(head, env) : eval(head, env);
+                if (f == nullptr || f->type != cell::CLOSURE)
+                    return c;
+                root rf(*this, f);
+                cell *frame = f->cdr;
+                root rframe(*this, frame);
+                cell *args = c->cdr;
+                for (cell *p = arg(f->car, 0); p != nullptr && p->type == cell::CONS; p = p->cdr) {
+                    cell *v = eval(args != nullptr && args->type == cell::CONS ? args->car : nullptr, env);
+                    root rv(*this, v);
+                    frame = cons(nullptr, frame);
+                    frame->car = cons(p->car, v);
+                    if (args != nullptr && args->type == cell::CONS)
+                        args = args->cdr;
+                }
+                cell *body = f->car->cdr;
+                if (body == nullptr || body->type != cell::CONS)
+                    return nullptr;
+                for (; body->cdr != nullptr && body->cdr->type == cell::CONS; body = body->cdr)
+                    eval(body->car, frame);
+                env = frame;
+                c = body->car;
+            }
+        }
+
+        // The global variable of an atom, or the atom if it has none.
+        cell *value(cell *a) const {
+            return lookup(a, nullptr);
+        }
+
+        // Same format as lisp::str().
+        std::string str(const cell *c) const {
+            std::ostringstream os;
+
+            print(os, c);
+            return os.str();
+        }
+
+        // The nth element of the list, or the empty list.
+        static cell *arg(const cell *c, int n) {
+            for (; c != nullptr && c->type == cell::CONS; c = c->cdr)
+                if (n-- == 0)
+                    return c->car;
+            return nullptr;
+        }
+
+        // Cells in use, garbage not collected yet included.
+        size_t cells() const {
+            return m_blocks.size() * BLOCK - (BLOCK - m_used) - m_nfree;
+        }
+
+        // Marks the cells in v too, until remove_roots().
+        void add_roots(const std::vector<cell *> *v) {
+            m_root_vectors.push_back(v);
+        }
+
+        void remove_roots(const std::vector<cell *> *v) {
+            for (auto i = m_root_vectors.begin(); i != m_root_vectors.end(); ++i) {
+                if (*i == v) {
+                    m_root_vectors.erase(i);
+                    break;
+                }
+            }
+        }
+
+        // Frees the cells nothing reachable from the roots points to.
+        void collect() {
+            auto t0 = std::chrono::steady_clock::now();
+
+            for (auto c : m_atoms)
+                mark(c);
+            for (const auto &g : m_globals)
+                mark(g.value);
+            for (auto var : m_roots)
+                mark(*var);
+            for (auto v : m_root_vectors)
+                for (auto c : *v)
+                    mark(c);
+
+            m_free = nullptr;
+            m_nfree = 0;
+            for (size_t b = 0; b < m_blocks.size(); ++b) {
+                size_t n = b + 1 == m_blocks.size() ? m_used : BLOCK;
+                for (cell *c = m_blocks[b].get(), *end = c + n; c != end; ++c) {
+                    if (c->mark) {
+                        c->mark = false;
+                        continue;
+                    }
+                    if (c->type != cell::FREE) {
+                        c->type = cell::FREE;
+                        ++m_stats.freed;
+                    }
+                    c->cdr = m_free;
+                    m_free = c;
+                    ++m_nfree;
+                }
+            }
+
+            double pause = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+            ++m_stats.collections;
+            m_stats.live = cells();
+            m_stats.pause_total += pause;
+            if (pause > m_stats.pause_max)
+                m_stats.pause_max = pause;
+        }
+
+        heap_stats stats() const {
+            heap_stats st = m_stats;
+            st.cells = m_blocks.size() * BLOCK;
+            return st;
+        }
+
+    private:
+        static const size_t BLOCK = 4096;
+
+        struct global {
+            bool bound;
+            cell *value;
+        };
+
+        symtab m_symbols;
+        std::vector<cell *> m_atoms;   // by symbol id
+        std::vector<global> m_globals; // by symbol id
+        std::vector<std::unique_ptr<cell[]>> m_blocks;
+        size_t m_used;                 // cells used in the last block
+        cell *m_free;
+        size_t m_nfree;
+        int m_hold;
+        std::vector<cell **> m_roots;
+        std::vector<const std::vector<cell *> *> m_root_vectors;
+        std::vector<cell *> m_marking;
+        heap_stats m_stats;
+
+        // Collects if allowed and the blocks are used up, and adds a block
+        // if that left less than half of the cells free.
+        cell *alloc() {
+            if (m_free == nullptr && m_used == BLOCK) {
+                if (m_hold == 0 && !m_blocks.empty())
+                    collect();
+                if (m_free == nullptr || m_nfree * 2 < m_blocks.size() * BLOCK) {
+                    m_blocks.emplace_back(new cell[BLOCK]);
+                    m_used = 0;
+                }
+            }
+
+            cell *c;
+            if (m_free != nullptr) {
+                c = m_free;
+                m_free = c->cdr;
+                --m_nfree;
+            } else {
+                c = &m_blocks.back()[m_used++];
+            }
+            c->mark = false;
+            return c;
+        }
+
+        void mark(cell *c) {
+            m_marking.push_back(c);
+            while (!m_marking.empty()) {
+                c = m_marking.back();
+                m_marking.pop_back();
+                // Down the cdrs in this loop, so that long lists do not
+                // pile up on the stack.
+                while (c != nullptr && !c->mark && c->type != cell::FREE) {
+                    c->mark = true;
+                    if (c->type == cell::ATOM)
+                        break;
+                    m_marking.push_back(c->car);
+                    c = c->cdr;
+                }
+            }
+        }
+
+        cell *lookup(cell *a, cell *env) const {
+            for (; env != nullptr; env = env->cdr)
+                if (env->car->car == a)
+                    return env->car->cdr;
+            if (a->sym < m_globals.size() && m_globals[a->sym].bound)
+                return m_globals[a->sym].value;
+            return a;
+        }
+
+        void print(std::ostream &os, const cell *c) const {
+            if (c == nullptr) {
+                os << "()";
+            } else if (c->type == cell::ATOM) {
+                os << m_symbols.name(c->sym);
+            } else if (c->type == cell::CLOSURE) {
+                os << "(lambda";
+                for (const cell *i = c->car; i != nullptr && i->type == cell::CONS; i = i->cdr) {
+                    os << ", ";
+                    print(os, i->car);
+                }
+                os << ')';
+            } else {
+                os << '(';
+                for (const cell *i = c; i != nullptr; i = i->cdr) {
+                    if (i != c)
+                        os << ", ";
+                    if (i->type != cell::CONS) { // improper list
+                        os << ". ";
+                        print(os, i);
+                        break;
+                    }
+                    print(os, i->car);
+                }
+                os << ')';
+            }
+        }
+};
+
+#endif // CELL_H_
@@ -1,173 +1,52 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
 #include <iostream>
-#include <string>
-#include <vector>
-#include <sstream>
-
-class lisp {
-    public:
-        enum types {
-            LISP,
-            ATOM,
-        };
-
-        lisp() :
-            m_type(LISP)
-        {
-            std::clog << "lisp()" << std::endl;
-        }
-
-        lisp(const std::string &s) :
-            m_type(ATOM),
-            m_s(s)
-        {
-            std::clog << "lisp(const std::string &s)" << std::endl;
-        }
 
-        lisp(const std::vector<lisp> &v) :
-            m_type(LISP),
-            m_v(v)
-        {
-            std::clog << "lisp(const std::vector<lisp> &v)" << std::endl;
-        }
-
-        lisp(const std::vector<lisp>::const_iterator first, const std::vector<lisp>::const_iterator last) :
-            m_type(LISP),
-            m_v(first, last)
-        {
-            std::clog << "lisp(const std::vector<lisp>::const_iterator first, const std::vector<lisp>::const_iterator last)" << std::endl;
-        }
-
-        template<typename ... Types> lisp(const lisp &l, Types ... args) :
-            m_type(LISP)
-        {
-            std::clog << "template<typename ... Types> lisp(const lisp &l, Types ... args)" << std::endl;
-            vctor(l, args...);
-        }
-
-        template<typename ... Types> lisp(const std::string &s, Types ... args) :
-            m_type(LISP)
-        {
-            std::clog << "template<typename ... Types> lisp(const std::string &s, Types ... args)" << std::endl;
-            vctor(s, args...);
-        }
-
-        bool operator==(const std::string &rhs) const {
-            return m_type == ATOM && m_s == rhs;
-        }
-
-        bool operator==(const lisp &rhs) const {
-            if (m_type != rhs.m_type)
-                return false;
-            if (m_type == ATOM)
-                return m_s == rhs.m_s;
-            else
-                return m_v == rhs.m_v;
-        }
-
-        lisp eval() const {
-            if (m_type == ATOM)
-                return *this;
-            else if (m_v.size() > 0) {
-                if (m_v[0] == "quote") {
-                    return { m_v.begin() + 1, m_v.end() };
-                } else if (m_v[0] == "atom") {
-                    if (m_v[1].eval().m_type == ATOM) {
-                        lisp l;
-                        l.m_type = ATOM;
-                        l.m_s = "t";
-                        return l;
-                    } else
-                        return {}; // empty list
-                } else if (m_v[0] == "car") {
-                    lisp v1(m_v[1].eval());
-                    if (v1.m_type == LISP) {
-                        if (v1.m_v.size() > 0)
-                            return v1.m_v[0];
-                        else
-                            return lisp();
-                    } else
-                        return lisp();
-                } else if (m_v[0] == "cdr") {
-                    lisp v1(m_v[1].eval());
-                    if (v1.m_type == LISP) {
-                        if (v1.m_v.size() > 0) {
-                            v1.m_v.erase(v1.m_v.begin());
-                            return v1;
-                        } else
-                            return lisp();
-                    } else
-                        return lisp();
-                } else if (m_v[0] == "eq") {
-                    lisp a(m_v[1].eval());
-                    lisp b(m_v[2].eval());
-                    if (a == b)
-                        return lisp("t");
-                    else
-                        return lisp();
-                } else if (m_v[0] == "cons") {
-                    if (m_v.size() > 1) {
-                        lisp a(m_v[1].eval());
-                        lisp b(m_v[2].eval());
-                        if (a.m_type == ATOM && b.m_type == LISP) {
-                            b.m_v.insert(b.m_v.begin(), a);
-                            return b;
-                        } else
-                            return lisp();
-                    } else {
-                        return lisp();
-                    }
-                } else
-                    return *this;
-            } else
-                return {};
-        }
-
-        std::string str() const {
-            std::ostringstream os;
-
-            if (m_type == ATOM)
-                os << m_s;
-            else {
-                os << '(';
-                for (auto i = m_v.begin(); i != m_v.end(); ++i) {
-                    if (i != m_v.begin())
-                        os << ", ";
-                    os << i->str();
-                }
-                os << ')';
-            }
-
-            return os.str();
-        }
-
-    private:
-        enum types m_type;
-        std::vector<lisp> m_v;
-        std::string m_s;
-
-        template<typename ... Types> void vctor(const std::string &s, Types ... args) {
-            lisp l;
-            l.m_type = ATOM;
-            l.m_s = s;
-            m_v.push_back(l);
-            vctor(args...);
-        }
-
-        template<typename ... Types> void vctor(const lisp &l, Types ... args) {
-            m_v.push_back(l);
-            vctor(args...);
-        }
-
-        void vctor() {
-        }
-};
+#include "lisp.h"
+#include "cell.h"
+#include "reader.h"
+#include "sexp.h"
+#include "vm.h"
 
 void test(const lisp &l) {
+    static heap h;
+
     std::cout << "expression: " << l.str() << std::endl;
     std::cout << "evaluation: " << l.eval().str() << std::endl;
+    std::cout << "cells: " << h.str(h.eval(h.from(l))) << std::endl;
+    std::cout << "bytecode: " << h.str(program(h, h.from(l)).run()) << std::endl;
 }
 
-int main(int argc, char **argv) {
+template<size_t N, size_t M> void test(const sexp<N> &expr, const sexp<M> &value) {
+    std::cout << "expression: " << expr.str() << std::endl;
+    std::cout << "constexpr: " << value.str() << std::endl;
+}
+
+// The same expressions, evaluated by the compiler.
+#define CONSTEXPR_TEST(...) do { \
+        static constexpr auto expr = make_sexp(__VA_ARGS__); \
+        static constexpr auto value = expr.eval(); \
+        test(expr, value); \
+    } while (0)
+
+void constexpr_tests() {
+    CONSTEXPR_TEST("atom", make_sexp("aaa", "bbb", "ccc"));
+    CONSTEXPR_TEST("eq", "aaa", "bbb");
+    CONSTEXPR_TEST("eq", "aaa", "aaa");
+    CONSTEXPR_TEST("eq", "aaa", make_sexp("quote", make_sexp("aaa", "bbb")));
+    CONSTEXPR_TEST("aaa", "bbb", "ccc");
+    CONSTEXPR_TEST("cdr", make_sexp("aaa", "bbb", "ccc"));
+    CONSTEXPR_TEST("cons", "aaa", make_sexp("123", "xxx", "ttt"));
+
+    static_assert(make_sexp("cdr", make_sexp("aaa", "bbb", "ccc")).eval() == make_sexp("bbb", "ccc"),
+                  "cdr");
+    static_assert(make_sexp("cons", "aaa", make_sexp("car", make_sexp("quote", make_sexp("b", "c")))).eval()
+                  == make_sexp("aaa", "b", "c"), "cons");
+}
+
+void tests() {
     test({ "atom", lisp { "aaa", "bbb", "ccc" } });
     test({ "eq", "aaa", "bbb" });
     test({ "eq", "aaa", "aaa" });
@@ -175,6 +54,80 @@ int main(int argc, char **argv) {
     test({ "aaa", "bbb", "ccc" });
     test({ "cdr", lisp { "aaa", "bbb", "ccc" } });
     test({ "cons", "aaa", lisp { "123", "xxx", "ttt" } });
+    constexpr_tests();
+}
+
+// Evaluates every expression read from fd and prints the results, with a
+// prompt if interactive.  Returns false on a read error or, unless
+// interactive, a syntax error.
+bool run(heap &h, int fd, const char *name, bool interactive) {
+    reader r(h, fd);
+    cell *expr;
+
+    for (;;) {
+        if (interactive)
+            std::cout << "> " << std::flush;
+        if (r.read(&expr)) {
+            std::cout << h.str(h.eval(expr)) << std::endl;
+            continue;
+        }
+        if (r.error().empty())
+            break;
+        std::cerr << name << ":" << r.line() << ": " << r.error() << std::endl;
+        if (!interactive)
+            return false;
+        r.reset();
+    }
+    if (interactive)
+        std::cout << std::endl;
+    return true;
+}
+
+void print_stats(const heap &h) {
+    heap_stats st = h.stats();
+
+    std::cerr << "heap: " << st.cells << " cells, " << st.live << " live after " << st.collections
+              << " collections, " << st.freed << " freed, pauses " << st.pause_total * 1e3 << " ms total, "
+              << st.pause_max * 1e3 << " ms max" << std::endl;
+}
+
+int main(int argc, char **argv) {
+    bool ok = true, stats = false;
+    int ch;
+
+    while ((ch = getopt(argc, argv, "st")) != -1) {
+        switch (ch) {
+            case 's':
+                stats = true;
+                break;
+            case 't':
+                tests();
+                return 0;
+            default:
+                std::cerr << "usage: lisp [-st] [file ...]" << std::endl;
+                return 1;
+        }
+    }
+
+    heap h;
+    if (optind == argc) {
+        ok = run(h, STDIN_FILENO, "stdin", isatty(STDIN_FILENO));
+        if (stats)
+            print_stats(h);
+        return ok ? 0 : 1;
+    }
+    for (int i = optind; i < argc; ++i) {
+        int fd = open(argv[i], O_RDONLY);
+        if (fd == -1) {
+            std::cerr << "lisp: " << argv[i] << ": " << strerror(errno) << std::endl;
+            ok = false;
+            continue;
+        }
+        ok = run(h, fd, argv[i], false) && ok;
+        close(fd);
+    }
+    if (stats)
+        print_stats(h);
 
-    return 0;
+    return ok ? 0 : 1;
 }
@@ -0,0 +1,223 @@
+#ifndef READER_H_
+#define READER_H_
+
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "cell.h"
+
+// Reads S-expressions from a file descriptor into cells, a chunk at a
+// time.  Lists nest on an explicit stack and a token cut by the end of a
+// chunk is carried over, so an expression may span any number of chunks,
+// and nothing is read past the end of the expression asked for, which
+// makes it usable on a terminal.  Atoms are interned straight from the
+// buffer.
+//
+// Atoms are runs of anything but white space, parentheses and ';', which
+// starts a comment running to the end of the line.  Commas count as white
+// space, so that what lisp::str() and heap::str() print reads back.
+class reader {
+    public:
+        reader(heap &h, int fd, size_t chunk = 1 << 16) :
+            m_heap(h),
+            m_fd(fd),
+            m_buf(chunk),
+            m_pos(0),
+            m_end(0),
+            m_line(1),
+            m_comment(false),
+            m_eof(false)
+        {
+            memset(m_kinds, ATOM, sizeof(m_kinds));
+            for (const char *s = " \t\n\r\f\v,"; *s != '\0'; ++s)
+                m_kinds[static_cast<unsigned char>(*s)] = SPACE;
+            m_kinds['('] = OPEN;
+            m_kinds[')'] = CLOSE;
+            m_kinds[';'] = COMMENT;
+        }
+
+        // Reads the next top level expression into *expr.  Returns false at
+        // the end of the input, or on an error, which error() then tells.
+        bool read(cell **expr) {
+            heap::hold h(m_heap); // the lists being read are not roots
+
+            m_error.clear();
+            for (;;) {
+                if (m_pos == m_end && !fill())
+                    return finish(expr);
+
+                if (m_comment) {
+                    const char *nl = static_cast<const char *>(memchr(&m_buf[m_pos], '\n', m_end - m_pos));
+                    if (nl == nullptr) {
+                        m_pos = m_end;
+                        continue;
+                    }
+                    m_pos = nl - m_buf.data();
+                    m_comment = false;
+                }
+
+                char c = m_buf[m_pos];
+                switch (kind(c)) {
+                    case SPACE:
+                        if (c == '\n')
+                            ++m_line;
+                        ++m_pos;
+                        if (!m_token.empty() && token(expr))
+                            return true;
+                        break;
+                    case COMMENT:
+                        m_comment = true;
+                        ++m_pos;
+                        if (!m_token.empty() && token(expr))
+                            return true;
+                        break;
+                    case OPEN:
+                        if (!m_token.empty() && token(expr))
+                            return true; // the parenthesis is read next time
+                        m_stack.push_back(frame { nullptr, nullptr });
+                        ++m_pos;
+                        break;
+                    case CLOSE: {
+                        if (!m_token.empty() && token(expr))
+                            return true;
+                        if (m_stack.empty()) {
+                            ++m_pos;
+                            m_error = "unexpected )";
+                            return false;
+                        }
+                        cell *list = m_stack.back().head;
+                        m_stack.pop_back();
+                        ++m_pos;
+                        if (add(list, expr))
+                            return true;
+                        break;
+                    }
+                    case ATOM: {
+                        // Locals, as the compiler must assume chars alias members.
+                        const char *buf = m_buf.data();
+                        size_t start = m_pos, pos = m_pos, end = m_end;
+                        uint32_t h = symtab::HASH_INIT;
+                        do
+                            h = symtab::next_hash(h, buf[pos++]);
+                        while (pos < end && kind(buf[pos]) == ATOM);
+                        m_pos = pos;
+                        if (m_pos == m_end || !m_token.empty()) {
+                            // Maybe cut by the end of the chunk.
+                            m_token.append(&m_buf[start], m_pos - start);
+                            break;
+                        }
+                        if (add(m_heap.atom(m_heap.symbols().intern(&m_buf[start], m_pos - start, h)), expr))
+                            return true;
+                        break;
+                    }
+                }
+            }
+        }
+
+        // Forgets the expression being read and the rest of the chunk, to
+        // start afresh after an error.
+        void reset() {
+            m_stack.clear();
+            m_token.clear();
+            m_comment = false;
+            m_pos = m_end;
+        }
+
+        const std::string &error() const {
+            return m_error;
+        }
+
+        size_t line() const {
+            return m_line;
+        }
+
+    private:
+        enum kinds {
+            ATOM,
+            SPACE,
+            OPEN,
+            CLOSE,
+            COMMENT,
+        };
+
+        struct frame {
+            cell *head;
+            cell *tail;
+        };
+
+        heap &m_heap;
+        int m_fd;
+        std::vector<char> m_buf;
+        size_t m_pos;
+        size_t m_end;
+        size_t m_line;
+        bool m_comment;
+        bool m_eof;
+        std::vector<frame> m_stack; // lists being read
+        std::string m_token;        // atom cut by the end of a chunk
+        std::string m_error;
+        unsigned char m_kinds[256]; // enum kinds by character
+
+        enum kinds kind(char c) const {
+            return static_cast<enum kinds>(m_kinds[static_cast<unsigned char>(c)]);
+        }
+
+        bool fill() {
+            ssize_t n;
+
+            if (m_eof)
+                return false;
+            do
+                n = ::read(m_fd, m_buf.data(), m_buf.size());
+            while (n == -1 && errno == EINTR);
+            if (n <= 0) {
+                if (n == -1)
+                    m_error = strerror(errno);
+                m_eof = true;
+                return false;
+            }
+            m_pos = 0;
+            m_end = n;
+            return true;
+        }
+
+        // Puts a value read into the innermost open list.  Returns true if
+        // it is a top level expression, which goes to *expr instead.
+        bool add(cell *value, cell **expr) {
+            if (m_stack.empty()) {
+                *expr = value;
+                return true;
+            }
+
+            frame &f = m_stack.back();
+            cell *c = m_heap.cons(value, nullptr);
+            if (f.tail == nullptr)
+                f.head = c;
+            else
+                f.tail->cdr = c;
+            f.tail = c;
+            return false;
+        }
+
+        bool token(cell **expr) {
+            cell *a = m_heap.atom(m_heap.symbols().intern(m_token));
+            m_token.clear();
+            return add(a, expr);
+        }
+
+        bool finish(cell **expr) {
+            if (!m_token.empty() && token(expr))
+                return true;
+            if (!m_stack.empty()) {
+                m_stack.clear();
+                if (m_error.empty())
+                    m_error = "unexpected end of input";
+            }
+            return false;
+        }
+};
+
+#endif // READER_H_
@@ -0,0 +1,240 @@
+#ifndef SEXP_H_
+#define SEXP_H_
+
+#include <cstddef>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "lisp.h"
+
+// Expressions the compiler can build and evaluate, so that a program known
+// at compile time is a constant:
+//
+//     constexpr auto v = make_sexp("cdr", make_sexp("aaa", "bbb", "ccc")).eval();
+//     static_assert(v == make_sexp("bbb", "ccc"), "");
+//
+// A sexp<N> holds up to N nodes in an array, linked by index; -1 is the
+// empty list.  Atoms point to their string literals.  eval() has the
+// builtins of lisp::eval(), with atoms eq by name and lists by identity as
+// in heap::eval(); there are no variables.
+
+struct sexp_node {
+    bool cons = false;
+    const char *name = nullptr; // atom
+    int car = -1;               // cons
+    int cdr = -1;               // cons
+};
+
+constexpr bool sexp_streq(const char *a, const char *b) {
+    while (*a != '\0' && *a == *b) {
+        ++a;
+        ++b;
+    }
+    return *a == *b;
+}
+
+template<size_t N> class sexp {
+    public:
+        constexpr sexp() :
+            m_nodes(),
+            m_used(0),
+            m_root(-1)
+        {
+        }
+
+        constexpr int root() const {
+            return m_root;
+        }
+
+        constexpr const sexp_node &node(int i) const {
+            return m_nodes[i];
+        }
+
+        constexpr size_t size() const {
+            return m_used;
+        }
+
+        constexpr int add(const char *name) {
+            m_nodes[m_used] = sexp_node { false, name, -1, -1 };
+            return m_used++;
+        }
+
+        // Copies s's nodes in, returning where its root went.
+        template<size_t M> constexpr int add(const sexp<M> &s) {
+            int base = m_used;
+
+            for (size_t i = 0; i < s.size(); ++i) {
+                sexp_node n = s.node(i);
+                if (n.cons) {
+                    n.car = n.car == -1 ? -1 : n.car + base;
+                    n.cdr = n.cdr == -1 ? -1 : n.cdr + base;
+                }
+                m_nodes[m_used++] = n;
+            }
+            return s.root() == -1 ? -1 : s.root() + base;
+        }
+
+        constexpr int cons(int car, int cdr) {
+            m_nodes[m_used] = sexp_node { true, nullptr, car, cdr };
+            return m_used++;
+        }
+
+        constexpr void set_root(int root) {
+            m_root = root;
+        }
+
+        // The value, with the expression's nodes and room for a new node
+        // per cons.
+        constexpr sexp<2 * N> eval() const {
+            sexp<2 * N> v;
+
+            v.set_root(v.eval(v.add(*this)));
+            return v;
+        }
+
+        // The value of the expression at node i, which is in this sexp.
+        constexpr int eval(int i) {
+            if (i == -1 || !m_nodes[i].cons)
+                return i;
+
+            int head = m_nodes[i].car;
+            if (head == -1 || m_nodes[head].cons)
+                return i;
+            const char *op = m_nodes[head].name;
+            if (sexp_streq(op, "quote"))
+                return m_nodes[i].cdr;
+            if (sexp_streq(op, "atom")) {
+                int v = eval(arg(i, 1));
+                return v != -1 && !m_nodes[v].cons ? add("t") : -1;
+            }
+            if (sexp_streq(op, "car") || sexp_streq(op, "cdr")) {
+                int v = eval(arg(i, 1));
+                if (v == -1 || !m_nodes[v].cons)
+                    return -1;
+                return sexp_streq(op, "car") ? m_nodes[v].car : m_nodes[v].cdr;
+            }
+            if (sexp_streq(op, "eq")) {
+                int a = eval(arg(i, 1));
+                int b = eval(arg(i, 2));
+                return eq(a, b) ? add("t") : -1;
+            }
+            if (sexp_streq(op, "cons")) {
+                if (m_nodes[i].cdr == -1)
+                    return -1;
+                int a = eval(arg(i, 1));
+                int b = eval(arg(i, 2));
+                if (a != -1 && !m_nodes[a].cons && (b == -1 || m_nodes[b].cons))
+                    return cons(a, b);
+                return -1;
+            }
+            return i;
+        }
+
+        // Same structure and atom names.
+        template<size_t M> constexpr bool operator==(const sexp<M> &rhs) const {
+            return equal(m_root, rhs, rhs.root());
+        }
+
+        template<size_t M> constexpr bool equal(int i, const sexp<M> &rhs, int j) const {
+            if (i == -1 || j == -1)
+                return i == j;
+            if (m_nodes[i].cons != rhs.node(j).cons)
+                return false;
+            if (!m_nodes[i].cons)
+                return sexp_streq(m_nodes[i].name, rhs.node(j).name);
+            return equal(m_nodes[i].car, rhs, rhs.node(j).car) && equal(m_nodes[i].cdr, rhs, rhs.node(j).cdr);
+        }
+
+        // Same format as lisp::str().
+        std::string str() const {
+            std::ostringstream os;
+
+            print(os, m_root);
+            return os.str();
+        }
+
+        lisp to_lisp() const {
+            return to_lisp(m_root);
+        }
+
+    private:
+        sexp_node m_nodes[N];
+        size_t m_used;
+        int m_root;
+
+        constexpr int arg(int i, int n) const {
+            for (; i != -1 && m_nodes[i].cons; i = m_nodes[i].cdr)
+                if (n-- == 0)
+                    return m_nodes[i].car;
+            return -1;
+        }
+
+        constexpr bool eq(int a, int b) const {
+            if (a == -1 || b == -1)
+                return a == b;
+            if (!m_nodes[a].cons && !m_nodes[b].cons)
+                return sexp_streq(m_nodes[a].name, m_nodes[b].name);
+            return a == b;
+        }
+
+        void print(std::ostream &os, int i) const {
+            if (i == -1) {
+                os << "()";
+            } else if (!m_nodes[i].cons) {
+                os << m_nodes[i].name;
+            } else {
+                os << '(';
+                for (int j = i; j != -1; j = m_nodes[j].cdr) {
+                    if (j != i)
+                        os << ", ";
+                    print(os, m_nodes[j].car);
+                }
+                os << ')';
+            }
+        }
+
+        lisp to_lisp(int i) const {
+            if (i != -1 && !m_nodes[i].cons)
+                return lisp(std::string(m_nodes[i].name));
+
+            std::vector<lisp> v;
+            for (; i != -1; i = m_nodes[i].cdr)
+                v.push_back(to_lisp(m_nodes[i].car));
+            return lisp(v);
+        }
+};
+
+// Nodes make_sexp() needs for an argument: one for an atom, all of a sexp's.
+template<typename T> struct sexp_nodes {
+    static constexpr size_t value = 1;
+};
+
+template<size_t N> struct sexp_nodes<sexp<N>> {
+    static constexpr size_t value = N;
+};
+
+// Nodes for a list of the arguments: theirs and a cons per element, and at
+// least one so that the array is not empty.
+template<typename ... Types> struct sexp_list_nodes {
+    static constexpr size_t value = 1;
+};
+
+template<typename T, typename ... Types> struct sexp_list_nodes<T, Types...> {
+    static constexpr size_t value = sexp_nodes<T>::value + 1 + sexp_list_nodes<Types...>::value;
+};
+
+// The list of the arguments, each an atom's name or a sexp, like the lisp
+// constructors take.
+template<typename ... Types> constexpr sexp<sexp_list_nodes<Types...>::value> make_sexp(Types ... args) {
+    sexp<sexp_list_nodes<Types...>::value> s;
+    int items[] = { s.add(args)..., -1 };
+    int list = -1;
+
+    for (size_t i = sizeof...(Types); i-- > 0; )
+        list = s.cons(items[i], list);
+    s.set_root(list);
+    return s;
+}
+
+#endif // SEXP_H_
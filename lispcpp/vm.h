@@ -0,0 +1,176 @@
+#ifndef VM_H_
+#define VM_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "cell.h"
+
+// A cell expression compiled to bytecode for a stack machine, so that
+// evaluating it again does not look at the expression's head symbols.
+// Arguments are compiled before their operator, and quoted lists become
+// constants.  Atoms are looked up as global variables when run, and what
+// the machine has no instruction for is left to heap::eval().
+class program {
+    public:
+        enum opcodes {
+            CONST, // push constant operand
+            VAR,   // push the global variable of atom operand, or the atom
+            EVAL,  // push heap::eval() of constant operand
+            ATOM,
+            CAR,
+            CDR,
+            EQ,
+            CONS,
+            RET,
+        };
+
+        program(heap &h, cell *expr) :
+            m_heap(h),
+            m_t(nullptr),
+            m_depth(0),
+            m_max_depth(0)
+        {
+            heap::hold hold(h); // nothing roots expr until m_consts does
+
+            m_t = h.atom(heap::T);
+            compile(expr);
+            emit(RET);
+            m_stack.resize(m_max_depth);
+            h.add_roots(&m_consts);
+            h.add_roots(&m_stack);
+        }
+
+        ~program() {
+            m_heap.remove_roots(&m_stack);
+            m_heap.remove_roots(&m_consts);
+        }
+
+        program(const program &) = delete;
+        program &operator=(const program &) = delete;
+
+        // Same result as heap::eval() on the expression.
+        cell *run() {
+            cell **sp = m_stack.data();
+
+            for (const uint32_t *pc = m_code.data(); ; ++pc) {
+                switch (*pc & 0xff) {
+                    case CONST:
+                        *sp++ = m_consts[*pc >> 8];
+                        break;
+                    case VAR:
+                        *sp++ = m_heap.value(m_consts[*pc >> 8]);
+                        break;
+                    case EVAL:
+                        *sp++ = m_heap.eval(m_consts[*pc >> 8]);
+                        break;
+                    case ATOM:
+                        sp[-1] = sp[-1] != nullptr && sp[-1]->type == cell::ATOM ? m_t : nullptr;
+                        break;
+                    case CAR:
+                        sp[-1] = sp[-1] != nullptr && sp[-1]->type == cell::CONS ? sp[-1]->car : nullptr;
+                        break;
+                    case CDR:
+                        sp[-1] = sp[-1] != nullptr && sp[-1]->type == cell::CONS ? sp[-1]->cdr : nullptr;
+                        break;
+                    case EQ:
+                        --sp;
+                        sp[-1] = sp[-1] == sp[0] ? m_t : nullptr;
+                        break;
+                    case CONS: {
+                        cell *a = sp[-2], *b = *--sp;
+                        if (a != nullptr && a->type == cell::ATOM && (b == nullptr || b->type == cell::CONS))
+                            sp[-1] = m_heap.cons(a, b);
+                        else
+                            sp[-1] = nullptr;
+                        break;
+                    }
+                    case RET: {
+                        cell *v = sp[-1];
+                        // Let the heap collect what the stack held.
+                        std::fill(m_stack.begin(), m_stack.end(), nullptr);
+                        return v;
+                    }
+                }
+            }
+        }
+
+        // Instructions, RET included.
+        size_t size() const {
+            return m_code.size();
+        }
+
+    private:
+        heap &m_heap;
+        cell *m_t;
+        std::vector<uint32_t> m_code; // opcode | operand << 8
+        std::vector<cell *> m_consts;
+        std::vector<cell *> m_stack;
+        size_t m_depth;
+        size_t m_max_depth;
+
+        void emit(enum opcodes op, uint32_t operand = 0) {
+            m_code.push_back(op | operand << 8);
+        }
+
+        void push(cell *c, enum opcodes op = CONST) {
+            emit(op, m_consts.size());
+            m_consts.push_back(c);
+            if (++m_depth > m_max_depth)
+                m_max_depth = m_depth;
+        }
+
+        void compile(cell *c) {
+            if (c == nullptr || c->type == cell::CLOSURE) {
+                push(c);
+                return;
+            }
+            if (c->type == cell::ATOM) {
+                push(c, VAR);
+                return;
+            }
+            if (c->car == nullptr || c->car->type != cell::ATOM) {
+                push(c, EVAL);
+                return;
+            }
+            switch (c->car->sym) {
+                case heap::QUOTE:
+                    push(c->cdr);
+                    break;
+                case heap::ATOM:
+                    compile(heap::arg(c, 1));
+                    emit(ATOM);
+                    break;
+                case heap::CAR:
+                    compile(heap::arg(c, 1));
+                    emit(CAR);
+                    break;
+                case heap::CDR:
+                    compile(heap::arg(c, 1));
+                    emit(CDR);
+                    break;
+                case heap::EQ:
+                    compile(heap::arg(c, 1));
+                    compile(heap::arg(c, 2));
+                    emit(EQ);
+                    --m_depth;
+                    break;
+                case heap::CONS:
+                    if (c->cdr == nullptr) {
+                        push(nullptr);
+                        break;
+                    }
+                    compile(heap::arg(c, 1));
+                    compile(heap::arg(c, 2));
+                    emit(CONS);
+                    --m_depth;
+                    break;
+                default:
+                    push(c, EVAL);
+                    break;
+            }
+        }
+};
+
+#endif // VM_H_
@@ -0,0 +1,89 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include <unistd.h>
+#include <err.h>
+
+#include "jsontok.hpp"
+#include "recvbuf.hpp"
+#include "json.hpp"
+
+// Fills a recvbuf with nreqs newline-delimited requests and times pulling
+// the "request" member out of each one, first with jsontok straight from the
+// buffer and then by copying each line and running it through json::parse().
+static FILE *
+make_requests(size_t nreqs)
+{
+    static const char *names[] = { "hello", "login", "stats", "echo" };
+    FILE *fp;
+
+    fp = tmpfile();
+    if (fp == NULL)
+        err(1, "tmpfile");
+    for (size_t i = 0; i < nreqs; ++i)
+        fprintf(fp, "{ \"seq\" : %zu, \"app\" : \"cs.bc.mb\", \"args\" : [ 1, 2, { \"x\" : null } ], "
+            "\"request\" : \"%s\", \"username\" : \"jdoe\" }\n", i, names[i % 4]);
+    if (fflush(fp) == EOF)
+        err(1, "fflush");
+    return fp;
+}
+
+static void
+load(FILE *fp, recvbuf &rbuf)
+{
+    if (lseek(fileno(fp), 0, SEEK_SET) == -1)
+        err(1, "lseek");
+    rbuf.read(fileno(fp));
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t nreqs = 1000000;
+    size_t n, hellos;
+    std::string scratch;
+    std::string_view name;
+
+    if (argc > 1)
+        nreqs = strtoul(argv[1], NULL, 10);
+
+    FILE *fp = make_requests(nreqs);
+
+    {
+        recvbuf rbuf;
+        load(fp, rbuf);
+        n = hellos = 0;
+        auto t0 = std::chrono::steady_clock::now();
+        while (rbuf.has_msg()) {
+            if (!json_get_string(rbuf.pop_msg(), "request", scratch, name))
+                errx(1, "jsontok: request %zu is malformed", n);
+            hellos += name == "hello";
+            ++n;
+        }
+        std::chrono::duration<double> t = std::chrono::steady_clock::now() - t0;
+        std::cout << "jsontok: " << n << " requests, " << hellos << " hellos, "
+            << t.count() << " s, " << t.count() * 1e9 / n << " ns/request" << std::endl;
+    }
+
+    {
+        recvbuf rbuf;
+        load(fp, rbuf);
+        n = hellos = 0;
+        auto t0 = std::chrono::steady_clock::now();
+        while (rbuf.has_msg()) {
+            json::value request(json::parse(std::string(rbuf.pop_msg())));
+            hellos += request["request"] == "hello";
+            ++n;
+        }
+        std::chrono::duration<double> t = std::chrono::steady_clock::now() - t0;
+        std::cout << "json::parse: " << n << " requests, " << hellos << " hellos, "
+            << t.count() << " s, " << t.count() * 1e9 / n << " ns/request" << std::endl;
+    }
+
+    fclose(fp);
+
+    return 0;
+}
@@ -0,0 +1,74 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include <unistd.h>
+#include <err.h>
+
+#include "recvbuf.hpp"
+
+// Writes nmsgs short lines, or with -f length-prefixed frames, into a
+// temporary file, slurps it with a single recvbuf::read() and times how long
+// it takes to pop every message.
+int main(int argc, char **argv) {
+    size_t nmsgs = 1000000;
+    bool framed = false;
+
+    if (argc > 1 && strcmp(argv[1], "-f") == 0) {
+        framed = true;
+        --argc, ++argv;
+    }
+    if (argc > 1)
+        nmsgs = strtoul(argv[1], nullptr, 10);
+
+    FILE *fp = tmpfile();
+    if (fp == nullptr)
+        err(1, "tmpfile");
+    for (size_t i = 0; i < nmsgs; ++i) {
+        if (framed) {
+            char msg[64], hdr[recvbuf::hdr_size];
+            int len = snprintf(msg, sizeof msg, "message %zu", i);
+            recvbuf::put_header(hdr, len);
+            fwrite(hdr, 1, sizeof hdr, fp);
+            fwrite(msg, 1, len, fp);
+        } else {
+            fprintf(fp, "message %zu\n", i);
+        }
+    }
+    if (fflush(fp) == EOF)
+        err(1, "fflush");
+    if (lseek(fileno(fp), 0, SEEK_SET) == -1)
+        err(1, "lseek");
+
+    recvbuf rbuf;
+    if (framed)
+        rbuf.set_framing(recvbuf::LENGTH);
+
+    auto t0 = std::chrono::steady_clock::now();
+    size_t nbytes = rbuf.read(fileno(fp));
+    auto t1 = std::chrono::steady_clock::now();
+
+    size_t n = 0, sum = 0;
+    while (rbuf.has_msg()) {
+        sum += rbuf.pop_msg().size();
+        ++n;
+    }
+    auto t2 = std::chrono::steady_clock::now();
+
+    fclose(fp);
+
+    if (n != nmsgs)
+        errx(1, "popped %zu messages, expected %zu", n, nmsgs);
+
+    std::chrono::duration<double> tread = t1 - t0, tdrain = t2 - t1;
+    std::cout << "bytes: " << nbytes << std::endl
+              << "msgs: " << n << " (" << sum << " payload bytes)" << std::endl
+              << "read: " << tread.count() << " s" << std::endl
+              << "drain: " << tdrain.count() << " s, "
+              << tdrain.count() * 1e9 / n << " ns/msg" << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,100 @@
+#ifndef HISTOGRAM_HPP
+#define HISTOGRAM_HPP
+
+#include <atomic>
+#include <cstdint>
+
+// HDR-style latency histogram with log-linear buckets.
+//
+// Values below 2^sub_bits are counted exactly; above that every power of
+// two is split into 2^(sub_bits - 1) equal buckets, so any recorded value
+// is reported within 1/64 of itself.  record() is meant to be called by a
+// single thread; the counters are atomic only so that another thread may
+// read a consistent-enough snapshot through merge().
+class histogram {
+    public:
+        static const unsigned sub_bits = 7;
+        static const unsigned half = 1u << (sub_bits - 1);
+        static const unsigned nbuckets = (64 - sub_bits + 2) * half;
+
+        histogram() {
+            for (auto &b : buckets)
+                b.store(0, std::memory_order_relaxed);
+        }
+
+        void record(uint64_t v) {
+            bump(buckets[index(v)], 1);
+            bump(n, 1);
+            bump(sum, v);
+            if (v > max.load(std::memory_order_relaxed))
+                max.store(v, std::memory_order_relaxed);
+        }
+
+        // Adds the counts of other to this histogram.
+        void merge(const histogram &other) {
+            for (unsigned i = 0; i < nbuckets; ++i)
+                bump(buckets[i], other.buckets[i].load(std::memory_order_relaxed));
+            bump(n, other.n.load(std::memory_order_relaxed));
+            bump(sum, other.sum.load(std::memory_order_relaxed));
+            if (other.max.load(std::memory_order_relaxed) > max.load(std::memory_order_relaxed))
+                max.store(other.max.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+
+        uint64_t count() const {
+            return n.load(std::memory_order_relaxed);
+        }
+
+        uint64_t maximum() const {
+            return max.load(std::memory_order_relaxed);
+        }
+
+        uint64_t mean() const {
+            uint64_t c = count();
+            return c == 0 ? 0 : sum.load(std::memory_order_relaxed) / c;
+        }
+
+        // Returns the highest value equivalent to the q-th quantile, q in
+        // [0, 1].
+        uint64_t quantile(double q) const {
+            uint64_t c = count();
+            if (c == 0)
+                return 0;
+            uint64_t rank = (uint64_t) (q * c + 0.5);
+            if (rank < 1)
+                rank = 1;
+            uint64_t seen = 0;
+            for (unsigned i = 0; i < nbuckets; ++i) {
+                seen += buckets[i].load(std::memory_order_relaxed);
+                if (seen >= rank)
+                    return highest(i) < maximum() ? highest(i) : maximum();
+            }
+            return maximum();
+        }
+
+    private:
+        std::atomic<uint64_t>   buckets[nbuckets];
+        std::atomic<uint64_t>   n { 0 };
+        std::atomic<uint64_t>   sum { 0 };
+        std::atomic<uint64_t>   max { 0 };
+
+        static void bump(std::atomic<uint64_t> &a, uint64_t v) {
+            a.store(a.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+        }
+
+        static unsigned index(uint64_t v) {
+            if (v < 2 * half)
+                return v;
+            unsigned shift = 63 - __builtin_clzll(v) - (sub_bits - 1);
+            return shift * half + (unsigned) (v >> shift);
+        }
+
+        static uint64_t highest(unsigned i) {
+            if (i < 2 * half)
+                return i;
+            unsigned shift = i / half - 1;
+            uint64_t m = i - shift * half;
+            return ((m + 1) << shift) - 1;
+        }
+};
+
+#endif
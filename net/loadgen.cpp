@@ -0,0 +1,406 @@
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+#include <err.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "histogram.hpp"
+#include "jsontok.hpp"
+#include "poller.hpp"
+#include "recvbuf.hpp"
+
+// Load generator for the chat (chat/server3) and request/response
+// (net/server) servers.
+//
+// Opens many connections, sends newline-delimited JSON at a fixed total
+// rate spread over them and measures end-to-end latency.  In chat mode
+// every message carries its send time and each copy broadcast back to the
+// other connections is timed; in net mode responses are matched to
+// requests in order on each connection.  With -f the connections negotiate
+// length-prefixed frames instead of newline-delimited messages.  Results are
+// printed as a single JSON object on stdout.
+
+enum Mode {
+    CHAT,
+    NET,
+};
+
+struct Load_conn {
+    int fd = -1;
+    bool connected = false;
+    bool writing = false;
+    recvbuf rbuf;
+    std::string wbuf;
+    size_t wpos = 0;
+    std::deque<int64_t> pending;    // send times of unanswered requests
+};
+
+struct Load_opts {
+    std::string ip = "127.0.0.1";
+    unsigned short port = 1234;
+    Mode mode = CHAT;
+    bool framed = false;
+    int nconns = 1000;
+    double rate = 1000;             // messages per second, all connections
+    double duration = 10;           // seconds, after warm-up
+    double warmup = 1;              // seconds
+    size_t size = 64;               // payload bytes per message
+};
+
+struct Load_stats {
+    uint64_t sent = 0;
+    uint64_t received = 0;
+    uint64_t bytes_sent = 0;
+    uint64_t bytes_received = 0;
+    uint64_t stalls = 0;            // messages skipped because a send queue was full
+    uint64_t errors = 0;
+    histogram latency;
+};
+
+void usage(void);
+void loadgen(const Load_opts &);
+
+static int64_t
+now_ns(void)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int
+main(int argc, char **argv)
+{
+    int         ch;
+    Load_opts     opts;
+    extern char    *optarg;
+
+    while ((ch = getopt(argc, argv, "c:d:fhi:m:p:r:s:w:")) != -1) {
+        switch (ch) {
+        case 'c':
+            opts.nconns = atoi(optarg);
+            break;
+        case 'd':
+            opts.duration = atof(optarg);
+            break;
+        case 'f':
+            opts.framed = true;
+            break;
+        case 'h':
+            usage();
+            return 0;
+        case 'i':
+            opts.ip = optarg;
+            break;
+        case 'm':
+            if (!strcmp(optarg, "chat"))
+                opts.mode = CHAT;
+            else if (!strcmp(optarg, "net"))
+                opts.mode = NET;
+            else
+                errx(1, "unknown mode: %s", optarg);
+            break;
+        case 'p':
+            opts.port = atoi(optarg);
+            break;
+        case 'r':
+            opts.rate = atof(optarg);
+            break;
+        case 's':
+            opts.size = strtoul(optarg, NULL, 10);
+            break;
+        case 'w':
+            opts.warmup = atof(optarg);
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (opts.nconns < 1 || opts.rate <= 0 || opts.duration <= 0)
+        errx(1, "connections, rate and duration must be positive");
+
+    loadgen(opts);
+
+    return 0;
+}
+
+void
+usage(void)
+{
+    fprintf(stderr, "usage: loadgen [-f] [-m chat|net] [-i <ip_addr>] [-p <port>] [-c <conns>]\n"
+        "               [-r <msgs/s>] [-s <bytes>] [-d <secs>] [-w <secs>]\n"
+        "Defaults: chat mode, 127.0.0.1:1234, 1000 connections, 1000 msgs/s,\n"
+        "64 byte payloads, 10 s measured after 1 s of warm-up.\n"
+        "-f negotiates length-prefixed frames instead of newline-delimited text.\n");
+}
+
+// Thousands of connections need more than the usual 1024 descriptors.
+static void
+raise_nofile(int nconns)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == -1)
+        err(1, "getrlimit");
+    if (rl.rlim_cur < (rlim_t) nconns + 64) {
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) == -1)
+            warn("setrlimit");
+    }
+}
+
+static int
+connect_nonblock(const sockaddr_in &sa)
+{
+    int s, on = 1;
+
+    s = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (s == -1)
+        err(1, "socket");
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+    if (connect(s, (const sockaddr *) &sa, sizeof sa) == -1 && errno != EINPROGRESS)
+        err(1, "connect");
+    return s;
+}
+
+static bool
+flush(Load_conn &c, poller &p)
+{
+    while (c.wpos < c.wbuf.size()) {
+        ssize_t n = write(c.fd, c.wbuf.data() + c.wpos, c.wbuf.size() - c.wpos);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return false;
+            if (!c.writing) {
+                c.writing = true;
+                p.want_write(c.fd, true);
+            }
+            return true;
+        }
+        c.wpos += n;
+    }
+    c.wbuf.clear();
+    c.wpos = 0;
+    if (c.writing) {
+        c.writing = false;
+        p.want_write(c.fd, false);
+    }
+    return true;
+}
+
+static void
+send_one(Load_conn &c, poller &p, const Load_opts &opts, const std::string &padding,
+    Load_stats &st, bool measure)
+{
+    static const size_t max_queued = 64 * 1024;
+    char head[96];
+    int64_t t = now_ns();
+
+    if (c.wbuf.size() - c.wpos > max_queued) {
+        if (measure)
+            ++st.stalls;
+        return;
+    }
+    if (opts.mode == CHAT)
+        snprintf(head, sizeof head, "{ \"request\" : \"msg\", \"ts\" : \"%lld\", \"pad\" : \"",
+            (long long) t);
+    else
+        snprintf(head, sizeof head, "{ \"request\" : \"hello\", \"pad\" : \"");
+    size_t before = c.wbuf.size();
+    if (opts.framed) {
+        char hdr[recvbuf::hdr_size];
+        recvbuf::put_header(hdr, strlen(head) + padding.size() + 3);
+        c.wbuf.append(hdr, sizeof hdr);
+    }
+    c.wbuf += head;
+    c.wbuf += padding;
+    c.wbuf += opts.framed ? "\" }" : "\" }\n";
+    if (opts.mode == NET)
+        c.pending.push_back(measure ? t : -1);
+    if (measure) {
+        ++st.sent;
+        st.bytes_sent += c.wbuf.size() - before;
+    }
+    if (!c.writing && !flush(c, p))
+        ++st.errors;
+}
+
+static void
+receive(Load_conn &c, const Load_opts &opts, Load_stats &st, bool measure, std::string &scratch)
+{
+    std::string_view ts;
+
+    // Text sent before the server switched this connection to frames is
+    // not measured.
+    while (opts.framed && c.rbuf.get_framing() == recvbuf::MARKER) {
+        std::string_view head(c.rbuf.peek());
+        if (!head.empty() && head[0] == recvbuf::framing_hello) {
+            c.rbuf.skip(1);
+            c.rbuf.set_framing(recvbuf::LENGTH);
+        } else if (c.rbuf.has_msg()) {
+            c.rbuf.pop_msg();
+        } else {
+            return;
+        }
+    }
+
+    while (c.rbuf.has_msg()) {
+        std::string_view msg(c.rbuf.pop_msg());
+        int64_t t0 = -1, t = now_ns();
+
+        if (opts.mode == CHAT) {
+            if (json_get_string(msg, "ts", scratch, ts))
+                t0 = strtoll(std::string(ts).c_str(), NULL, 10);
+        } else if (!c.pending.empty()) {
+            t0 = c.pending.front();
+            c.pending.pop_front();
+        }
+        if (!measure || t0 < 0)
+            continue;
+        ++st.received;
+        st.bytes_received += msg.size() + (opts.framed ? recvbuf::hdr_size : 1);
+        st.latency.record(t - t0);
+    }
+}
+
+static void
+report(const Load_opts &opts, const Load_stats &st, double secs)
+{
+    printf("{ \"mode\" : \"%s\", \"conns\" : %d, \"target_rate\" : %.0f, \"duration_s\" : %.3f, "
+        "\"sent\" : %llu, \"received\" : %llu, \"send_rate\" : %.1f, \"recv_rate\" : %.1f, "
+        "\"recv_mbps\" : %.2f, \"stalls\" : %llu, \"errors\" : %llu, "
+        "\"p50_us\" : %.1f, \"p99_us\" : %.1f, \"p999_us\" : %.1f, \"max_us\" : %.1f }\n",
+        opts.mode == CHAT ? "chat" : "net", opts.nconns, opts.rate, secs,
+        (unsigned long long) st.sent, (unsigned long long) st.received,
+        st.sent / secs, st.received / secs, st.bytes_received * 8 / secs / 1e6,
+        (unsigned long long) st.stalls, (unsigned long long) st.errors,
+        st.latency.quantile(0.5) / 1e3, st.latency.quantile(0.99) / 1e3,
+        st.latency.quantile(0.999) / 1e3, st.latency.maximum() / 1e3);
+}
+
+void
+loadgen(const Load_opts &opts)
+{
+    sockaddr_in sa;
+    std::unique_ptr<poller> p = make_poller(true);
+    std::vector<Load_conn> conns;
+    std::vector<int> slot;          // fd -> index into conns
+    std::vector<pollev> evs;
+    std::string padding(opts.size, 'x');
+    std::string scratch;
+    Load_stats st;
+    int nconnected = 0;
+
+    signal(SIGPIPE, SIG_IGN);
+    raise_nofile(opts.nconns);
+
+    memset(&sa, 0, sizeof sa);
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(opts.port);
+    if (inet_pton(AF_INET, opts.ip.c_str(), &sa.sin_addr) != 1)
+        errx(1, "invalid ip address specification");
+
+    conns.resize(opts.nconns);
+    for (int i = 0; i < opts.nconns; ++i) {
+        Load_conn &c = conns[i];
+        c.fd = connect_nonblock(sa);
+        if ((size_t) c.fd >= slot.size())
+            slot.resize(c.fd + 1, -1);
+        slot[c.fd] = i;
+        p->add(c.fd);
+        p->want_write(c.fd, true);
+        c.writing = true;
+    }
+
+    int64_t start = now_ns();
+    while (nconnected < opts.nconns) {
+        p->wait(evs, 1000);
+        if (now_ns() - start > 30 * 1000000000LL)
+            errx(1, "only %d of %d connections established", nconnected, opts.nconns);
+        for (const pollev &ev : evs) {
+            Load_conn &c = conns[slot[ev.fd]];
+            if (c.connected || !(ev.out || ev.hup))
+                continue;
+            int e = 0;
+            socklen_t len = sizeof e;
+            if (getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &e, &len) == -1 || e != 0)
+                errx(1, "connect: %s", strerror(e));
+            c.connected = true;
+            c.writing = false;
+            p->want_write(c.fd, false);
+            if (opts.framed) {
+                c.wbuf += recvbuf::framing_hello;
+                if (!flush(c, *p))
+                    errx(1, "write: connection %d", slot[ev.fd]);
+            }
+            ++nconnected;
+        }
+    }
+    fprintf(stderr, "%d connections established in %.3f s\n", nconnected,
+        (now_ns() - start) / 1e9);
+
+    const int64_t interval = 1000000;   // schedule sends every millisecond
+    int64_t t0 = now_ns();
+    int64_t measure_from = t0 + (int64_t) (opts.warmup * 1e9);
+    int64_t measure_to = measure_from + (int64_t) (opts.duration * 1e9);
+    int64_t drain_to = measure_to + 1000000000LL;
+    uint64_t scheduled = 0;
+    size_t next = 0;
+
+    for ( ;; ) {
+        int64_t now = now_ns();
+        if (now >= drain_to)
+            break;
+        if (now < measure_to) {
+            uint64_t due = (uint64_t) ((now - t0) * opts.rate / 1e9);
+            bool measure = now >= measure_from;
+            for ( ; scheduled < due; ++scheduled) {
+                send_one(conns[next], *p, opts, padding, st, measure);
+                next = (next + 1) % conns.size();
+            }
+        }
+
+        p->wait(evs, (int) (interval / 1000000));
+        now = now_ns();
+        bool measure = now >= measure_from;
+        for (const pollev &ev : evs) {
+            Load_conn &c = conns[slot[ev.fd]];
+            if (ev.out && !flush(c, *p))
+                ++st.errors;
+            if (ev.in) {
+                try {
+                    c.rbuf.read(c.fd);
+                } catch (const std::runtime_error &) {
+                    errx(1, "read: connection %d: %s", slot[ev.fd], strerror(errno));
+                }
+                receive(c, opts, st, measure, scratch);
+                if (c.rbuf.eof())
+                    errx(1, "connection %d closed by server", slot[ev.fd]);
+            } else if (ev.hup) {
+                errx(1, "connection %d hung up", slot[ev.fd]);
+            }
+        }
+    }
+
+    report(opts, st, opts.duration);
+
+    for (auto &c : conns)
+        close(c.fd);
+}
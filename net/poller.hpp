@@ -0,0 +1,185 @@
+#ifndef POLLER_HPP
+#define POLLER_HPP
+
+#include <cerrno>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <unistd.h>
+#include <err.h>
+#include <poll.h>
+#include <sys/epoll.h>
+
+// Readiness event reported by poller::wait().
+struct pollev {
+    int     fd;
+    bool    in;
+    bool    out;
+    bool    hup;
+};
+
+// Event loop backend.  Descriptors are watched for input from add() until
+// del(); output readiness is only reported while want_write() is on.
+//
+// The epoll backend is edge-triggered for descriptors added with edge set,
+// so callers must read and write those until EAGAIN.
+class poller {
+    public:
+        virtual ~poller() {}
+
+        virtual void add(int fd, bool edge = true) = 0;
+        virtual void want_write(int fd, bool on) = 0;
+        virtual void del(int fd) = 0;
+
+        // Blocks for up to timeout milliseconds (-1 for ever) and replaces
+        // the contents of evs with the ready descriptors.
+        virtual void wait(std::vector<pollev> &evs, int timeout) = 0;
+
+        virtual const char *name() const = 0;
+};
+
+// poll(2) backend.  slots maps a descriptor to its slot in pfds so that del()
+// can swap the last slot into the hole instead of erasing from the middle.
+class pollpoller : public poller {
+    public:
+        void add(int fd, bool = true) override {
+            if ((size_t) fd >= slots.size())
+                slots.resize(fd + 1, -1);
+            slots[fd] = pfds.size();
+            pfds.push_back({ fd, POLLIN, 0 });
+        }
+
+        void want_write(int fd, bool on) override {
+            pollfd &pfd = pfds[slots[fd]];
+            if (on)
+                pfd.events |= POLLOUT;
+            else
+                pfd.events &= ~POLLOUT;
+        }
+
+        void del(int fd) override {
+            int slot = slots[fd];
+            pfds[slot] = pfds.back();
+            slots[pfds[slot].fd] = slot;
+            pfds.pop_back();
+            slots[fd] = -1;
+        }
+
+        void wait(std::vector<pollev> &evs, int timeout) override {
+            evs.clear();
+            int n = poll(pfds.data(), pfds.size(), timeout);
+            if (n == -1) {
+                if (errno == EINTR)
+                    return;
+                err(1, "poll");
+            }
+            for (auto i = pfds.begin(); n > 0 && i != pfds.end(); ++i) {
+                if (i->revents == 0)
+                    continue;
+                --n;
+                evs.push_back({
+                    i->fd,
+                    (i->revents & POLLIN) != 0,
+                    (i->revents & POLLOUT) != 0,
+                    (i->revents & (POLLHUP | POLLERR | POLLNVAL)) != 0
+                });
+            }
+        }
+
+        const char *name() const override {
+            return "poll";
+        }
+
+    private:
+        std::vector<pollfd>  pfds;
+        std::vector<int>     slots;
+};
+
+// epoll(7) backend.  The kernel keeps the interest list, so wait() costs
+// O(ready descriptors) rather than O(open descriptors).
+class epollpoller : public poller {
+    public:
+        epollpoller() :
+            epfd(epoll_create1(EPOLL_CLOEXEC)),
+            events(maxevents)
+        {
+            if (epfd == -1)
+                err(1, "epoll_create1");
+        }
+
+        ~epollpoller() {
+            close(epfd);
+        }
+
+        void add(int fd, bool edge = true) override {
+            if ((size_t) fd >= edges.size())
+                edges.resize(fd + 1, false);
+            edges[fd] = edge;
+            ctl(EPOLL_CTL_ADD, fd, mask(fd, false));
+        }
+
+        void want_write(int fd, bool on) override {
+            ctl(EPOLL_CTL_MOD, fd, mask(fd, on));
+        }
+
+        void del(int fd) override {
+            if (epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr) == -1)
+                warn("epoll_ctl: del %d", fd);
+        }
+
+        void wait(std::vector<pollev> &evs, int timeout) override {
+            evs.clear();
+            int n = epoll_wait(epfd, events.data(), events.size(), timeout);
+            if (n == -1) {
+                if (errno == EINTR)
+                    return;
+                err(1, "epoll_wait");
+            }
+            for (int i = 0; i < n; ++i) {
+                const epoll_event &ev = events[i];
+                evs.push_back({
+                    ev.data.fd,
+                    (ev.events & (EPOLLIN | EPOLLRDHUP)) != 0,
+                    (ev.events & EPOLLOUT) != 0,
+                    (ev.events & (EPOLLHUP | EPOLLERR)) != 0
+                });
+            }
+        }
+
+        const char *name() const override {
+            return "epoll";
+        }
+
+    private:
+        static const int            maxevents = 1024;
+        int                         epfd;
+        std::vector<epoll_event>    events;
+        std::vector<bool>           edges;
+
+        uint32_t mask(int fd, bool out) const {
+            uint32_t m = EPOLLIN | EPOLLRDHUP;
+            if (out)
+                m |= EPOLLOUT;
+            if (edges[fd])
+                m |= EPOLLET;
+            return m;
+        }
+
+        void ctl(int op, int fd, uint32_t events) {
+            epoll_event ev = {};
+            ev.events = events;
+            ev.data.fd = fd;
+            if (epoll_ctl(epfd, op, fd, &ev) == -1)
+                err(1, "epoll_ctl: fd %d", fd);
+        }
+};
+
+static inline std::unique_ptr<poller> make_poller(bool useepoll) {
+    if (useepoll)
+        return std::unique_ptr<poller>(new epollpoller());
+    else
+        return std::unique_ptr<poller>(new pollpoller());
+}
+
+#endif
@@ -0,0 +1,114 @@
+#ifndef ROUTER_HPP
+#define ROUTER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "histogram.hpp"
+
+// Maps request names to handlers and times every call.
+//
+// Handlers are added once at startup; add() rebuilds an open-addressing
+// table sized to twice the number of routes, so dispatch() costs one hash
+// of the name and, almost always, a single probe.  Each route has its own
+// latency histogram.  A router is owned by one event loop thread.
+class router {
+    public:
+        // Handles one request given its raw JSON text and appends the
+        // response, if any, to out.
+        typedef std::function<void(std::string_view request, std::string &out)> handler;
+
+        struct route {
+            std::string     name;
+            handler         fn;
+            histogram       latency;
+
+            route(std::string_view name, handler fn) :
+                name(name),
+                fn(std::move(fn))
+            {
+            }
+        };
+
+        void add(std::string_view name, handler fn) {
+            routes.emplace_back(new route(name, std::move(fn)));
+            rebuild();
+        }
+
+        // Runs the handler for name.  Returns false if there is none.
+        bool dispatch(std::string_view name, std::string_view request, std::string &out) {
+            route *r = find(name);
+            if (r == nullptr) {
+                unknown.store(unknown.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                return false;
+            }
+            auto t0 = std::chrono::steady_clock::now();
+            r->fn(request, out);
+            auto t1 = std::chrono::steady_clock::now();
+            r->latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count());
+            return true;
+        }
+
+        route *find(std::string_view name) const {
+            uint32_t h = hash(name);
+            for (size_t i = h & mask; ; i = (i + 1) & mask) {
+                const slot &s = table[i];
+                if (s.r == nullptr)
+                    return nullptr;
+                if (s.hash == h && s.r->name == name)
+                    return s.r;
+            }
+        }
+
+        const std::vector<std::unique_ptr<route>> &all() const {
+            return routes;
+        }
+
+        uint64_t unknown_requests() const {
+            return unknown.load(std::memory_order_relaxed);
+        }
+
+    private:
+        struct slot {
+            uint32_t    hash;
+            route      *r;
+        };
+
+        std::vector<std::unique_ptr<route>>     routes;
+        std::vector<slot>                       table = std::vector<slot>(1, slot{ 0, nullptr });
+        size_t                                  mask = 0;
+        std::atomic<uint64_t>                   unknown { 0 };
+
+        // FNV-1a.
+        static uint32_t hash(std::string_view s) {
+            uint32_t h = 2166136261u;
+            for (unsigned char c : s) {
+                h ^= c;
+                h *= 16777619u;
+            }
+            return h;
+        }
+
+        void rebuild() {
+            size_t size = 1;
+            while (size < 2 * routes.size())
+                size <<= 1;
+            table.assign(size, slot{ 0, nullptr });
+            mask = size - 1;
+            for (auto &r : routes) {
+                uint32_t h = hash(r->name);
+                size_t i = h & mask;
+                while (table[i].r != nullptr)
+                    i = (i + 1) & mask;
+                table[i] = slot{ h, r.get() };
+            }
+        }
+};
+
+#endif
@@ -1,29 +1,33 @@
+#include <cerrno>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
 #include <vector>
-#include <map>
-#include <algorithm>
 
 #include <unistd.h>
 #include <err.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <fcntl.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
-#include <poll.h>
 
+#include "jsontok.hpp"
+#include "poller.hpp"
 #include "recvbuf.hpp"
+#include "router.hpp"
 #include "json.hpp"
 
 #define DEFAULT_PORT    1234
 #define POLL_TIMEOUT    -1
+#define LISTEN_BACKLOG  16384   /* clamped by the kernel to net.core.somaxconn */
 
 
 void usage(void);
-void server(unsigned short);
+void server(unsigned short, bool, int);
 
 
 class App {
@@ -32,7 +36,9 @@ class App {
         virtual ~App() = 0;
 };
 
-class Echoer : App {
+inline App::~App() {}
+
+class Echoer : public App {
     public:
         virtual json::value process(const json::value &request) {
             json::value response;
@@ -41,7 +47,7 @@ class Echoer : App {
             response.erase("request");
             response["response"] = request["request"];
 
-            return std::move(response);
+            return response;
         }
 };
 
@@ -52,33 +58,114 @@ class User {
         }
 };
 
+// Per-connection state, kept in a slab indexed by fd.
 struct Conn_ctx {
-    User *user;
-    App *app;
+    User *user = nullptr;
+    App *app = nullptr;
+    bool open = false;
+    bool closing = false;
+    bool writing = false;
+    bool negotiated = false;
+    bool framed = false;    // speaks recvbuf LENGTH frames
+    recvbuf rbuf;
+    std::string wbuf;       // output not yet accepted by the kernel
+    size_t wpos = 0;
 };
 
+// Routers of all worker threads, for the stats request.
+std::mutex routers_lock;
+std::vector<router *> routers;
+
+// Adapts an App to the router: the request is parsed into a json::value only
+// for handlers that want one.
+router::handler
+app_handler(std::shared_ptr<App> app)
+{
+    return [app](std::string_view request, std::string &out) {
+        out += app->process(json::parse(std::string(request))).str();
+    };
+}
+
+void
+append_latency(std::string &out, const histogram &h)
+{
+    char buf[256];
+
+    snprintf(buf, sizeof buf, "{ \"count\" : %llu, \"mean_ns\" : %llu, \"p50_ns\" : %llu, "
+        "\"p99_ns\" : %llu, \"p999_ns\" : %llu, \"max_ns\" : %llu }",
+        (unsigned long long) h.count(), (unsigned long long) h.mean(),
+        (unsigned long long) h.quantile(0.5), (unsigned long long) h.quantile(0.99),
+        (unsigned long long) h.quantile(0.999), (unsigned long long) h.maximum());
+    out += buf;
+}
+
+// Reports per-handler latency summed over all workers.  Every router has
+// the same routes in the same order.
+void
+stats(std::string_view, std::string &out)
+{
+    std::lock_guard<std::mutex> lock(routers_lock);
+    const auto &names = routers.front()->all();
+    uint64_t unknown = 0;
+
+    for (router *r : routers)
+        unknown += r->unknown_requests();
+    out += "{ \"response\" : \"stats\", \"unknown\" : " + std::to_string(unknown)
+        + ", \"handlers\" : { ";
+    for (size_t i = 0; i < names.size(); ++i) {
+        std::unique_ptr<histogram> sum(new histogram());
+        for (router *r : routers)
+            sum->merge(r->all()[i]->latency);
+        if (i != 0)
+            out += ", ";
+        out += "\"" + names[i]->name + "\" : ";
+        append_latency(out, *sum);
+    }
+    out += " } }";
+}
+
+void
+add_routes(router &r)
+{
+    r.add("hello", [](std::string_view, std::string &out) {
+        out += "{ \"response\" : \"hello\" }";
+    });
+    r.add("echo", app_handler(std::make_shared<Echoer>()));
+    r.add("stats", stats);
+}
+
 int
 main(int argc, char **argv)
 {
     int         ch;
     unsigned short     port = DEFAULT_PORT;
+    bool         use_epoll = false;
+    int         nthreads = 1;
     extern char    *optarg;
 
-    while ((ch = getopt(argc, argv, "hp:")) != -1) {
+    while ((ch = getopt(argc, argv, "Ehp:t:")) != -1) {
         switch (ch) {
+        case 'E':
+            use_epoll = true;
+            break;
         case 'h':
             usage();
             return 0;
         case 'p':
             port = atoi(optarg);
             break;
+        case 't':
+            nthreads = atoi(optarg);
+            if (nthreads < 1)
+                errx(1, "invalid number of threads: %s", optarg);
+            break;
         default:
             usage();
             return 1;
         }
     }
 
-    server(port);
+    server(port, use_epoll, nthreads);
 
     return 0;
 }
@@ -86,91 +173,228 @@ main(int argc, char **argv)
 void
 usage(void)
 {
-    fprintf(stderr, "usage: server [-p <port>]\n"
-        "Default port is 1234.\n");
+    fprintf(stderr, "usage: server [-E] [-p <port>] [-t <threads>]\n"
+        "Default port is 1234.  -E uses epoll instead of poll.\n"
+        "-t runs <threads> event loops, each with its own SO_REUSEPORT listener.\n");
 }
 
 void
-setnonblock(int fd)
+flush(std::vector<Conn_ctx> &conns, poller &p, int fd)
 {
-    if (fcntl(fd, F_SETFD, O_NONBLOCK) == -1)
-        err(1, "setnonblock: fcntl");
+    Conn_ctx &c = conns[fd];
+    ssize_t nwrite;
+
+    while (c.wpos < c.wbuf.size()) {
+        nwrite = write(fd, c.wbuf.data() + c.wpos, c.wbuf.size() - c.wpos);
+        if (nwrite == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                warn("write");
+                c.closing = true;
+                return;
+            }
+            if (!c.writing) {
+                c.writing = true;
+                p.want_write(fd, true);
+            }
+            return;
+        }
+        c.wpos += nwrite;
+    }
+    c.wbuf.clear();
+    c.wpos = 0;
+    if (c.writing) {
+        c.writing = false;
+        p.want_write(fd, false);
+    }
 }
 
 void
-server(unsigned short port)
+send_msg(std::vector<Conn_ctx> &conns, poller &p, int fd, const std::string &msg)
+{
+    Conn_ctx &c = conns[fd];
+    char hdr[recvbuf::hdr_size];
+
+    if (c.framed) {
+        recvbuf::put_header(hdr, msg.size());
+        c.wbuf.append(hdr, sizeof hdr);
+        c.wbuf += msg;
+    } else {
+        c.wbuf += msg;
+        c.wbuf += '\n';
+    }
+    if (!c.writing)
+        flush(conns, p, fd);
+}
+
+int
+listen_port(unsigned short port, bool reuse_port)
 {
     int             s;
-    int             conn;
+    int             on = 1;
     struct sockaddr_in     sa;
-    struct             pfds;
-    int             npoll;
-    std::vector<pollfd>     pfds;
-    std::map<int, recvbuf>     rbufs;
 
-    s = socket(AF_INET, SOCK_STREAM, 0);
+    s = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (s == -1)
         err(1, "socket");
-    setnonblock(s);
+    if (reuse_port && setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof on) == -1)
+        err(1, "setsockopt: SO_REUSEPORT");
     memset(&sa, 0, sizeof sa);
     sa.sin_family = AF_INET;
     sa.sin_port = htons(port);
     sa.sin_addr.s_addr = htonl(INADDR_ANY);
     if (bind(s, (struct sockaddr *) &sa, sizeof sa) == -1)
         err(1, "bind");
-    if (listen(s, 0) == -1)
+    if (listen(s, LISTEN_BACKLOG) == -1)
         err(1, "listen");
 
-    std::clog << "listening on port " << port << std::endl;
+    return s;
+}
+
+// The first byte a client sends decides its framing for good.  A client
+// asking for LENGTH frames gets the hello byte back.
+void
+negotiate(std::vector<Conn_ctx> &conns, poller &p, int fd)
+{
+    Conn_ctx &c = conns[fd];
+    std::string_view head(c.rbuf.peek());
+
+    if (head.empty())
+        return;
+    c.negotiated = true;
+    if (head[0] != recvbuf::framing_hello)
+        return;
+    c.rbuf.skip(1);
+    c.rbuf.set_framing(recvbuf::LENGTH);
+    c.framed = true;
+    c.wbuf += recvbuf::framing_hello;
+    if (!c.writing)
+        flush(conns, p, fd);
+}
 
-    pfds.push_back({ s, POLLIN });
+// Accepts every pending connection.  The listener is level-triggered, so if
+// this stops early (e.g. out of descriptors) the next wait reports it again.
+void
+accept_all(int s, poller &p, std::vector<Conn_ctx> &conns)
+{
+    int             conn;
 
-    while ((npoll = poll(pfds.data(), pfds.size(), POLL_TIMEOUT)) != -1) {
-        if (pfds[0].revents & POLLIN) {
-            conn = accept(s, NULL, NULL);
-            if (conn == -1) {
-                warn("accept");
+    for ( ;; ) {
+        conn = accept4(s, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (conn == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
                 continue;
-            }
-            std::clog << "accepted a new connection, fd=" << conn << std::endl;
-            setnonblock(conn);
-            pfds.push_back({ conn, POLLIN });
-            continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                warn("accept4");
+            return;
         }
+        std::clog << "accepted a new connection, fd=" << conn << std::endl;
+        if ((size_t) conn >= conns.size())
+            conns.resize(conn + 1);
+        conns[conn].open = true;
+        p.add(conn);
+    }
+}
 
-        std::vector<int> closed;
-        for (pollfd *p = pfds.data() + 1; p < pfds.data() + pfds.size(); ++p) {
-            std::clog << pfds.size() << " open fds" << std::endl;
-            if (p->revents & POLLIN) {
-                std::clog << "POLLIN occured for fd " << p->fd << std::endl;
-                recvbuf &rbuf = rbufs[p->fd];
-                if (rbuf.read(p->fd) == 0)
-                    goto close;
+// Event loop of one thread.  Connections stay on the thread whose listener
+// accepted them, so workers share nothing.
+void
+worker(int s, bool use_epoll)
+{
+    std::unique_ptr<poller>     p(make_poller(use_epoll));
+    std::vector<pollev>     evs;
+    std::vector<Conn_ctx>     conns;
+    std::vector<int>     closed;
+    std::string     scratch;
+    std::string     response;
+    router     routes;
+
+    add_routes(routes);
+    {
+        std::lock_guard<std::mutex> lock(routers_lock);
+        routers.push_back(&routes);
+    }
+
+    p->add(s, false);
+
+    for ( ;; ) {
+        p->wait(evs, POLL_TIMEOUT);
+
+        for (const pollev &ev : evs) {
+            if (ev.fd == s) {
+                accept_all(s, *p, conns);
+                continue;
+            }
+
+            Conn_ctx &c = conns[ev.fd];
+            if (!c.open || c.closing)
+                continue;
+            if (ev.out)
+                flush(conns, *p, ev.fd);
+            if (ev.in) {
+                recvbuf &rbuf = c.rbuf;
+                try {
+                    rbuf.read(ev.fd);
+                } catch (const std::runtime_error &e) {
+                    warnx("read: fd %d: %s", ev.fd, e.what());
+                    closed.push_back(ev.fd);
+                    continue;
+                }
+                if (!c.negotiated)
+                    negotiate(conns, *p, ev.fd);
                 while (rbuf.has_msg()) {
-                    json::value request(json::parse(rbuf.pop_msg()));
-                    if (request["request"] == "hello") {
-                        std::clog << "this is a hello request" << std::endl;
+                    std::string_view request(rbuf.pop_msg());
+                    std::string_view name;
+                    response.clear();
+                    // Answer even a bad request, so that clients matching
+                    // pipelined responses in order stay in step.
+                    if (!json_get_string(request, "request", scratch, name)) {
+                        std::clog << ev.fd << ": malformed request" << std::endl;
+                        response = "{ \"response\" : \"error\", \"errmsg\" : \"Malformed request\" }";
+                    } else {
+                        try {
+                            if (!routes.dispatch(name, request, response))
+                                response = "{ \"response\" : \"error\", \"errmsg\" : \"Unknown request\" }";
+                        } catch (const json::parse_error &e) {
+                            response = "{ \"response\" : \"error\", \"errmsg\" : \"Malformed request\" }";
+                        }
                     }
-                    std::cout << p->fd << ": " << request.str() << std::endl;
+                    if (!response.empty())
+                        send_msg(conns, *p, ev.fd, response);
                 }
-            } else if (p->revents & ~POLLIN) {
-                std::clog << "not POLLIN occured for fd " << p->fd << std::endl;
-close:
-                if (close(p->fd) == -1)
-                    warn("close");
-                closed.push_back(p->fd);
+                if (rbuf.eof())
+                    c.closing = true;
+            } else if (ev.hup) {
+                std::clog << "not POLLIN occured for fd " << ev.fd << std::endl;
+                c.closing = true;
             }
+            if (c.closing)
+                closed.push_back(ev.fd);
         }
 
         for (auto fd : closed) {
             std::clog << "erasing all traces of fd " << fd << std::endl;
-            rbufs.erase(fd);
-            pfds.erase(std::find_if(pfds.begin(), pfds.end(), [fd](const pollfd &p) { return p.fd == fd; }));
+            p->del(fd);
+            if (close(fd) == -1)
+                warn("close");
+            conns[fd] = Conn_ctx();
         }
+        closed.clear();
     }
-    if (npoll < 0)
-        err(1, "server: poll");
 }
 
+void
+server(unsigned short port, bool use_epoll, int nthreads)
+{
+    std::vector<std::thread>     workers;
 
+    std::clog << "listening on port " << port << " with " << nthreads
+        << (nthreads == 1 ? " thread" : " threads") << " using "
+        << (use_epoll ? "epoll" : "poll") << std::endl;
 
+    for (int i = 0; i < nthreads; ++i)
+        workers.emplace_back(worker, listen_port(port, nthreads > 1), use_epoll);
+    for (auto &t : workers)
+        t.join();
+}
@@ -19,6 +19,10 @@ int main(int argc, char **argv) {
         recvbuf buf;
 
         buf.read(fd);
+        if (!buf.peek().empty() && buf.peek()[0] == recvbuf::framing_hello) {
+            buf.skip(1);
+            buf.set_framing(recvbuf::LENGTH);
+        }
         while (buf.has_msg())
             std::cout << "str: " << buf.pop_msg() << std::endl;
         close(fd);
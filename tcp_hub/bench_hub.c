@@ -0,0 +1,150 @@
+#define _POSIX_C_SOURCE 200809L	/* clock_gettime(2) */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <err.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#include <xmem.h>
+
+/*
+ * Measures tcp_hub throughput over loopback: connects n_peers clients, has
+ * the first one send megs MiB as fast as the hub takes it and waits until
+ * every other client has received all of it.  Run it against "tcp_hub port"
+ * and "tcp_hub -s port" to compare the read/write and splice relays.
+ */
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: bench_hub [-m megs] [-n peers] port\n");
+}
+
+static double
+now(void)
+{
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+connect_hub(int port)
+{
+	int			 s;
+	struct sockaddr_in	 sa;
+
+	s = socket(AF_INET, SOCK_STREAM, 0);
+	if (s == -1)
+		err(1, "socket");
+	memset(&sa, 0, sizeof sa);
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons((short) port);
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (connect(s, (struct sockaddr *) &sa, sizeof sa) != 0)
+		err(1, "connect");
+	if (fcntl(s, F_SETFL, O_NONBLOCK) == -1)
+		err(1, "fcntl");
+	return s;
+}
+
+int
+main(int argc, char **argv)
+{
+	int		 ch;
+	int		 port;
+	size_t		 n_peers = 2;
+	size_t		 total = 256 * 1024 * 1024;
+	size_t		 sent = 0, received = 0, i;
+	struct pollfd	*pfds;
+	char		*buf;
+	size_t		 bufsize = 256 * 1024;
+	ssize_t		 n;
+	double		 t0, t;
+
+	while ((ch = getopt(argc, argv, "m:n:")) != -1) {
+		switch (ch) {
+		case 'm':
+			total = strtoul(optarg, NULL, 10) * 1024 * 1024;
+			break;
+		case 'n':
+			n_peers = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc < 1 || n_peers < 2) {
+		usage();
+		return 1;
+	}
+	port = atoi(argv[0]);
+
+	signal(SIGPIPE, SIG_IGN);
+	buf = xrealloc(NULL, bufsize);
+	memset(buf, 'x', bufsize);
+	pfds = xrealloc(NULL, sizeof(*pfds) * n_peers);
+	for (i = 0; i < n_peers; ++i) {
+		pfds[i].fd = connect_hub(port);
+		pfds[i].events = i == 0 ? POLLOUT : POLLIN;
+	}
+	/* Give the hub a moment to accept everyone before data flows. */
+	poll(NULL, 0, 200);
+
+	t0 = now();
+	while (received < total * (n_peers - 1)) {
+		if (poll(pfds, n_peers, 10 * 1000) <= 0)
+			errx(1, "stalled after %zu of %zu bytes received", received,
+			    total * (n_peers - 1));
+		if (pfds[0].revents & POLLOUT) {
+			while (sent < total) {
+				n = write(pfds[0].fd, buf, total - sent < bufsize ? total - sent : bufsize);
+				if (n == -1) {
+					if (errno == EAGAIN || errno == EWOULDBLOCK)
+						break;
+					err(1, "write");
+				}
+				sent += n;
+			}
+			if (sent == total)
+				pfds[0].events = 0;
+		}
+		for (i = 1; i < n_peers; ++i) {
+			if (!(pfds[i].revents & (POLLIN | POLLHUP)))
+				continue;
+			while ((n = read(pfds[i].fd, buf, bufsize)) > 0)
+				received += n;
+			if (n == 0)
+				errx(1, "peer %zu was disconnected by the hub", i);
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				err(1, "read");
+		}
+	}
+	t = now() - t0;
+
+	printf("peers=%zu bytes_sent=%zu bytes_delivered=%zu seconds=%.3f "
+	    "in_GB/s=%.3f out_GB/s=%.3f\n", n_peers, sent, received, t,
+	    sent / t / 1e9, received / t / 1e9);
+
+	for (i = 0; i < n_peers; ++i)
+		close(pfds[i].fd);
+	free(pfds);
+	free(buf);
+
+	return 0;
+}
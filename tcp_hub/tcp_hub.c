@@ -1,11 +1,16 @@
+#define _GNU_SOURCE	/* splice(2), tee(2), F_SETPIPE_SZ, accept4(2) */
+
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <err.h>
 #include <poll.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,112 +19,888 @@
 
 #include <xmem.h>
 
+/*
+ * Everything a peer sends is relayed to every other peer.
+ *
+ * By default data is read into user space and written out again.  With -s
+ * it is spliced from the sender's socket into a pipe, tee'd into a pipe per
+ * recipient and spliced from there into the recipient's socket, so the
+ * payload is never copied through user space.
+ *
+ * Output a recipient's socket does not take right away stays pending, in
+ * obuf or in the recipient's pipe, and is flushed when the socket becomes
+ * writable.  While any peer has more than highwater bytes pending the hub
+ * stops reading, so a slow reader slows the senders down instead of making
+ * the hub spin or buffer without bound.
+ *
+ * Peers live in a table that doubles its capacity when full and removes an
+ * entry by moving the last one into its place, so connecting and
+ * disconnecting cost O(1) however many peers there are.  With -e the hub
+ * waits with epoll and only looks at the peers that are ready.
+ *
+ * With -p the stream is instead made of frames, each a 4-byte big-endian
+ * length of what follows, a type byte, a channel name length byte, the
+ * channel name and, for publications, the payload.  Peers subscribe ('S')
+ * and unsubscribe ('U') to channels, and a publication ('P') is forwarded
+ * as is to the other subscribers of its channel only.
+ */
+
+#define SPLICE_CHUNK	(64 * 1024)
+#define MAX_EVENTS	1024
+
+#define FRAME_HDR	4
+#define MAX_FRAME	(64 * 1024)
+#define FRAME_SUB	'S'
+#define FRAME_UNSUB	'U'
+#define FRAME_PUB	'P'
+
+struct channel {
+	struct channel	*next;		/* in the same hash bucket */
+	uint32_t	 hash;
+	char		*name;
+	size_t		 len;
+	int		*subs;		/* fds of the subscribers */
+	size_t		 n_subs;
+	size_t		 size_subs;
+};
+
+/* Channels by name, chained, with the bucket count doubled at load 1. */
+struct chanmap {
+	struct channel	**buckets;
+	size_t		 n_buckets;
+	size_t		 n;
+};
+
+struct peer {
+	int		 fd;
+	int		 dead;
+	int		 congested;
+	short		 events;	/* POLLIN/POLLOUT currently waited for */
+	/* Copy mode: output pending in obuf[opos, olen). */
+	char		*obuf;
+	size_t		 opos;
+	size_t		 olen;
+	size_t		 osize;
+	/* Splice mode: output pending in the pipe. */
+	int		 pipe[2];
+	size_t		 pending;
+	/* Framed mode: input not yet parsed and subscriptions. */
+	char		*ibuf;
+	size_t		 ilen;
+	size_t		 isize;
+	struct channel	**chans;
+	size_t		 n_chans;
+	size_t		 size_chans;
+};
+
+struct hub {
+	int		 s;
+	int		 epfd;		/* -1 when polling */
+	struct peer	*peers;		/* peers[0, n_peers) */
+	struct pollfd	*pfds;		/* pfds[0] is s, pfds[i + 1] is peers[i] */
+	size_t		 n_peers;
+	size_t		 size;		/* capacity of peers and pfds */
+	size_t		*slots;		/* fd -> index into peers */
+	size_t		 n_slots;
+	int		*dead;		/* fds of peers to remove after this round */
+	size_t		 n_dead;
+	size_t		 n_congested;
+	struct chanmap	 chans;
+};
+
+static int	 verbose;
+static int	 use_splice;
+static int	 use_epoll;
+static int	 use_frames;
+static size_t	 highwater = 512 * 1024;
+static int	 hub_pipe[2] = { -1, -1 };
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: tcp_hub [-epsv] [-w highwater] port\n"
+	    "  -e waits with epoll(7) instead of poll(2)\n"
+	    "  -p routes framed publications to channel subscribers\n"
+	    "  -s relays with splice(2)/tee(2) instead of read(2)/write(2)\n"
+	    "  -v prints every chunk relayed\n"
+	    "  -w stops reading while a peer has more than highwater bytes pending\n");
+}
+
+static size_t
+pending(const struct peer *p)
+{
+	return use_splice ? p->pending : p->olen - p->opos;
+}
+
+static int
+congested(const struct peer *p)
+{
+	return !p->dead && pending(p) > highwater;
+}
+
+/*
+ * Up to highwater plus one chunk can be pending in a pipe, so its capacity
+ * is raised to twice highwater; unprivileged users are limited to
+ * /proc/sys/fs/pipe-max-size.
+ */
+static void
+make_pipe(int fds[2])
+{
+	static int	 warned;
+
+	if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) == -1)
+		err(1, "pipe2");
+	if (fcntl(fds[1], F_SETPIPE_SZ, (int) (2 * highwater)) == -1 && !warned) {
+		warn("fcntl: F_SETPIPE_SZ");
+		warned = 1;
+	}
+}
+
+static void
+init_peer(struct peer *p, int fd, int with_pipe)
+{
+	memset(p, 0, sizeof *p);
+	p->fd = fd;
+	p->pipe[0] = p->pipe[1] = -1;
+	if (with_pipe)
+		make_pipe(p->pipe);
+}
+
+static void
+free_peer(struct peer *p)
+{
+	close(p->fd);
+	if (p->pipe[0] != -1) {
+		close(p->pipe[0]);
+		close(p->pipe[1]);
+	}
+	free(p->obuf);
+	free(p->ibuf);
+	free(p->chans);
+}
+
+/* FNV-1a. */
+static uint32_t
+hash_name(const char *name, size_t len)
+{
+	uint32_t	 h = 2166136261u;
+	size_t		 i;
+
+	for (i = 0; i < len; ++i) {
+		h ^= (unsigned char) name[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static struct channel **
+chan_slot(struct chanmap *m, const char *name, size_t len, uint32_t hash)
+{
+	struct channel	**cp;
+
+	if (m->n_buckets == 0)
+		return NULL;
+	for (cp = &m->buckets[hash & (m->n_buckets - 1)]; *cp != NULL; cp = &(*cp)->next)
+		if ((*cp)->hash == hash && (*cp)->len == len && memcmp((*cp)->name, name, len) == 0)
+			return cp;
+	return cp;
+}
+
+static struct channel *
+chan_find(struct chanmap *m, const char *name, size_t len)
+{
+	struct channel	**cp = chan_slot(m, name, len, hash_name(name, len));
+
+	return cp == NULL ? NULL : *cp;
+}
+
+static void
+chan_grow(struct chanmap *m)
+{
+	struct channel	**old = m->buckets, *c, *next;
+	size_t		 n_old = m->n_buckets, i;
+
+	m->n_buckets = n_old == 0 ? 64 : n_old * 2;
+	m->buckets = xrealloc(NULL, sizeof(*m->buckets) * m->n_buckets);
+	memset(m->buckets, 0, sizeof(*m->buckets) * m->n_buckets);
+	for (i = 0; i < n_old; ++i) {
+		for (c = old[i]; c != NULL; c = next) {
+			next = c->next;
+			c->next = m->buckets[c->hash & (m->n_buckets - 1)];
+			m->buckets[c->hash & (m->n_buckets - 1)] = c;
+		}
+	}
+	free(old);
+}
+
+static struct channel *
+chan_get(struct chanmap *m, const char *name, size_t len)
+{
+	struct channel	**cp, *c;
+	uint32_t	 hash = hash_name(name, len);
+
+	if (m->n >= m->n_buckets)
+		chan_grow(m);
+	cp = chan_slot(m, name, len, hash);
+	if (*cp != NULL)
+		return *cp;
+	c = xrealloc(NULL, sizeof *c);
+	memset(c, 0, sizeof *c);
+	c->hash = hash;
+	c->len = len;
+	c->name = xrealloc(NULL, len == 0 ? 1 : len);
+	memcpy(c->name, name, len);
+	*cp = c;
+	++m->n;
+	return c;
+}
+
+static void
+chan_drop(struct chanmap *m, struct channel *c)
+{
+	struct channel	**cp = chan_slot(m, c->name, c->len, c->hash);
+
+	*cp = c->next;
+	--m->n;
+	free(c->name);
+	free(c->subs);
+	free(c);
+}
+
+static void
+subscribe(struct peer *p, struct chanmap *m, const char *name, size_t len)
+{
+	struct channel	*c = chan_get(m, name, len);
+	size_t		 k;
+
+	for (k = 0; k < p->n_chans; ++k)
+		if (p->chans[k] == c)
+			return;
+	if (c->n_subs == c->size_subs) {
+		c->size_subs = c->size_subs == 0 ? 4 : c->size_subs * 2;
+		c->subs = xrealloc(c->subs, sizeof(*c->subs) * c->size_subs);
+	}
+	c->subs[c->n_subs++] = p->fd;
+	if (p->n_chans == p->size_chans) {
+		p->size_chans = p->size_chans == 0 ? 4 : p->size_chans * 2;
+		p->chans = xrealloc(p->chans, sizeof(*p->chans) * p->size_chans);
+	}
+	p->chans[p->n_chans++] = c;
+}
+
+/* Removes p from p->chans[k], dropping the channel once nobody is left. */
+static void
+unsubscribe_at(struct peer *p, struct chanmap *m, size_t k)
+{
+	struct channel	*c = p->chans[k];
+	size_t		 j;
+
+	for (j = 0; j < c->n_subs; ++j) {
+		if (c->subs[j] == p->fd) {
+			c->subs[j] = c->subs[--c->n_subs];
+			break;
+		}
+	}
+	p->chans[k] = p->chans[--p->n_chans];
+	if (c->n_subs == 0)
+		chan_drop(m, c);
+}
+
+static void
+unsubscribe(struct peer *p, struct chanmap *m, const char *name, size_t len)
+{
+	struct channel	*c = chan_find(m, name, len);
+	size_t		 k;
+
+	for (k = 0; c != NULL && k < p->n_chans; ++k) {
+		if (p->chans[k] == c) {
+			unsubscribe_at(p, m, k);
+			return;
+		}
+	}
+}
+
+/* Tells the backend what to wait for on peers[i]. */
+static void
+set_events(struct hub *h, size_t i)
+{
+	struct peer		*p = &h->peers[i];
+	struct epoll_event	 ev;
+	short			 events;
+
+	events = (h->n_congested == 0 ? POLLIN : 0) | (pending(p) > 0 ? POLLOUT : 0);
+	if (events == p->events)
+		return;
+	p->events = events;
+	if (h->epfd == -1) {
+		h->pfds[i + 1].events = events;
+		return;
+	}
+	memset(&ev, 0, sizeof ev);
+	ev.events = (events & POLLIN ? EPOLLIN : 0) | (events & POLLOUT ? EPOLLOUT : 0);
+	ev.data.fd = p->fd;
+	if (epoll_ctl(h->epfd, EPOLL_CTL_MOD, p->fd, &ev) == -1)
+		err(1, "epoll_ctl");
+}
+
+/*
+ * Call after peers[i]'s pending output changed.  Input is switched off for
+ * everybody when the first peer gets congested and back on when the last
+ * one recovers, the only times all peers are visited.
+ */
+static void
+refresh(struct hub *h, size_t i)
+{
+	struct peer	*p = &h->peers[i];
+	size_t		 before = h->n_congested, j;
+
+	if (congested(p) != p->congested) {
+		p->congested = !p->congested;
+		h->n_congested += p->congested ? 1 : -1;
+	}
+	if ((before == 0) != (h->n_congested == 0))
+		for (j = 0; j < h->n_peers; ++j)
+			set_events(h, j);
+	else
+		set_events(h, i);
+}
+
 static void
-pump(struct pollfd *pfds, size_t n_pfds)
+kill_peer(struct hub *h, size_t i)
 {
-	size_t			 i, j;
-	ssize_t			 n_read, n_write;
+	if (h->peers[i].dead)
+		return;
+	h->peers[i].dead = 1;
+	refresh(h, i);
+	h->dead = xrealloc(h->dead, sizeof(*h->dead) * (h->n_dead + 1));
+	h->dead[h->n_dead++] = h->peers[i].fd;
+}
+
+static void
+add_peer(struct hub *h, int fd)
+{
+	struct epoll_event	 ev;
+	size_t			 i;
+
+	if (h->n_peers == h->size) {
+		h->size = h->size == 0 ? 64 : h->size * 2;
+		h->peers = xrealloc(h->peers, sizeof(*h->peers) * h->size);
+		h->pfds = xrealloc(h->pfds, sizeof(*h->pfds) * (h->size + 1));
+	}
+	if ((size_t) fd >= h->n_slots) {
+		while ((size_t) fd >= h->n_slots)
+			h->n_slots = h->n_slots == 0 ? 1024 : h->n_slots * 2;
+		h->slots = xrealloc(h->slots, sizeof(*h->slots) * h->n_slots);
+	}
+
+	i = h->n_peers++;
+	h->slots[fd] = i;
+	init_peer(&h->peers[i], fd, use_splice);
+	h->peers[i].events = h->n_congested == 0 ? POLLIN : 0;
+	if (h->epfd == -1) {
+		h->pfds[i + 1].fd = fd;
+		h->pfds[i + 1].events = h->peers[i].events;
+		h->pfds[i + 1].revents = 0;
+		return;
+	}
+	memset(&ev, 0, sizeof ev);
+	ev.events = h->peers[i].events & POLLIN ? EPOLLIN : 0;
+	ev.data.fd = fd;
+	if (epoll_ctl(h->epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+		err(1, "epoll_ctl");
+}
+
+/* Closes the peer and moves the last one into its slot. */
+static void
+del_peer(struct hub *h, int fd)
+{
+	size_t	 i = h->slots[fd], last = h->n_peers - 1;
+
+	printf("shutting down a socket...\n");
+	shutdown(fd, SHUT_RDWR);
+	while (h->peers[i].n_chans > 0)
+		unsubscribe_at(&h->peers[i], &h->chans, 0);
+	free_peer(&h->peers[i]);	/* closing fd also drops it from epoll */
+	if (i != last) {
+		h->peers[i] = h->peers[last];
+		h->pfds[i + 1] = h->pfds[last + 1];
+		h->slots[h->peers[i].fd] = i;
+	}
+	--h->n_peers;
+}
+
+/*
+ * Writes as much pending output as the socket takes.  Returns -1 if the
+ * peer has to go.
+ */
+static int
+flush_peer(struct peer *p)
+{
+	ssize_t	 n;
+
+	while (pending(p) > 0) {
+		if (use_splice)
+			n = splice(p->pipe[0], NULL, p->fd, NULL, p->pending,
+			    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		else
+			n = write(p->fd, p->obuf + p->opos, p->olen - p->opos);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			if (errno != EPIPE && errno != ECONNRESET)
+				warn(use_splice ? "splice" : "write");
+			return -1;
+		}
+		if (use_splice) {
+			p->pending -= n;
+		} else {
+			p->opos += n;
+			if (p->opos == p->olen)
+				p->opos = p->olen = 0;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Queues buf for p, writing straight to the socket if nothing is pending.
+ * Returns -1 if the peer has to go.
+ */
+static int
+send_copy(struct peer *p, const char *buf, size_t len)
+{
+	ssize_t	 n;
+
+	if (p->olen == 0) {
+		do n = write(p->fd, buf, len);
+		while (n == -1 && errno == EINTR);
+		if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+			if (errno != EPIPE && errno != ECONNRESET)
+				warn("write");
+			return -1;
+		}
+		if (n > 0) {
+			buf += n;
+			len -= n;
+		}
+	}
+	if (len == 0)
+		return 0;
+	if (p->olen + len > p->osize) {
+		if (p->opos > 0) {
+			memmove(p->obuf, p->obuf + p->opos, p->olen - p->opos);
+			p->olen -= p->opos;
+			p->opos = 0;
+		}
+		while (p->olen + len > p->osize)
+			p->osize = p->osize == 0 ? 16 * 1024 : p->osize * 2;
+		p->obuf = xrealloc(p->obuf, p->osize);
+	}
+	memcpy(p->obuf + p->olen, buf, len);
+	p->olen += len;
+	return 0;
+}
+
+/* Drops len bytes from the front of a pipe. */
+static void
+discard(int fd, size_t len)
+{
+	char	 buf[4096];
+	ssize_t	 n;
+
+	while (len > 0) {
+		n = read(fd, buf, len < sizeof buf ? len : sizeof buf);
+		if (n <= 0)
+			break;
+		len -= n;
+	}
+}
+
+/*
+ * Relays what peers[i] sent until it has nothing more or a recipient gets
+ * congested.
+ */
+static void
+pump_copy(struct hub *h, size_t i)
+{
+	size_t			 j;
+	ssize_t			 n_read;
 	char			 buf[16 * 1024];
 	size_t			 bufsize = sizeof buf;
 
-	for (i = 0; i < n_pfds; ++i) {
-		if (pfds[i].revents & POLLIN) {
-			while ((n_read = read(pfds[i].fd, buf, bufsize)) > 0) {
-				printf("pumping %d bytes of data...\n", (int) n_read);
-				for (j = 0; j < n_pfds; ++j) {
-					if (j == i)
-						continue;
-					do n_write = write(pfds[j].fd, buf, n_read);
-					while (n_write == -1 && errno == EAGAIN);
-				}
+	while (h->n_congested == 0 && (n_read = read(h->peers[i].fd, buf, bufsize)) > 0) {
+		if (verbose)
+			printf("pumping %d bytes of data...\n", (int) n_read);
+		for (j = 0; j < h->n_peers; ++j) {
+			if (j == i || h->peers[j].dead)
+				continue;
+			if (send_copy(&h->peers[j], buf, n_read) == -1)
+				kill_peer(h, j);
+			else
+				refresh(h, j);
+		}
+	}
+	if (h->n_congested > 0)
+		return;
+	if (n_read == 0)
+		kill_peer(h, i);
+	else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+		warn("read");
+		kill_peer(h, i);
+	}
+}
+
+/* Forwards a whole frame to the other live subscribers of c. */
+static void
+publish(struct hub *h, size_t i, struct channel *c, const char *frame, size_t len)
+{
+	size_t		 k, j;
+
+	for (k = 0; k < c->n_subs; ++k) {
+		j = h->slots[c->subs[k]];
+		if (j == i || h->peers[j].dead)
+			continue;
+		if (send_copy(&h->peers[j], frame, len) == -1)
+			kill_peer(h, j);
+		else
+			refresh(h, j);
+	}
+}
+
+/*
+ * Handles the complete frames in peers[i].ibuf and keeps the rest.
+ * Returns -1 on a malformed frame.
+ */
+static int
+parse_frames(struct hub *h, size_t i)
+{
+	struct peer		*p = &h->peers[i];
+	const unsigned char	*f;
+	struct channel		*c;
+	size_t			 pos = 0, len, n_name;
+	int			 ret = 0;
+
+	while (p->ilen - pos >= FRAME_HDR) {
+		f = (const unsigned char *) p->ibuf + pos;
+		len = (size_t) f[0] << 24 | (size_t) f[1] << 16 | (size_t) f[2] << 8 | f[3];
+		if (len < 2 || len > MAX_FRAME) {
+			ret = -1;
+			break;
+		}
+		if (p->ilen - pos < FRAME_HDR + len)
+			break;
+		n_name = f[5];
+		if (2 + n_name > len) {
+			ret = -1;
+			break;
+		}
+		switch (f[4]) {
+		case FRAME_SUB:
+			subscribe(p, &h->chans, (const char *) f + 6, n_name);
+			break;
+		case FRAME_UNSUB:
+			unsubscribe(p, &h->chans, (const char *) f + 6, n_name);
+			break;
+		case FRAME_PUB:
+			c = chan_find(&h->chans, (const char *) f + 6, n_name);
+			if (verbose)
+				printf("publishing %d bytes to %d subscribers...\n",
+				    (int) (len - 2 - n_name), c == NULL ? 0 : (int) c->n_subs);
+			if (c != NULL)
+				publish(h, i, c, (const char *) f, FRAME_HDR + len);
+			break;
+		default:
+			ret = -1;
+			break;
+		}
+		if (ret == -1)
+			break;
+		pos += FRAME_HDR + len;
+	}
+	memmove(p->ibuf, p->ibuf + pos, p->ilen - pos);
+	p->ilen -= pos;
+	return ret;
+}
+
+/* Like pump_copy(), but routes whole frames by channel. */
+static void
+pump_frames(struct hub *h, size_t i)
+{
+	struct peer	*p;
+	ssize_t		 n_read;
+
+	for ( ;; ) {
+		if (h->n_congested > 0)
+			return;
+		p = &h->peers[i];
+		if (p->isize - p->ilen < 16 * 1024) {
+			p->isize = p->isize == 0 ? 32 * 1024 : p->isize * 2;
+			p->ibuf = xrealloc(p->ibuf, p->isize);
+		}
+		n_read = read(p->fd, p->ibuf + p->ilen, p->isize - p->ilen);
+		if (n_read <= 0)
+			break;
+		p->ilen += n_read;
+		if (parse_frames(h, i) == -1) {
+			printf("peer %d sent a malformed frame, disconnecting...\n", p->fd);
+			kill_peer(h, i);
+			return;
+		}
+	}
+	if (n_read == 0)
+		kill_peer(h, i);
+	else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+		warn("read");
+		kill_peer(h, i);
+	}
+}
+
+/*
+ * Like pump_copy().  Each chunk is tee'd into every recipient's pipe but
+ * the last, into whose pipe it is moved.  A recipient whose pipe cannot take
+ * the whole chunk would see a gap in the stream, so it is disconnected
+ * instead.
+ */
+static void
+pump_splice(struct hub *h, size_t i)
+{
+	struct peer		*peers = h->peers;
+	size_t			 j, last;
+	ssize_t			 n_read, n;
+	size_t			 left;
+
+	while (h->n_congested == 0) {
+		n_read = splice(peers[i].fd, NULL, hub_pipe[1], NULL, SPLICE_CHUNK,
+		    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (n_read == 0) {
+			kill_peer(h, i);
+			return;
+		}
+		if (n_read == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				warn("splice");
+				kill_peer(h, i);
+			}
+			return;
+		}
+		if (verbose)
+			printf("pumping %d bytes of data...\n", (int) n_read);
+
+		last = h->n_peers;
+		for (j = 0; j < h->n_peers; ++j)
+			if (j != i && !peers[j].dead)
+				last = j;
+		left = n_read;
+		for (j = 0; j < h->n_peers; ++j) {
+			if (j == i || peers[j].dead)
+				continue;
+			if (j == last)
+				n = splice(hub_pipe[0], NULL, peers[j].pipe[1], NULL, left,
+				    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			else
+				n = tee(hub_pipe[0], peers[j].pipe[1], left, SPLICE_F_NONBLOCK);
+			if (n > 0 && j == last)
+				left -= n;
+			if (n != n_read) {
+				printf("peer %d is too slow, disconnecting...\n", peers[j].fd);
+				kill_peer(h, j);
+				continue;
 			}
-			if (n_read < 0)
-				warn("read");
+			peers[j].pending += n;
+			if (flush_peer(&peers[j]) == -1)
+				kill_peer(h, j);
+			else
+				refresh(h, j);
 		}
+		discard(hub_pipe[0], left);
 	}
 }
 
 static void
-del_pfd(struct pollfd **pfds, size_t *n_pfds, size_t idx)
+handle(struct hub *h, size_t i, short revents)
 {
-	memmove(*pfds + idx, *pfds + idx + 1, sizeof(**pfds) * (*n_pfds - idx - 1));
-	*pfds = xrealloc(*pfds, sizeof(**pfds) * --(*n_pfds));
+	struct peer	*p = &h->peers[i];
+
+	if (p->dead)
+		return;
+	if (revents & POLLOUT) {
+		if (flush_peer(p) == -1) {
+			kill_peer(h, i);
+			return;
+		}
+		refresh(h, i);
+	}
+	if ((revents & POLLIN) && h->n_congested == 0) {
+		if (use_frames)
+			pump_frames(h, i);
+		else if (use_splice)
+			pump_splice(h, i);
+		else
+			pump_copy(h, i);
+	} else if ((revents & (POLLERR | POLLHUP)) && !(revents & POLLIN)) {
+		kill_peer(h, i);
+	}
 }
 
 static void
-close_erronous(struct pollfd **pfds, size_t *n_pfds)
+accept_peers(struct hub *h)
 {
-	size_t	 i;
+	int	 conn;
 
-	for (i = 1; i < *n_pfds; /* empty */) {
-		if ((*pfds)[i].revents & (POLLERR | POLLHUP)) {
-			printf("shutting down a socket...\n");
-			shutdown((*pfds)[i].fd, SHUT_RDWR);
-			del_pfd(pfds, n_pfds, i);
-		} else {
-			++i;
+	for ( ;; ) {
+		conn = accept4(h->s, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (conn == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				warn("accept4");
+			return;
 		}
+		if (verbose)
+			printf("accepted a new connection...\n");
+		add_peer(h, conn);
 	}
 }
 
+/* Waits for the next round of events and handles them. */
+static void
+wait_poll(struct hub *h)
+{
+	size_t	 i;
+
+	if (poll(h->pfds, h->n_peers + 1, -1) == -1) {
+		if (errno == EINTR)
+			return;
+		err(1, "poll");
+	}
+	/* Peers accepted below are past n and were not polled. */
+	for (i = 0; i < h->n_peers; ++i)
+		if (h->pfds[i + 1].revents != 0)
+			handle(h, i, h->pfds[i + 1].revents);
+	if (h->pfds[0].revents & POLLIN)
+		accept_peers(h);
+}
+
+static void
+wait_epoll(struct hub *h)
+{
+	struct epoll_event	 evs[MAX_EVENTS];
+	int			 n, k;
+	short			 revents;
+
+	n = epoll_wait(h->epfd, evs, MAX_EVENTS, -1);
+	if (n == -1) {
+		if (errno == EINTR)
+			return;
+		err(1, "epoll_wait");
+	}
+	for (k = 0; k < n; ++k) {
+		if (evs[k].data.fd == h->s) {
+			accept_peers(h);
+			continue;
+		}
+		revents = (evs[k].events & EPOLLIN ? POLLIN : 0)
+		    | (evs[k].events & EPOLLOUT ? POLLOUT : 0)
+		    | (evs[k].events & EPOLLERR ? POLLERR : 0)
+		    | (evs[k].events & EPOLLHUP ? POLLHUP : 0);
+		handle(h, h->slots[evs[k].data.fd], revents);
+	}
+}
 
 static void
 tcp_hub(int port)
 {
-	int			 s;
+	struct hub		 h;
 	struct sockaddr_in	 sa;
-	struct sockaddr_storage	 sa_stor;
-	socklen_t		 sa_stor_size;
-	int			 conn;
-	struct pollfd		*pfds = NULL;
-	size_t			 n_pfds = 0;
-
-	s = socket(AF_INET, SOCK_STREAM, 0);
-	if (s == -1)
+	struct epoll_event	 ev;
+	size_t			 k;
+
+	memset(&h, 0, sizeof h);
+	h.s = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (h.s == -1)
 		err(1, "socket");
 	memset(&sa, 0, sizeof sa);
 	sa.sin_family = AF_INET;
 	sa.sin_port = htons((short) port);
 	sa.sin_addr.s_addr = INADDR_ANY;
-	if (bind(s, (struct sockaddr *) &sa, sizeof sa) != 0)
+	if (bind(h.s, (struct sockaddr *) &sa, sizeof sa) != 0)
 		err(1, "bind");
 	printf("listening...\n");
-	if (listen(s, INT_MAX) != 0)
+	if (listen(h.s, INT_MAX) != 0)
 		err(1, "listen");
+	if (use_splice)
+		make_pipe(hub_pipe);
+
+	h.pfds = xrealloc(NULL, sizeof(*h.pfds));
+	h.pfds[0].fd = h.s;
+	h.pfds[0].events = POLLIN;
+	h.epfd = -1;
+	if (use_epoll) {
+		h.epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (h.epfd == -1)
+			err(1, "epoll_create1");
+		memset(&ev, 0, sizeof ev);
+		ev.events = EPOLLIN;
+		ev.data.fd = h.s;
+		if (epoll_ctl(h.epfd, EPOLL_CTL_ADD, h.s, &ev) == -1)
+			err(1, "epoll_ctl");
+	}
 
-	pfds = xrealloc(pfds, sizeof(*pfds) * ++n_pfds);
-	pfds[0].fd = s;
-	pfds[0].events = POLLIN;
 	for ( ;; ) {
-		if (poll(pfds, n_pfds, -1) == -1)
-			err(1, "poll");
-		if (pfds[0].revents & POLLIN) { /* received a new connection */
-			conn = accept(s, (struct sockaddr *) &sa_stor, &sa_stor_size);
-			if (conn == -1)
-				err(1, "accept");
-			printf("accepted a new connection...\n");
-			if (fcntl(conn, F_SETFL, O_NONBLOCK) == -1)
-				err(1, "fcntl");
-			pfds = xrealloc(pfds, sizeof(*pfds) * ++n_pfds);
-			pfds[n_pfds - 1].fd = conn;
-			pfds[n_pfds - 1].events = POLLIN;
-		}
-		pump(pfds + 1, n_pfds - 1);
-		close_erronous(&pfds, &n_pfds);
+		if (use_epoll)
+			wait_epoll(&h);
+		else
+			wait_poll(&h);
+		for (k = 0; k < h.n_dead; ++k)
+			del_peer(&h, h.dead[k]);
+		h.n_dead = 0;
 	}
 }
 
 int
 main(int argc, char **argv)
 {
+	int	 ch;
 	int	 port;
 
-	if (argc < 2)
+	while ((ch = getopt(argc, argv, "epsvw:")) != -1) {
+		switch (ch) {
+		case 'e':
+			use_epoll = 1;
+			break;
+		case 'p':
+			use_frames = 1;
+			break;
+		case 's':
+			use_splice = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'w':
+			highwater = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc < 1) {
+		usage();
 		return 1;
+	}
+	if (use_frames && use_splice)
+		errx(1, "-p needs to look at the data and cannot be combined with -s");
 
-	port = atoi(argv[1]);
+	signal(SIGPIPE, SIG_IGN);
+	port = atoi(argv[0]);
 	tcp_hub(port);
 
 	return 0;
 }
-